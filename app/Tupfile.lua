@@ -3,11 +3,35 @@ DoOnce('app/ren-script/Tupfile.lua')
 DoOnce('app/ren-translation/Tupfile.lua')
 DoOnce('app/ren-gtk/Tupfile.lua')
 
-local SharedSources = Item():Include 'image.cxx':Include 'settings.cxx'
+local SharedSources = Item():Include 'image.cxx':Include 'settings.cxx':Include 'workerpool.cxx':Include 'simd.cxx'
+	:Include 'compression.cxx'
 ImageObject = Define.Object
 {
 	Source = Item 'image.cxx',
 }
+WorkerPoolObject = Define.Object
+{
+	Source = Item 'workerpool.cxx',
+}
+SIMDObject = Define.Object
+{
+	Source = Item 'simd.cxx',
+}
+local CompressionFlags = ''
+local CompressionLinkFlags = ''
+if tup.getconfig('ZSTD') == 'true' then
+	CompressionFlags = CompressionFlags .. ' -DHAVE_ZSTD'
+	CompressionLinkFlags = CompressionLinkFlags .. ' -lzstd'
+end
+if tup.getconfig('LZ4') == 'true' then
+	CompressionFlags = CompressionFlags .. ' -DHAVE_LZ4'
+	CompressionLinkFlags = CompressionLinkFlags .. ' -llz4'
+end
+CompressionObject = Define.Object
+{
+	Source = Item 'compression.cxx',
+	BuildFlags = CompressionFlags
+}
 SettingsObject = Define.Object
 {
 	Source = Item 'settings.cxx',
@@ -19,13 +43,13 @@ InfoHeader = Define.Lua
 }
 
 local LinkFlags
-LinkFlags = '-lbz2'
+LinkFlags = '-lbz2 -lpng -lz -pthread' .. CompressionLinkFlags
 App = Define.Executable
 {
 	Name = 'inscribist',
-	Sources = Item '*.cxx':Exclude 'test.cxx':Exclude(SharedSources),
+	Sources = Item '*.cxx':Exclude 'test.cxx':Exclude 'benchmark.cxx':Exclude(SharedSources),
 	Objects = Item()
-		:Include(ImageObject):Include(SettingsObject)
+		:Include(ImageObject):Include(SettingsObject):Include(WorkerPoolObject):Include(SIMDObject):Include(CompressionObject)
 		:Include(GeneralObjects):Include(ScriptObjects):Include(TranslationObjects):Include(GTKObjects),
 	BuildExtras = InfoHeader,
 	LinkFlags = LinkFlags
@@ -35,8 +59,16 @@ Test = Define.Executable
 {
 	Name = 'test',
 	Sources = Item 'test.cxx',
-	Objects = Item():Include(ImageObject):Include(SettingsObject)
+	Objects = Item():Include(ImageObject):Include(SettingsObject):Include(WorkerPoolObject):Include(SIMDObject):Include(CompressionObject)
 		:Include(GeneralObjects):Include(ScriptObjects):Include(TranslationObjects),
 	LinkFlags = LinkFlags
 }
 
+Benchmark = Define.Executable
+{
+	Name = 'benchmark',
+	Sources = Item 'benchmark.cxx',
+	Objects = Item():Include(ImageObject):Include(SettingsObject):Include(WorkerPoolObject):Include(SIMDObject):Include(CompressionObject)
+		:Include(GeneralObjects):Include(ScriptObjects):Include(TranslationObjects),
+	LinkFlags = LinkFlags
+}
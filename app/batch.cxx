@@ -0,0 +1,217 @@
+// Copyright 2013 Rendaw, under the FreeBSD license (See included license.txt)
+
+#include "batch.h"
+
+#include <iostream>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ren-translation/translation.h"
+
+#include "image.h"
+#include "workerpool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static long Milliseconds(Clock::duration const &Duration)
+	{ return std::chrono::duration_cast<std::chrono::milliseconds>(Duration).count(); }
+
+static void ShowUsage(void)
+{
+	std::cerr << Local("Usage: inscribist --batch [OPTION]... FILE...") << "\n" <<
+		Local("Operations are done to each file in the order given.") << "\n" <<
+		"  --flip-horizontally\n"
+		"  --flip-vertically\n"
+		"  --scale FACTOR\n"
+		"  --add LEFT RIGHT UP DOWN\n"
+		"  --save\n"
+		"  --save-to DIRECTORY\n"
+		"  --export\n"
+		"  --export-to DIRECTORY\n"
+		"  --jobs COUNT (" << Local("files at once, 0 for one per processor") << ")" << std::endl;
+}
+
+static bool ReadNumber(char const *Text, unsigned int &Out)
+{
+	char *End;
+	errno = 0;
+	unsigned long const Value = strtoul(Text, &End, 10);
+	if ((*Text == 0) || (*End != 0) || (Text[0] == '-') || (errno == ERANGE) || (Value > UINT_MAX)) return false;
+	Out = Value;
+	return true;
+}
+
+// The file name without any directories
+static String Leaf(String const &Filename)
+{
+	size_t const Slash = Filename.find_last_of('/');
+	if (Slash == String::npos) return Filename;
+	return Filename.substr(Slash + 1);
+}
+
+// The file name with the .inscribble extension replaced by .png
+static String ExportName(String const &Filename)
+{
+	String const ExportExtension(".png");
+	if ((Filename.length() > Extension.length()) &&
+		(Filename.compare(Filename.length() - Extension.length(), String::npos, Extension) == 0))
+		return Filename.substr(0, Filename.length() - Extension.length()) + ExportExtension;
+	return Filename + ExportExtension;
+}
+
+int RunBatch(int ArgumentCount, char **Arguments)
+{
+	/// Parse the operations and files
+	typedef std::function<bool(Image &Sketch, String const &Filename)> Operation;
+	std::vector<Operation> Operations;
+	std::vector<String> Filenames;
+	unsigned int Jobs = 0;
+
+	for (int Index = 0; Index < ArgumentCount; ++Index)
+	{
+		String const Argument = Arguments[Index];
+		int const Remaining = ArgumentCount - Index - 1;
+		auto Bad = [&](void)
+		{
+			std::cerr << Local("Bad arguments for ") << Argument << std::endl;
+			ShowUsage();
+			return 1;
+		};
+
+		if (Argument == "--flip-horizontally")
+			Operations.push_back([](Image &Sketch, String const &) { Sketch.FlipHorizontally(); return true; });
+		else if (Argument == "--flip-vertically")
+			Operations.push_back([](Image &Sketch, String const &) { Sketch.FlipVertically(); return true; });
+		else if (Argument == "--scale")
+		{
+			unsigned int Factor;
+			if ((Remaining < 1) || !ReadNumber(Arguments[Index + 1], Factor) || (Factor < 1)) return Bad();
+			Index += 1;
+			Operations.push_back([Factor](Image &Sketch, String const &) { Sketch.Scale(Factor); return true; });
+		}
+		else if (Argument == "--add")
+		{
+			unsigned int Left, Right, Up, Down;
+			if ((Remaining < 4) ||
+				!ReadNumber(Arguments[Index + 1], Left) || !ReadNumber(Arguments[Index + 2], Right) ||
+				!ReadNumber(Arguments[Index + 3], Up) || !ReadNumber(Arguments[Index + 4], Down))
+				return Bad();
+			Index += 4;
+			Operations.push_back([=](Image &Sketch, String const &)
+				{ Sketch.Add(Left, Right, Up, Down); return true; });
+		}
+		else if (Argument == "--save")
+			Operations.push_back([](Image &Sketch, String const &Filename) { return Sketch.Save(Filename); });
+		else if (Argument == "--save-to")
+		{
+			if (Remaining < 1) return Bad();
+			String const Directory = Arguments[++Index];
+			Operations.push_back([Directory](Image &Sketch, String const &Filename)
+				{ return Sketch.Save(Directory + "/" + Leaf(Filename)); });
+		}
+		else if (Argument == "--export")
+			Operations.push_back([](Image &Sketch, String const &Filename) { return Sketch.Export(ExportName(Filename)); });
+		else if (Argument == "--export-to")
+		{
+			if (Remaining < 1) return Bad();
+			String const Directory = Arguments[++Index];
+			Operations.push_back([Directory](Image &Sketch, String const &Filename)
+				{ return Sketch.Export(Directory + "/" + ExportName(Leaf(Filename))); });
+		}
+		else if (Argument == "--jobs")
+		{
+			if ((Remaining < 1) || !ReadNumber(Arguments[Index + 1], Jobs)) return Bad();
+			Index += 1;
+		}
+		else if (Argument == "--")
+		{
+			for (++Index; Index < ArgumentCount; ++Index) Filenames.push_back(Arguments[Index]);
+		}
+		else if ((Argument.length() > 1) && (Argument[0] == '-'))
+		{
+			std::cerr << Local("Unknown option ") << Argument << std::endl;
+			ShowUsage();
+			return 1;
+		}
+		else Filenames.push_back(Argument);
+	}
+
+	if (Filenames.empty() || Operations.empty())
+	{
+		ShowUsage();
+		return 1;
+	}
+
+	/// Split the processors between the files
+	// Each file gets its own image (and settings, since loading changes them), and the processors left over after
+	// handing one to each job are used for rendering inside the jobs.
+	unsigned int const Processors = std::max(1u, std::thread::hardware_concurrency());
+	if (Jobs == 0) Jobs = Processors;
+	Jobs = std::min(Jobs, (unsigned int)Filenames.size());
+	unsigned int const ThreadsPerJob = std::max(1u, Processors / Jobs);
+
+	std::mutex Mutex; // For output, and settings which read the configuration file
+	unsigned int Failures = 0;
+	Clock::time_point const BatchStart = Clock::now();
+
+	auto Process = [&](unsigned int const &Index)
+	{
+		String const &Filename = Filenames[Index];
+		Clock::time_point const Start = Clock::now();
+
+		std::unique_ptr<SettingsData> Settings;
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			Settings.reset(new SettingsData);
+		}
+		Settings->RenderThreads = ThreadsPerJob;
+
+		bool Succeeded = false;
+		String Status = Local("done");
+		Clock::duration LoadTime;
+		{
+			Image Sketch(*Settings, Filename);
+			LoadTime = Clock::now() - Start;
+			if (!Sketch.Loaded()) Status = Local("could not be loaded");
+			else
+			{
+				Succeeded = true;
+				for (auto &Operate : Operations)
+					if (!Operate(Sketch, Filename))
+					{
+						Succeeded = false;
+						Status = Local("failed");
+						break;
+					}
+				if (Succeeded && !Sketch.Loaded()) // Large images are only read as they're used
+				{
+					Succeeded = false;
+					Status = Local("could not be loaded");
+				}
+			}
+		}
+
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if (!Succeeded) ++Failures;
+		std::cout << Filename << ": " << Status <<
+			" (" << Local("load ") << Milliseconds(LoadTime) << " ms, " <<
+			Local("total ") << Milliseconds(Clock::now() - Start) << " ms)" << std::endl;
+	};
+
+	WorkerPool Workers;
+	Workers.SetThreadCount(Jobs);
+	Workers.Run(Filenames.size(), std::ref(Process));
+
+	std::cout << Filenames.size() << Local(" files in ") << Milliseconds(Clock::now() - BatchStart) << " ms" <<
+		((Failures > 0) ? ", " + AsString(Failures) + Local(" failed") : String()) << std::endl;
+	return (Failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,10 @@
+// Copyright 2013 Rendaw, under the FreeBSD license (See included license.txt)
+
+#ifndef batch_h
+#define batch_h
+
+// Runs operations on many files from the command line without opening a window, several files at a time.
+// Arguments are everything after --batch.  Returns the exit code for the process.
+int RunBatch(int ArgumentCount, char **Arguments);
+
+#endif
@@ -0,0 +1,203 @@
+// Copyright 2013 Rendaw, under the FreeBSD license (See included license.txt)
+
+#include "image.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+typedef std::chrono::steady_clock Clock;
+
+static double Milliseconds(Clock::time_point const &Start)
+	{ return std::chrono::duration<double, std::milli>(Clock::now() - Start).count(); }
+
+// Builds a row of alternating white and black runs
+static RunData::RunArray HatchedRow(unsigned int const &RunCount, unsigned int const &RunLength)
+{
+	RunData::RunArray Row;
+	Row.resize(RunCount, RunLength);
+	return Row;
+}
+
+// Line as it was before splicing: the whole row is copied into a new array for every line
+static void CopyingLine(RunData::RunArray &Row, unsigned int const &Width, unsigned int const &Left, unsigned int const &Right, bool const &Black)
+{
+	RunData::RunArray NewRuns;
+	NewRuns.reserve(Row.size() + 2);
+	unsigned int Index = 0, RunRight = Row[0];
+	while (RunRight < Left) { NewRuns.push_back(Row[Index]); RunRight += Row[++Index]; }
+	unsigned int ExtendedLeft;
+	if (RunData::IsBlack(Index) == Black) ExtendedLeft = RunRight - Row[Index];
+	else
+	{
+		ExtendedLeft = Left;
+		NewRuns.push_back(Left - (RunRight - Row[Index]));
+	}
+	while ((RunRight < Width) && (RunRight <= Right)) RunRight += Row[++Index];
+	if (RunData::IsBlack(Index) == Black) NewRuns.push_back(RunRight - ExtendedLeft);
+	else
+	{
+		NewRuns.push_back(Right - ExtendedLeft);
+		if (Right < RunRight) NewRuns.push_back(RunRight - Right);
+	}
+	NewRuns.insert(NewRuns.end(), Row.begin() + Index + 1, Row.end());
+	Row.swap(NewRuns);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int const Lines = argc > 1 ? atoi(argv[1]) : 20000;
+
+	// Line
+	for (unsigned int const RunCount : {10000u, 100000u})
+	{
+		unsigned int const RunLength = 4;
+		unsigned int const Width = RunCount * RunLength;
+
+		RunData::RunArray Row = HatchedRow(RunCount, RunLength);
+		srand(0);
+		Clock::time_point Start = Clock::now();
+		for (unsigned int Line = 0; Line < Lines; ++Line)
+		{
+			unsigned int const Left = rand() % (Width - 8);
+			CopyingLine(Row, Width, Left, Left + 1 + rand() % 8, rand() & 1);
+		}
+		double const CopyingTime = Milliseconds(Start);
+
+		RunData Data { RunData::RowArray { HatchedRow(RunCount, RunLength) } };
+		srand(0);
+		Start = Clock::now();
+		for (unsigned int Line = 0; Line < Lines; ++Line)
+		{
+			unsigned int const Left = rand() % (Width - 8);
+			Data.Line(Left, Left + 1 + rand() % 8, 0, rand() & 1);
+		}
+		double const SplicingTime = Milliseconds(Start);
+
+		bool const Matches = (Row.size() == Data.Rows[0].size()) && std::equal(Row.begin(), Row.end(), Data.Rows[0].begin());
+		std::cout << "Line, " << RunCount << " runs, " << Lines << " lines: copying " << CopyingTime << "ms, splicing " <<
+			SplicingTime << "ms" << (Matches ? "" : " (RESULTS DIFFER)") << std::endl;
+	}
+
+	// Combine near the end of long rows
+	for (unsigned int const RunCount : {10000u, 100000u})
+	{
+		unsigned int const RunLength = 4;
+		RunData Data { RunData::RowArray(16, HatchedRow(RunCount, RunLength)) };
+		std::vector<unsigned int> Buffer(256);
+		Clock::time_point const Start = Clock::now();
+		for (unsigned int Pass = 0; Pass < Lines / 16; ++Pass)
+		{
+			std::fill(Buffer.begin(), Buffer.end(), 0);
+			Data.Combine(&Buffer[0], Buffer.size(), RunCount * RunLength - Buffer.size(), 0, 1);
+		}
+		std::cout << "Combine, " << RunCount << " runs, " << Lines / 16 << " rows at the right edge: " << Milliseconds(Start) << "ms" << std::endl;
+	}
+
+	// Rendering kernels, for each instruction set available
+	{
+		unsigned int const Megapixels = 16, PixelCount = 1024 * 1024;
+		std::vector<unsigned int> Shades(PixelCount, 0);
+		for (unsigned int Index = 0; Index < PixelCount; ++Index)
+			if ((Index / 64) % 2) Shades[Index] = Index % 17;
+		std::vector<uint32_t> Colors(17), Pixels(PixelCount);
+		for (unsigned int Index = 0; Index < Colors.size(); ++Index) Colors[Index] = Index * 0x0f0f0f0f;
+
+		// A drawing with strokes of varied widths, rendered at 1:1 and zoomed out
+		RunData Data { RunData::RowArray(1024, HatchedRow(256, 16)) };
+		for (unsigned int Row = 0; Row < 1024; Row += 3) Data.Line(Row, Row + 600, Row, true);
+
+		for (SIMDLevel Level = SIMDLevel::Scalar; (int)Level <= (int)DetectSIMD(); Level = (SIMDLevel)((int)Level + 1))
+		{
+			SetSIMD(Level);
+
+			Clock::time_point Start = Clock::now();
+			for (unsigned int Pass = 0; Pass < Megapixels; ++Pass)
+				ShadePixels(&Pixels[0], &Shades[0], &Colors[0], PixelCount);
+			double const ShadeTime = Milliseconds(Start) / Megapixels;
+
+			Start = Clock::now();
+			for (unsigned int Pass = 0; Pass < Megapixels; ++Pass)
+				for (unsigned int Row = 0; Row < PixelCount; Row += 1024)
+					AddCoverage(&Shades[Row], 1024, 1);
+			double const FillTime = Milliseconds(Start) / Megapixels;
+
+			double CombineTime[2];
+			unsigned int const Scales[2] = {1, 4};
+			for (unsigned int ScaleIndex = 0; ScaleIndex < 2; ++ScaleIndex)
+			{
+				unsigned int const Scale = Scales[ScaleIndex], Width = 4096 / Scale, Height = 1024 / Scale;
+				std::vector<unsigned int> Line(Width);
+				Start = Clock::now();
+				for (unsigned int Pass = 0; Pass < Megapixels / 4; ++Pass)
+					for (unsigned int Row = 0; Row < Height; ++Row)
+					{
+						std::fill(Line.begin(), Line.end(), 0);
+						Data.Combine(&Line[0], Width, 0, Row, Scale);
+					}
+				CombineTime[ScaleIndex] = Milliseconds(Start) / (Megapixels / 4) / 4; // Each pass covers the 4 megapixel image
+			}
+
+			std::cout << SIMDName(Level) << ": shading " << ShadeTime << "ms/MP, filling " << FillTime << "ms/MP, combining " <<
+				CombineTime[0] << "ms/source MP at 1:1, " << CombineTime[1] << "ms/source MP at 1:4" << std::endl;
+		}
+		SetSIMD(DetectSIMD());
+	}
+
+	// Saving and loading a scribbled image, for each compression method available
+	{
+		String const Filename("benchmark.inscribble");
+		SettingsData Settings;
+		Settings.ImageSize = FlatVector(8000, 8000);
+		Image Sketch(Settings);
+		FlatVector const DisplaySize = Sketch.GetDisplaySize();
+		srand(0);
+		for (unsigned int Stroke = 0; Stroke < Lines / 4; ++Stroke)
+		{
+			CursorState Start, End;
+			Start.Position = FlatVector(rand() % (int)DisplaySize[0], rand() % (int)DisplaySize[1]);
+			End.Position = FlatVector(rand() % (int)DisplaySize[0], rand() % (int)DisplaySize[1]);
+			Start.Radius = End.Radius = 1 + rand() % 8;
+			Sketch.Mark(Start, End, rand() & 1);
+			Sketch.FinishMark();
+		}
+		std::cout << "Undo, " << Lines / 4 << " strokes: " << Sketch.UndoFootprint() / 1024 << "KB of history" << std::endl;
+
+		for (unsigned int Method = 0; Method < (unsigned int)CompressionMethod::Count; ++Method)
+		{
+			if (!CompressionAvailable((CompressionMethod)Method)) continue;
+			Settings.SaveCompression = (CompressionMethod)Method;
+
+			Clock::time_point Start = Clock::now();
+			bool const Saved = Sketch.Save(Filename);
+			double const SaveTime = Milliseconds(Start);
+
+			long Size = 0;
+			FILE *File = fopen(Filename.c_str(), "rb");
+			if (File != nullptr)
+			{
+				fseek(File, 0, SEEK_END);
+				Size = ftell(File);
+				fclose(File);
+			}
+
+			Start = Clock::now();
+			bool Loaded;
+			{
+				Image Reloaded(Settings, Filename);
+				Loaded = Reloaded.Loaded();
+			}
+			double const LoadTime = Milliseconds(Start);
+
+			std::cout << "Save, " << CompressionName((CompressionMethod)Method) << ": saving " << SaveTime <<
+				"ms, loading " << LoadTime << "ms, " << Size << " bytes" <<
+				((Saved && Loaded) ? "" : " (FAILED)") << std::endl;
+		}
+		remove(Filename.c_str());
+	}
+
+	return 0;
+}
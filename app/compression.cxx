@@ -0,0 +1,123 @@
+// Copyright 2013 Rendaw, under the FreeBSD license (See included license.txt)
+
+#include "compression.h"
+
+#include <algorithm>
+#include <bzlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+int const BZip2Level = 5, ZStandardLevel = 3;
+
+CompressionMethod DefaultCompression(void)
+{
+	if (CompressionAvailable(CompressionMethod::ZStandard)) return CompressionMethod::ZStandard;
+	if (CompressionAvailable(CompressionMethod::LZ4)) return CompressionMethod::LZ4;
+	return CompressionMethod::BZip2;
+}
+
+bool CompressionAvailable(CompressionMethod const &Method)
+{
+	switch (Method)
+	{
+		case CompressionMethod::BZip2: return true;
+		case CompressionMethod::None: return true;
+#ifdef HAVE_ZSTD
+		case CompressionMethod::ZStandard: return true;
+#endif
+#ifdef HAVE_LZ4
+		case CompressionMethod::LZ4: return true;
+#endif
+		default: return false;
+	}
+}
+
+char const *CompressionName(CompressionMethod const &Method)
+{
+	switch (Method)
+	{
+		case CompressionMethod::BZip2: return "bzip2";
+		case CompressionMethod::ZStandard: return "zstd";
+		case CompressionMethod::LZ4: return "lz4";
+		case CompressionMethod::None: return "none";
+		default: return "unknown";
+	}
+}
+
+bool Compress(CompressionMethod const &Method, std::vector<uint8_t> const &Raw, std::vector<uint8_t> &Out)
+{
+	switch (Method)
+	{
+		case CompressionMethod::BZip2:
+		{
+			// bzip2 needs 1% more plus 600 bytes in the worst case
+			unsigned int Size = Raw.size() + Raw.size() / 100 + 600;
+			Out.resize(Size);
+			if (BZ2_bzBuffToBuffCompress((char *)Out.data(), &Size,
+				(char *)Raw.data(), Raw.size(), BZip2Level, 0, 30) != BZ_OK) return false;
+			Out.resize(Size);
+			return true;
+		}
+		case CompressionMethod::None:
+			Out = Raw;
+			return true;
+#ifdef HAVE_ZSTD
+		case CompressionMethod::ZStandard:
+		{
+			Out.resize(ZSTD_compressBound(Raw.size()));
+			size_t const Size = ZSTD_compress(Out.data(), Out.size(), Raw.data(), Raw.size(), ZStandardLevel);
+			if (ZSTD_isError(Size)) return false;
+			Out.resize(Size);
+			return true;
+		}
+#endif
+#ifdef HAVE_LZ4
+		case CompressionMethod::LZ4:
+		{
+			Out.resize(LZ4_compressBound(Raw.size()));
+			int const Size = LZ4_compress_default((char const *)Raw.data(), (char *)Out.data(), Raw.size(), Out.size());
+			if (Size <= 0) return false;
+			Out.resize(Size);
+			return true;
+		}
+#endif
+		default: return false;
+	}
+}
+
+bool Decompress(CompressionMethod const &Method, uint8_t const *Compressed, size_t const &CompressedSize,
+	uint8_t *Raw, size_t const &RawSize)
+{
+	switch (Method)
+	{
+		case CompressionMethod::BZip2:
+		{
+			unsigned int Size = RawSize;
+			return (BZ2_bzBuffToBuffDecompress((char *)Raw, &Size,
+				(char *)Compressed, CompressedSize, 0, 0) == BZ_OK) && (Size == RawSize);
+		}
+		case CompressionMethod::None:
+			if (CompressedSize != RawSize) return false;
+			std::copy(Compressed, Compressed + CompressedSize, Raw);
+			return true;
+#ifdef HAVE_ZSTD
+		case CompressionMethod::ZStandard:
+		{
+			size_t const Size = ZSTD_decompress(Raw, RawSize, Compressed, CompressedSize);
+			return !ZSTD_isError(Size) && (Size == RawSize);
+		}
+#endif
+#ifdef HAVE_LZ4
+		case CompressionMethod::LZ4:
+		{
+			int const Size = LZ4_decompress_safe((char const *)Compressed, (char *)Raw, CompressedSize, RawSize);
+			return (Size >= 0) && ((size_t)Size == RawSize);
+		}
+#endif
+		default: return false;
+	}
+}
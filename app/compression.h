@@ -0,0 +1,33 @@
+// Copyright 2013 Rendaw, under the FreeBSD license (See included license.txt)
+
+#ifndef compression_h
+#define compression_h
+
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+// Ways of compressing the blocks in saved images.  The number is stored in the file header, so only add to the end.
+// zstd and lz4 are only available if the build was configured with them (HAVE_ZSTD, HAVE_LZ4).
+enum class CompressionMethod : uint32_t
+{
+	BZip2 = 0, // Smallest and slowest, readable by every version
+	ZStandard = 1,
+	LZ4 = 2, // Fastest and largest
+	None = 3, // Stored as is, so blocks can be read straight from a mapped file
+	Count
+};
+
+CompressionMethod DefaultCompression(void); // Fast but still small, out of what's available
+bool CompressionAvailable(CompressionMethod const &Method);
+char const *CompressionName(CompressionMethod const &Method);
+
+// Replaces Out with Raw compressed.  Returns false if the method isn't available or fails.
+bool Compress(CompressionMethod const &Method, std::vector<uint8_t> const &Raw, std::vector<uint8_t> &Out);
+
+// Fills Raw, which must be the size the data was before compression.  Returns false if the method isn't available,
+// the data is damaged, or it decompresses to a different size.
+bool Decompress(CompressionMethod const &Method, uint8_t const *Compressed, size_t const &CompressedSize,
+	uint8_t *Raw, size_t const &RawSize);
+
+#endif
@@ -4,81 +4,547 @@
 
 #include <cassert>
 #include <stdint.h>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <iomanip>
 #include <bzlib.h>
+#include <glib.h>
+#include <png.h>
+#include <zlib.h>
+#include <cerrno>
 #include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "compression.h"
+#include "simd.h"
 
 #include "ren-general/endian.h"
 #include "ren-translation/translation.h"
 
-unsigned int const MaxUndoLevels = 50;
+size_t const SaveBlockBytes = 1 << 20; // Uncompressed row data per block in saved files
+unsigned int const LazyLoadBlocks = 8; // Files with more blocks than this are mapped and read as the rows are used
+unsigned int const HotUndoLevels = 4; // The newest undo levels, which aren't frozen
+unsigned int const ResidentUndoLevels = 16; // The newest undo levels, which aren't spilled to disk
+
+// Where a block of rows is in a v03 file, as listed in the index at the end
+struct FileBlock
+{
+	uint64_t Offset;
+	uint32_t CompressedSize, RawSize, FirstRow;
+};
+
+// The blocks of a mapped v03 file that haven't been read into the image yet
+struct DeferredRows
+{
+	DeferredRows(String const &Filename, GMappedFile *File, CompressionMethod const &Method,
+		std::vector<FileBlock> const &Index, unsigned int const &RowCount) :
+		Filename(Filename), File(File), Bytes((uint8_t const *)g_mapped_file_get_contents(File)), Method(Method),
+		Index(Index), RowCount(RowCount), Read(Index.size(), false), Remaining(Index.size())
+		{}
+	// Shares the mapping, which stays valid even if the file is replaced, since saving renames a new file over it
+	DeferredRows(DeferredRows const &Other) :
+		Filename(Other.Filename), File(g_mapped_file_ref(Other.File)), Bytes(Other.Bytes), Method(Other.Method),
+		Index(Other.Index), RowCount(Other.RowCount), Read(Other.Read), Remaining(Other.Remaining)
+		{}
+	~DeferredRows(void) { g_mapped_file_unref(File); }
+
+	String const Filename;
+	GMappedFile *File;
+	uint8_t const *Bytes;
+	CompressionMethod const Method;
+	std::vector<FileBlock> const Index;
+	unsigned int const RowCount;
+	std::vector<bool> Read;
+	unsigned int Remaining;
+	std::vector<uint8_t> Raw; // Reused between blocks
+};
+
+UndoStore::UndoStore(void) : File(nullptr), Failed(false), End(0) {}
+
+UndoStore::~UndoStore(void) { if (File != nullptr) fclose(File); }
+
+bool UndoStore::Write(std::vector<uint8_t> const &Data, off_t &Offset)
+{
+	assert(!Data.empty());
+	if (Failed) return false;
+	if (File == nullptr)
+	{
+		File = tmpfile();
+		if (File == nullptr)
+		{
+			Failed = true;
+			std::cerr << Local("Could not create a temporary file for undo levels, so they will stay in memory") << std::endl;
+			return false;
+		}
+	}
+
+	// Use the first free space that fits, otherwise add to the end
+	Offset = End;
+	for (auto Space = Free.begin(); Space != Free.end(); ++Space)
+	{
+		if (Space->second < Data.size()) continue;
+		Offset = Space->first;
+		if (Space->second > Data.size()) Free[Offset + Data.size()] = Space->second - Data.size();
+		Free.erase(Space);
+		break;
+	}
+
+	if ((fseeko(File, Offset, SEEK_SET) != 0) ||
+		(fwrite(Data.data(), 1, Data.size(), File) != Data.size()) ||
+		(fflush(File) != 0))
+	{
+		Failed = true;
+		std::cerr << Local("Could not write to the temporary file for undo levels, so new levels will stay in memory") << std::endl;
+		return false;
+	}
+	End = std::max(End, Offset + (off_t)Data.size());
+	return true;
+}
+
+bool UndoStore::Read(off_t const &Offset, std::vector<uint8_t> &Data)
+{
+	assert(File != nullptr);
+	return (fseeko(File, Offset, SEEK_SET) == 0) && (fread(Data.data(), 1, Data.size(), File) == Data.size());
+}
+
+void UndoStore::Release(off_t const &Offset, size_t const &Size)
+{
+	assert(Offset + (off_t)Size <= End);
+
+	// Merge with the free space on either side, and give space at the end back
+	off_t Start = Offset;
+	size_t Length = Size;
+	auto After = Free.find(Offset + Size);
+	if (After != Free.end())
+	{
+		Length += After->second;
+		Free.erase(After);
+	}
+	auto Before = Free.lower_bound(Offset);
+	if ((Before != Free.begin()) && ((--Before)->first + (off_t)Before->second == Offset))
+	{
+		Start = Before->first;
+		Length += Before->second;
+		Free.erase(Before);
+	}
+
+	if (Start + (off_t)Length < End)
+	{
+		Free[Start] = Length;
+		return;
+	}
+	End = Start;
+	if (ftruncate(fileno(File), End) != 0) {} // Only disk space, it'll be overwritten later either way
+}
 
 Change::~Change(void) {}
+
+size_t Change::Footprint(void) const { return 64; } // Enough for changes that are just a few numbers
+
+void Change::Freeze(UndoStore *) {}
+
+void Change::Prefetch(void) {}
+
+bool Change::ChangedRows(std::vector<unsigned int> &) const { return false; }
+
+ChangeManager::Stack::Stack(void) : Bytes(0), Cold(0), Spilled(0) {}
+
+void ChangeManager::Stack::Push(Change *Level)
+{
+	Levels.push_back(Level);
+	Bytes += Level->Footprint();
+}
+
+Change *ChangeManager::Stack::Take(void)
+{
+	assert(!Levels.empty());
+	Change *Level = Levels.back();
+	Bytes -= Level->Footprint();
+	Levels.std::deque<Change *>::pop_back();
+	Cold = std::min(Cold, (unsigned int)Levels.size());
+	Spilled = std::min(Spilled, (unsigned int)Levels.size());
+	return Level;
+}
+
+void ChangeManager::Stack::PopFront(void)
+{
+	assert(!Levels.empty());
+	Bytes -= Levels.front()->Footprint();
+	Levels.pop_front();
+	if (Cold > 0) --Cold;
+	if (Spilled > 0) --Spilled;
+}
 		
+ChangeManager::ChangeManager(void) : Limit(0) {}
+
+ChangeManager::~ChangeManager(void) { Wait(); }
+
+void ChangeManager::SetLimit(size_t const &Bytes)
+{
+	Wait();
+	Limit = Bytes;
+	Trim();
+}
+
 void ChangeManager::AddUndo(Change *Undo)
 {
-	while (!Redos.empty())
-		Redos.pop_back();
+	Wait();
+	while (!Redos.Levels.empty())
+		delete Redos.Take();
+	size_t const Before = CanUndo() ? Undos.Levels.back()->Footprint() : 0;
 	Change::CombineResult CombineResult;
-	if (!CanUndo() || ((CombineResult = Undos.back()->Combine(Undo)) == Change::CombineResult::Fail))
+	if (!CanUndo() || ((CombineResult = Undos.Levels.back()->Combine(Undo)) == Change::CombineResult::Fail))
 	{
-		Undos.push_back(Undo);
-		if (Undos.size() > MaxUndoLevels)
-			Undos.pop_front();
+		Undos.Push(Undo);
+		Trim();
+		FreezeCold(Undos);
+		Start();
 		return;
 	}
 	switch (CombineResult)
 	{
 		case Change::CombineResult::Nullify:
-			Undos.pop_back();
+			delete Undos.Take();
 			delete Undo;
 			break;
 		case Change::CombineResult::Combine:
+			Undos.Bytes += Undos.Levels.back()->Footprint() - Before;
 			delete Undo;
+			Trim();
 			break;
 		default: assert(false); break;
 	}
 }
 
-bool ChangeManager::CanUndo(void) { return !Undos.empty(); }
+bool ChangeManager::CanUndo(void) { return !Undos.Levels.empty(); }
 
-void ChangeManager::Undo(bool &FlippedHorizontally, bool &FlippedVertically)
+bool ChangeManager::Undo(bool &FlippedHorizontally, bool &FlippedVertically, std::vector<unsigned int> &ChangedRows)
 {
 	assert(CanUndo());
-	Redos.push_back(Undos.back()->Apply(FlippedHorizontally, FlippedVertically));
-	Undos.pop_back();
+	Wait();
+	Change *Level = Undos.Take();
+	Change *Redo = Level->Apply(FlippedHorizontally, FlippedVertically);
+	delete Level;
+	// The redo level replaces the same rows the undo level just did
+	bool const Limited = (Redo == nullptr) || Redo->ChangedRows(ChangedRows);
+	if (Redo == nullptr) Lose(Undos);
+	else Redos.Push(Redo);
+	Trim();
+	FreezeCold(Redos);
+	Prefetch(Undos);
+	Start();
+	return Limited;
 }
 
-bool ChangeManager::CanRedo(void) { return !Redos.empty(); }
+bool ChangeManager::CanRedo(void) { return !Redos.Levels.empty(); }
 
-void ChangeManager::Redo(bool &FlippedHorizontally, bool &FlippedVertically)
+bool ChangeManager::Redo(bool &FlippedHorizontally, bool &FlippedVertically, std::vector<unsigned int> &ChangedRows)
 {
 	assert(CanRedo());
-	Undos.push_back(Redos.back()->Apply(FlippedHorizontally, FlippedVertically));
-	Redos.pop_back();
+	Wait();
+	Change *Level = Redos.Take();
+	Change *Undo = Level->Apply(FlippedHorizontally, FlippedVertically);
+	delete Level;
+	bool const Limited = (Undo == nullptr) || Undo->ChangedRows(ChangedRows);
+	if (Undo == nullptr) Lose(Redos);
+	else Undos.Push(Undo);
+	Trim();
+	FreezeCold(Undos);
+	Prefetch(Redos);
+	Start();
+	return Limited;
+}
+
+size_t ChangeManager::UndoFootprint(void) const { return Undos.Bytes; }
+
+size_t ChangeManager::RedoFootprint(void) const { return Redos.Bytes; }
+
+void ChangeManager::Trim(void)
+{
+	while ((Undos.Levels.size() > 1) && (Undos.Bytes + Redos.Bytes > Limit))
+		Undos.PopFront();
+}
+
+void ChangeManager::Lose(Stack &Side)
+{
+	std::cerr << Local("Part of the undo history was lost, so the changes past it can no longer be undone or redone") << std::endl;
+	while (!Side.Levels.empty()) delete Side.Take();
+}
+
+void ChangeManager::FreezeCold(Stack &Side)
+{
+	while (Side.Spilled + ResidentUndoLevels < Side.Levels.size())
+	{
+		Change *Level = Side.Levels[Side.Spilled++];
+		Tasks.push_back(Task{Level, &Side.Bytes, Level->Footprint(), &Store, false});
+	}
+	Side.Cold = std::max(Side.Cold, Side.Spilled);
+	while (Side.Cold + HotUndoLevels < Side.Levels.size())
+	{
+		Change *Level = Side.Levels[Side.Cold++];
+		Tasks.push_back(Task{Level, &Side.Bytes, Level->Footprint(), nullptr, false});
+	}
+}
+
+void ChangeManager::Prefetch(Stack &Side)
+{
+	if (Side.Levels.empty() || (Side.Spilled < Side.Levels.size())) return; // The next level is in memory
+	Side.Spilled = Side.Levels.size() - 1;
+	Change *Level = Side.Levels.back();
+	Tasks.push_back(Task{Level, &Side.Bytes, Level->Footprint(), nullptr, true});
+}
+
+void ChangeManager::Start(void)
+{
+	assert(!Freezer.joinable());
+	if (Tasks.empty()) return;
+	Freezer = std::thread(Run, Tasks);
+}
+
+// Every change to the levels waits for the freezer thread to finish first, so levels are never used on two threads
+void ChangeManager::Wait(void)
+{
+	if (!Freezer.joinable()) return;
+	Freezer.join();
+	for (auto const &Done : Tasks) *Done.Bytes = *Done.Bytes - Done.Before + Done.Level->Footprint();
+	Tasks.clear();
+}
+
+void ChangeManager::Run(std::vector<Task> const Tasks)
+{
+	for (auto const &Next : Tasks)
+	{
+		if (Next.Prefetch) Next.Level->Prefetch();
+		else Next.Level->Freeze(Next.Store);
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
-// RLE data methods and storage
-RunData::RunData(const FlatVector &Size) : Width(std::max(Size[0], 1.0f))
+// Row storage
+RowStore::RowStore(void) : Garbage(0), Reversed(false), Origin(0) {}
+
+RowStore::RowStore(std::vector<std::vector<Run> > const &Rows) : Garbage(0), Reversed(false), Origin(0)
+{
+	size_t Total = 0;
+	for (auto const &Row : Rows) Total += Slack(Row.size());
+	Slab.reserve(Total);
+	Slots.resize(Rows.size());
+	for (unsigned int Index = 0; Index < Rows.size(); ++Index)
+	{
+		Slot &Row = Slots[Index];
+		Row.Offset = Slab.size();
+		Row.Count = Rows[Index].size();
+		Row.Capacity = Slack(Row.Count);
+		Row.Tag = 0;
+		Slab.insert(Slab.end(), Rows[Index].begin(), Rows[Index].end());
+		Slab.resize(Row.Offset + Row.Capacity);
+	}
+}
+
+unsigned int RowStore::size(void) const { return Slots.size(); }
+
+RowStore::Row RowStore::operator[](unsigned int const &Index) const
+{
+	assert(Index < Slots.size());
+	Slot const &Found = Slots[Locate(Index)];
+	return Row(&Slab[0] + Found.Offset, Found.Count);
+}
+
+void RowStore::Resize(unsigned int const &Count, Run const &Fill)
+{
+	Straighten();
+	if (Count < Slots.size())
+	{
+		for (unsigned int Index = Count; Index < Slots.size(); ++Index)
+			Garbage += Slots[Index].Capacity;
+		Slots.resize(Count);
+		Collect();
+		return;
+	}
+
+	unsigned int const Capacity = Slack(1);
+	Slab.reserve(Slab.size() + (Count - Slots.size()) * Capacity);
+	while (Slots.size() < Count)
+	{
+		Slot NewRow;
+		NewRow.Offset = Slab.size();
+		NewRow.Count = 1;
+		NewRow.Capacity = Capacity;
+		NewRow.Tag = 0;
+		Slab.resize(NewRow.Offset + Capacity);
+		Slab[NewRow.Offset] = Fill;
+		Slots.push_back(NewRow);
+	}
+}
+
+void RowStore::AddUnset(unsigned int const &Count)
+{
+	Straighten();
+	Slot NewRow;
+	NewRow.Offset = Slab.size();
+	NewRow.Count = 0;
+	NewRow.Capacity = 0;
+	NewRow.Tag = 0;
+	Slots.resize(Slots.size() + Count, NewRow);
+}
+
+void RowStore::Assign(unsigned int const &Index, Run const *Runs, unsigned int const &Count)
+{
+	std::copy(Runs, Runs + Count, Allocate(Index, Count));
+}
+
+RowStore::Run *RowStore::Allocate(unsigned int const &Index, unsigned int const &Count)
+{
+	assert(Index < Slots.size());
+	Slot &Found = Reserve(Locate(Index), Count, false);
+	Found.Count = Count;
+	return &Slab[Found.Offset];
+}
+
+RowStore::Run *RowStore::Edit(unsigned int const &Index)
+{
+	assert(Index < Slots.size());
+	return &Slab[Slots[Locate(Index)].Offset];
+}
+
+RowStore::Run *RowStore::Splice(unsigned int const &Index, unsigned int const &Position, unsigned int const &Erase, unsigned int const &Insert)
+{
+	assert(Index < Slots.size());
+	unsigned int const Physical = Locate(Index);
+	assert(Position + Erase <= Slots[Physical].Count);
+	unsigned int const OldCount = Slots[Physical].Count;
+	unsigned int const NewCount = OldCount - Erase + Insert;
+	Slot &Found = Reserve(Physical, NewCount, true);
+	Run *Start = &Slab[Found.Offset];
+	if (Insert < Erase) std::copy(Start + Position + Erase, Start + OldCount, Start + Position + Insert);
+	else if (Insert > Erase) std::copy_backward(Start + Position + Erase, Start + OldCount, Start + NewCount);
+	Found.Count = NewCount;
+	return Start;
+}
+
+void RowStore::Copy(unsigned int const &Target, unsigned int const &Source)
+{
+	assert(Source < Slots.size());
+	if (Target == Source) return;
+	Slot const &From = Slots[Locate(Source)];
+	unsigned int const Count = From.Count;
+	Run *Destination = Allocate(Target, Count);
+	Run const *Start = &Slab[From.Offset]; // After allocating, which may move the slab
+	std::copy(Start, Start + Count, Destination);
+	Slots[Locate(Target)].Tag = From.Tag;
+}
+
+void RowStore::Swap(unsigned int const &First, unsigned int const &Second)
+{
+	assert(First < Slots.size());
+	assert(Second < Slots.size());
+	std::swap(Slots[Locate(First)], Slots[Locate(Second)]);
+}
+
+void RowStore::Reverse(void) { Reversed = !Reversed; }
+
+void RowStore::Rotate(unsigned int const &Down)
+{
+	assert(Down < Slots.size());
+	Origin = Reversed ? (Origin + Down) % Slots.size() : (Origin + Slots.size() - Down) % Slots.size();
+}
+
+uint32_t RowStore::GetTag(unsigned int const &Index) const
+{
+	assert(Index < Slots.size());
+	return Slots[Locate(Index)].Tag;
+}
+
+void RowStore::SetTag(unsigned int const &Index, uint32_t const &Tag)
+{
+	assert(Index < Slots.size());
+	Slots[Locate(Index)].Tag = Tag;
+}
+
+void RowStore::Compact(void)
+{
+	size_t Total = 0;
+	for (auto const &Row : Slots) Total += Slack(Row.Count);
+	std::vector<Run> NewSlab;
+	NewSlab.reserve(Total);
+	for (auto &Row : Slots)
+	{
+		size_t const Offset = NewSlab.size();
+		NewSlab.insert(NewSlab.end(), Slab.begin() + Row.Offset, Slab.begin() + Row.Offset + Row.Count);
+		NewSlab.resize(Offset + Slack(Row.Count));
+		Row.Offset = Offset;
+		Row.Capacity = Slack(Row.Count);
+	}
+	Slab.swap(NewSlab);
+	Garbage = 0;
+}
+
+unsigned int RowStore::Slack(unsigned int const &Count) { return Count + Count / 2 + 2; }
+
+unsigned int RowStore::Locate(unsigned int const &Index) const
+{
+	unsigned int const Ordered = Reversed ? Slots.size() - 1 - Index : Index;
+	return (Ordered < Slots.size() - Origin) ? Ordered + Origin : Ordered - (Slots.size() - Origin);
+}
+
+void RowStore::Straighten(void)
+{
+	std::rotate(Slots.begin(), Slots.begin() + Origin, Slots.end());
+	if (Reversed) std::reverse(Slots.begin(), Slots.end());
+	Reversed = false;
+	Origin = 0;
+}
+
+RowStore::Slot &RowStore::Reserve(unsigned int const &Physical, unsigned int const &Count, bool const &Preserve)
 {
-	Rows.resize(Size[1]);
-	for (auto &Row : Rows)
+	Slot &Row = Slots[Physical];
+	if (Count <= Row.Capacity) return Row;
+	// Before moving the row, since compacting fits every slot to the runs it holds now
+	Collect();
+
+	unsigned int const Capacity = Slack(Count);
+	if (Row.Offset + Row.Capacity == Slab.size())
 	{
-		Row.resize(1);
-		Row[0] = Width;
+		// Last row in the slab, so grow in place
+		Slab.resize(Row.Offset + Capacity);
+		Row.Capacity = Capacity;
+		return Row;
 	}
+
+	size_t const Offset = Slab.size();
+	Slab.resize(Offset + Capacity);
+	if (Preserve) std::copy(Slab.begin() + Row.Offset, Slab.begin() + Row.Offset + Row.Count, Slab.begin() + Offset);
+	Garbage += Row.Capacity;
+	Row.Offset = Offset;
+	Row.Capacity = Capacity;
+	return Row;
+}
+
+void RowStore::Collect(void)
+{
+	if ((Garbage > 4096) && (Garbage * 2 > Slab.size())) Compact();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// RLE data methods and storage
+RunData::RunData(const FlatVector &Size) : Width(std::max(Size[0], 1.0f)), Deferred(nullptr), FoundDamage(false), Orientation(0), Unoriented(0)
+{
+	Rows.Resize(Size[1], Width);
 }
 	
-static unsigned int CalculateWidth(RunData::RowArray const &Rows)
+static unsigned int CalculateWidth(RowStore const &Rows)
 {
 	unsigned int Width = 0;
 	bool WidthUnset = true;
-	for (auto const &Row : Rows)
+	for (unsigned int RowIndex = 0; RowIndex < Rows.size(); ++RowIndex)
 	{
 		unsigned int TestWidth = 0;
-		for (auto const &Run : Row) TestWidth += Run;
+		for (auto const &Run : Rows[RowIndex]) TestWidth += Run;
 		if (WidthUnset)
 		{
 			Width = TestWidth;
@@ -94,139 +560,84 @@ static unsigned int CalculateWidth(RunData::RowArray const &Rows)
 }
 
 RunData::RunData(std::vector<std::vector<Run> > const &InitialRows) : 
-	Rows(InitialRows), Width(CalculateWidth(Rows))
+	Rows(InitialRows), Width(CalculateWidth(Rows)), Deferred(nullptr), FoundDamage(false), Orientation(0), Unoriented(0)
 	{ }
 
+RunData::~RunData(void) { delete Deferred; }
+
 void RunData::Line(int UnclippedLeft, int UnclippedRight, unsigned int const &Y, bool Black)
 {
 	// Validate parameters
 	assert(Y < Rows.size());
+	Materialize(Y, Y + 1);
 
 	unsigned int const Right = RangeD(0, Width).Constrain(UnclippedRight);
 	unsigned int const Left = RangeD(0, Right).Constrain(UnclippedLeft);
 
 	if (Left == Right) return;
 
-	// Create new row data
-	// We'll add at most two runs to the row, so this may waste two runs
-	// but we'll clean it up next time we modify this row.
-	class NewRunManager
-	{
-		public:
-			NewRunManager(RunData const &Base, unsigned int const &Y) : 
-				MaxCount(Base.Rows[Y].size() + 2),
-				MaxWidth(Base.Width), Width(0)
-			{
-				assert(MaxCount >= 2);
-				NewRuns.reserve(MaxCount);
-			}
-
-			void Create(unsigned int Length)
-			{
-				assert((NewRuns.size() == 0) || (Length > 0));
-				assert(NewRuns.size() < MaxCount);
-				NewRuns.push_back(Length);
-				assert(Width + Length <= MaxWidth);
-				Width += Length;
-			}
-
-			unsigned int Right(void) const { return Width; }
-
-			RunArray &&GetFinalRuns(void) { return std::move(NewRuns); }
-		private:
-			unsigned int const MaxCount;
-			RunArray NewRuns;
-			unsigned int const &MaxWidth;
-			unsigned int Width;
-	} NewRuns(*this, Y);
+	// Only the runs touching the line change, so we find them and splice in at most three runs to replace them.
+	// The rest of the row stays where it is.
+	RowStore::Row const OldRuns = Rows[Y];
 
+	// Find the run, within or immediately after which the line starts (the first run ending at or after Left).
+	unsigned int First, FirstLeft;
+	Skips.Find(Rows, Y, Left, First, FirstLeft);
+	unsigned int FirstRight = FirstLeft + OldRuns[First];
+	while (FirstRight < Left)
 	{
-		class OldRunManager
-		{
-			public:
-				OldRunManager(RunData const &Base, unsigned int const &Y) : 
-					OldRuns(Base.Rows[Y]), Count(0), Width(0)
-				{ 
-					Advance();
-				}
-
-				~OldRunManager(void)
-				{
-					assert(Count == OldRuns.size());
-				}
-
-				unsigned int Right(void) const { return Width; }
-
-				unsigned int RunLength(void) const { return Length; }
-
-				bool IsBlack(void) const { return RunData::IsBlack(Count - 1); }
-
-				void Advance(void) 
-				{
-					assert(Count < OldRuns.size());
-					Length = OldRuns[Count];
-					Width += Length;
-					++Count;
-				}
-			private:
-				RunArray const &OldRuns;
-				unsigned int Count;
-				unsigned int Width;
-				unsigned int Length;
-		} OldRun(*this, Y);
-
-		// Find the run, within or immediately after which the line starts.  Copy earlier runs over.
-		while (OldRun.Right() < Left)
-		{
-			NewRuns.Create(OldRun.RunLength());
-			OldRun.Advance();
-		}
-
-		// If the run doesn't match the line color, cut it short.  Mark the start of our line.
-		int ExtendedLeft;
-		if (OldRun.IsBlack() == Black)
-			ExtendedLeft = NewRuns.Right();
-		else 
-		{
-			ExtendedLeft = Left;
-			NewRuns.Create(Left - NewRuns.Right());
-		}
-		
-		// Skip over old runs that fall entirely behind the new runs.
-		while ((OldRun.Right() < Width) && (OldRun.Right() <= Right))
-			OldRun.Advance();
+		++First;
+		assert(First < OldRuns.size());
+		FirstLeft = FirstRight;
+		FirstRight += OldRuns[First];
+	}
 
-		// If the next run matches the new line color, incorporate it and finish the line.  Otherwise, finish the new line and shorten the next run.
-		if (OldRun.IsBlack() == Black)
-		{
-			NewRuns.Create(OldRun.Right() - ExtendedLeft);
-		}
-		else
+	// Find the run that touches the end of the line - the first run ending after Right, or the last run.
+	unsigned int Last = First, LastRight = FirstRight;
+	{
+		unsigned int Skip, SkipLeft;
+		Skips.Find(Rows, Y, Right + 1, Skip, SkipLeft);
+		if (Skip > Last)
 		{
-			NewRuns.Create(Right - ExtendedLeft);
-			if (Right < OldRun.Right())
-				NewRuns.Create(OldRun.Right() - Right);
+			Last = Skip;
+			LastRight = SkipLeft + OldRuns[Skip];
 		}
+	}
+	while ((LastRight < Width) && (LastRight <= Right))
+	{
+		++Last;
+		assert(Last < OldRuns.size());
+		LastRight += OldRuns[Last];
+	}
+	assert(LastRight <= Width);
+
+	// Work out the replacement runs.  If the first run doesn't match the line color, cut it short.  If the last run
+	// matches the line color, incorporate it, otherwise shorten it.
+	Run NewRuns[3];
+	unsigned int NewCount = 0;
+	unsigned int ExtendedLeft;
+	if (IsBlack(First) == Black)
+		ExtendedLeft = FirstLeft;
+	else
+	{
+		ExtendedLeft = Left;
+		NewRuns[NewCount++] = Left - FirstLeft;
+	}
 
-		if (OldRun.Right() < Width)
-		{
-			// Advance past the run that touched the modified region
-			OldRun.Advance();
-
-			// Copy the remaining old runs over
-			while (true)
-			{
-				NewRuns.Create(OldRun.RunLength());
-				if (OldRun.Right() == Width) break;
-				OldRun.Advance();
-			}
-		}
-		assert(OldRun.Right() == Width);
+	if (IsBlack(Last) == Black)
+		NewRuns[NewCount++] = LastRight - ExtendedLeft;
+	else
+	{
+		NewRuns[NewCount++] = Right - ExtendedLeft;
+		if (Right < LastRight)
+			NewRuns[NewCount++] = LastRight - Right;
 	}
+	assert((First == 0) || (NewRuns[0] > 0));
 
-	assert(NewRuns.Right() == Width);
-		
-	Rows[Y] = NewRuns.GetFinalRuns();
+	Run *Runs = Rows.Splice(Y, First, Last - First + 1, NewCount);
+	std::copy(NewRuns, NewRuns + NewCount, Runs + First);
+	Skips.Splice(Rows, Y, First, Last - First + 1, NewCount);
+	Coverage.Invalidate(Y);
 }
 
 void RunData::Combine(unsigned int *Buffer, unsigned int const BufferWidth,
@@ -250,23 +661,45 @@ void RunData::Combine(unsigned int *Buffer, unsigned int const BufferWidth,
 			BufferColumnLeft = BufferLeft, // Inclusive
 			BufferColumnRight = BufferColumnLeft + Scale; // Exclusive
 
-		RunArray const &CurrentRow = Rows[CurrentRowIndex];
+		RowStore::Row const CurrentRow = Rows[CurrentRowIndex];
 		assert(CurrentRow.size() >= 1);
 		unsigned int 
-			RunIndex = 0,
-			RunLeft = 0, // Inclusive
-			RunRight = CurrentRow[RunIndex]; // Exclusive
+			RunIndex,
+			RunLeft; // Inclusive
+		Skips.Find(Rows, CurrentRowIndex, BufferLeft, RunIndex, RunLeft);
+		unsigned int RunRight = RunLeft + CurrentRow[RunIndex]; // Exclusive
 		while (true)
 		{
 			if (RunLeft >= BufferRight) break;
 			if (IsBlack(RunIndex))
 			{
+				// Skip to the first column the run touches
+				if (BufferColumnRight <= RunLeft)
+				{
+					unsigned int const Skip = (RunLeft - BufferColumnLeft) / Scale;
+					BufferColumn += Skip;
+					BufferColumnLeft += Skip * Scale;
+					BufferColumnRight += Skip * Scale;
+					assert(BufferColumn < BufferWidth);
+				}
 				while (BufferColumnLeft < RunRight)
 				{
+					// Fill columns entirely covered by the run in one go
+					if ((BufferColumnLeft >= RunLeft) && (BufferColumnRight <= RunRight))
+					{
+						unsigned int const Covered = std::min((RunRight - BufferColumnLeft) / Scale, BufferWidth - BufferColumn);
+						AddCoverage(Buffer + BufferColumn, Covered, Scale);
+						BufferColumn += Covered;
+						if (BufferColumn >= BufferWidth) goto RowEndMark;
+						BufferColumnLeft += Covered * Scale;
+						BufferColumnRight += Covered * Scale;
+						continue;
+					}
 					if (BufferColumnRight > RunLeft)
 					{
 						Buffer[BufferColumn] += std::min(RunRight, BufferColumnRight) - std::max(RunLeft, BufferColumnLeft);
 					}
+					if (BufferColumnRight > RunRight) break; // The next black run may share this column
 					++BufferColumn;
 					if (BufferColumn >= BufferWidth) goto RowEndMark;
 					BufferColumnLeft += Scale;
@@ -282,177 +715,550 @@ RowEndMark:;
 	}
 }
 
-void RunData::FlipVertically(void) { FlipSubsectionVertically(0, Rows.size()); }
+void RunData::CombineCoarse(unsigned int *Buffer, unsigned int const BufferWidth,
+	unsigned int const X, unsigned int const Y, unsigned int const Scale)
+{
+	if (CoveragePyramid::Covers(Scale)) Coverage.Combine(*this, Buffer, BufferWidth, X, Y, Scale);
+	else Combine(Buffer, BufferWidth, X, Y, Scale);
+}
 
-void RunData::FlipHorizontally(void)
+void RunData::PrepareCombine(unsigned int const &Y, unsigned int const &Height, unsigned int const &Scale, bool const &Coarse)
 {
-	for (unsigned int CurrentRow = 0; CurrentRow < Rows.size(); CurrentRow++)
-	{
-		RunArray OldRuns; 
-		Rows[CurrentRow].swap(OldRuns); // Could we just move constructor and clear instead?
-		
-		// If the last element was black, add a 0 width white to start the new row
-		unsigned int const WriteStartOffset = IsBlack(OldRuns.size() - 1) ? 1 : 0;
+	// Coverage cells are smaller than a screen pixel but don't have to line up with them
+	Materialize(std::min((unsigned int)Rows.size(), (Y > 0) ? (Y - 1) * Scale : 0),
+		std::min((unsigned int)Rows.size(), (Y + Height + 1) * Scale));
+	if (Coarse && CoveragePyramid::Covers(Scale)) Coverage.Prepare(*this, Y, Height, Scale);
+	else Skips.Refresh(Rows, Y * Scale, (Y + Height) * Scale);
+}
 
-		// If the first element of the old is 0, skip it
-		unsigned int const ReadStartOffset = (OldRuns[0] == 0) ? 1 : 0;
+void RunData::SwapRow(unsigned int const &Y, RunArray &Runs)
+{
+	assert(Y < Rows.size());
+	assert(!Runs.empty());
+	Materialize(Y, Y + 1);
+	RunArray OldRuns(Rows[Y].begin(), Rows[Y].end());
+	Rows.Assign(Y, &Runs[0], Runs.size());
+	Runs.swap(OldRuns);
+	Coverage.Invalidate(Y);
+	Skips.Invalidate(Y);
+}
 
-		Rows[CurrentRow].resize(OldRuns.size() + WriteStartOffset - ReadStartOffset);
+// Little endian 32 bit values in byte buffers, which may not be aligned
+static void PutWord(uint8_t *&Cursor, uint32_t const &Value)
+{
+	LittleEndian<uint32_t> const Standardized = Value;
+	memcpy(Cursor, &Standardized, sizeof(Standardized));
+	Cursor += sizeof(Standardized);
+}
 
-		if (WriteStartOffset == 1)
-			Rows[CurrentRow][0] = 0;
+static uint32_t GetWord(uint8_t const *&Cursor)
+{
+	LittleEndian<uint32_t> Standardized;
+	memcpy(&Standardized, Cursor, sizeof(Standardized));
+	Cursor += sizeof(Standardized);
+	return Standardized;
+}
 
-		auto SetNewRun = [&](unsigned int const &NewIndex, unsigned int const &OldIndex)
-		{
-			assert(NewIndex < Rows[CurrentRow].size());
-			assert(NewIndex >= WriteStartOffset);
-			assert(OldIndex < OldRuns.size());
-			assert(OldIndex >= ReadStartOffset);
-			Rows[CurrentRow][NewIndex] = OldRuns[OldIndex];
-		};
-		for (unsigned int NewRun = 0; NewRun < Rows[CurrentRow].size() - WriteStartOffset; ++NewRun)
-			SetNewRun(WriteStartOffset + NewRun, OldRuns.size() - 1 - NewRun);
-	}
+// Whether runs are stored the same way in memory as in files, so a row of words can be copied as is
+static bool RunsAreLittleEndian(void)
+{
+	if (sizeof(RunData::Run) != sizeof(uint32_t)) return false;
+	uint32_t const Probe = 1;
+	uint8_t Low;
+	memcpy(&Low, &Probe, 1);
+	return Low == 1;
 }
 
-void RunData::ShiftHorizontally(int Columns)
+// Packed row numbers: 7 bits per byte, low bits first, with the top bit set on every byte but the last
+static void PutNumber(uint8_t *&Cursor, uint32_t Value)
 {
-	// Split is where the end will be after the shift
-	unsigned int const Split = Mod(-Columns, Width);
-	assert(Split <= Width);
-	
-	// Shift each row to align with the new split
-	for (unsigned int CurrentRow = 0; CurrentRow < Rows.size(); ++CurrentRow)
+	while (Value >= 0x80)
 	{
-		RunArray OldRuns; 
-		assert(!Rows[CurrentRow].empty());
-		Rows[CurrentRow].swap(OldRuns); // Could we just move constructor and clear instead?
-
-		class RunIterator
-		{
-			public:
-				RunIterator(RunArray const &Runs) : Runs(Runs), CurrentRun(0) 
-					{ assert(!Runs.empty()); RunRight = Runs[CurrentRun]; }
-
-				void Reset(void) { CurrentRun = 0; RunRight = Runs[CurrentRun]; }
-
-				bool CanAdvance(void) { return CurrentRun + 1 < Runs.size(); }
-
-				void Advance(void)
-				{
-					++CurrentRun;
-					assert(CurrentRun < Runs.size());
-					RunRight += Runs[CurrentRun];
-				}
-
-				unsigned int Right(void) { return RunRight; }
-
-				unsigned int Index(void) { return CurrentRun; }
-
-				unsigned int Width(void) { return Runs[CurrentRun]; }
-
-				bool IsBlack(void) { return RunData::IsBlack(CurrentRun); }
-
-			private:
-				RunArray const &Runs;
-				unsigned int CurrentRun, RunRight;
+		*Cursor++ = (Value & 0x7f) | 0x80;
+		Value >>= 7;
+	}
+	*Cursor++ = Value;
+}
 
-		} OldRun(OldRuns);
+static bool GetNumber(uint8_t const *&Cursor, uint8_t const *End, uint32_t &Value)
+{
+	Value = 0;
+	for (unsigned int Shift = 0; Shift < 32; Shift += 7)
+	{
+		if (Cursor == End) return false;
+		uint8_t const Byte = *Cursor++;
+		if ((Shift == 28) && (Byte > 0x0f)) return false; // More than 32 bits
+		Value |= (uint32_t)(Byte & 0x7f) << Shift;
+		if (!(Byte & 0x80)) return true;
+	}
+	return false;
+}
 
-		// First, find the row that straddles/hits the division 
-		while (OldRun.Right() <= Split)
-			OldRun.Advance();
+// Differences from the row above are stored with the sign in the low bit, so small changes either way stay small
+static uint32_t Fold(int64_t const &Difference)
+	{ return (Difference < 0) ? ((uint32_t)-Difference << 1) - 1 : (uint32_t)Difference << 1; }
 
-		unsigned int const StraddleRunIndex = OldRun.Index();
-		
-		Rows[CurrentRow].reserve(OldRuns.size() + 2); // Potential white padding + extra split run
+static int64_t Unfold(uint32_t const &Folded)
+	{ return (Folded & 1) ? -((int64_t)Folded + 1) / 2 : Folded / 2; }
 
-		// Write the runs to the end.
-		auto AddPostSplitRun = [&](bool Black, unsigned int Length)
+void RunData::WriteRows(unsigned int const &Top, unsigned int const &Bottom, RowFormat const &Format, std::vector<uint8_t> &Out) const
+{
+	assert(Top <= Bottom);
+	assert(Bottom <= Rows.size());
+	for (unsigned int CurrentRow = Top; CurrentRow < Bottom; ++CurrentRow)
+	{
+		assert(Materialized(CurrentRow));
+		RowStore::Row const Row = Rows[CurrentRow];
+		size_t const Start = Out.size();
+		if (Format == RowFormat::Words)
 		{
-			assert(Length > 0);
-			if (Rows[CurrentRow].empty() && Black)
-				Rows[CurrentRow].push_back(0);
-			Rows[CurrentRow].push_back(Length);
-		};
-
-		unsigned int const StraddleRunRemainder = OldRun.Right() - Split;
-		AddPostSplitRun(OldRun.IsBlack(), StraddleRunRemainder);
+			Out.resize(Start + sizeof(uint32_t) * (Row.size() + 1));
+			uint8_t *Cursor = &Out[Start];
+			PutWord(Cursor, Row.size());
+			for (auto const &Run : Row) PutWord(Cursor, Run);
+			continue;
+		}
 
-		while (OldRun.CanAdvance())
+		// The low bit of the count says whether the runs are differences from the row above
+		Out.resize(Start + 5 * (Row.size() + 1));
+		uint8_t *Cursor = &Out[Start];
+		bool const Difference = (CurrentRow > Top) && (Rows[CurrentRow - 1].size() == Row.size());
+		PutNumber(Cursor, (Row.size() << 1) | (Difference ? 1 : 0));
+		if (Difference)
 		{
-			OldRun.Advance();
-			AddPostSplitRun(OldRun.IsBlack(), OldRun.Width());
+			RowStore::Row const Above = Rows[CurrentRow - 1];
+			for (unsigned int RunIndex = 0; RunIndex < Row.size(); ++RunIndex)
+				PutNumber(Cursor, Fold((int64_t)Row[RunIndex] - Above[RunIndex]));
 		}
+		else for (auto const &Run : Row) PutNumber(Cursor, Run);
+		Out.resize(Cursor - &Out[0]);
+	}
+}
 
-		// Start from the beginning, and work back to the split.  Drop the initial padded white if present.
-		OldRun.Reset();
+bool RunData::ReadRows(unsigned int const &Top, unsigned int const &Bottom, RowFormat const &Format,
+	uint8_t const *Buffer, size_t const &Size)
+{
+	assert(Top <= Bottom);
+	assert(Bottom <= Rows.size());
+	uint8_t const *Cursor = Buffer, *End = Buffer + Size;
+	for (unsigned int CurrentRow = Top; CurrentRow < Bottom; ++CurrentRow)
+	{
+		Coverage.Invalidate(CurrentRow);
+		Skips.Invalidate(CurrentRow);
 
-		if (OldRun.Width() == 0)
-			OldRun.Advance();
-		
-		auto AddPreSplitRun = [&](bool Black, unsigned int Length)
+		uint32_t RunCount;
+		bool Difference = false;
+		if (Format == RowFormat::Words)
 		{
-			assert(Length > 0);
-			assert(!Rows[CurrentRow].empty());
-			if (IsBlack(Rows[CurrentRow].size() - 1) == Black)
-				Rows[CurrentRow].back() += Length;
-			else Rows[CurrentRow].push_back(Length);
-		};
+			if ((size_t)(End - Cursor) < sizeof(uint32_t)) return false;
+			RunCount = GetWord(Cursor);
+			if ((RunCount == 0) || (RunCount > (size_t)(End - Cursor) / sizeof(uint32_t))) return false;
+		}
+		else
+		{
+			uint32_t Header;
+			if (!GetNumber(Cursor, End, Header)) return false;
+			RunCount = Header >> 1;
+			Difference = Header & 1;
+			// Every run takes at least a byte
+			if ((RunCount == 0) || (RunCount > (size_t)(End - Cursor))) return false;
+			if (Difference && ((CurrentRow == Top) || (Rows[CurrentRow - 1].size() != RunCount))) return false;
+		}
+
+		// Every run but a leading white one has to have some length, and they have to fill the row exactly.  Damaged
+		// rows are left blank.
+		uint64_t RowWidth = 0;
+		bool Damaged = false;
+		Run *Row = Rows.Allocate(CurrentRow, RunCount);
+		if (Format == RowFormat::Words)
+		{
+			if (RunsAreLittleEndian())
+			{
+				memcpy(Row, Cursor, sizeof(uint32_t) * RunCount);
+				Cursor += sizeof(uint32_t) * RunCount;
+			}
+			else for (uint32_t RunIndex = 0; RunIndex < RunCount; ++RunIndex) Row[RunIndex] = GetWord(Cursor);
+			for (uint32_t RunIndex = 0; RunIndex < RunCount; ++RunIndex)
+			{
+				Damaged |= (RunIndex > 0) && (Row[RunIndex] == 0);
+				RowWidth += Row[RunIndex];
+			}
+		}
+		else
+		{
+			Run const *Above = Difference ? Rows[CurrentRow - 1].begin() : nullptr;
+			for (uint32_t RunIndex = 0; !Damaged && (RunIndex < RunCount); ++RunIndex)
+			{
+				uint32_t Value;
+				if (!GetNumber(Cursor, End, Value)) Damaged = true;
+				else if (Difference)
+				{
+					int64_t const Restored = Above[RunIndex] + Unfold(Value);
+					if ((Restored < 0) || (Restored > Width)) Damaged = true;
+					else Value = Restored;
+				}
+				Row[RunIndex] = Value;
+				if ((RunIndex > 0) && (Row[RunIndex] == 0)) Damaged = true;
+				RowWidth += Row[RunIndex];
+			}
+		}
+		if (Damaged || (RowWidth != Width))
+		{
+			Rows.Assign(CurrentRow, &Width, 1);
+			return false;
+		}
+	}
+	return Cursor == End;
+}
+
+void RunData::Defer(DeferredRows *Source)
+{
+	assert(Deferred == nullptr);
+	assert(Source->RowCount == Rows.size());
+	Deferred = Source;
+}
+
+void RunData::Copy(RunData const &Source)
+{
+	assert((Deferred == nullptr) && (Rows.size() == 0));
+	Width = Source.Width;
+	Rows = Source.Rows;
+	if (Source.Deferred != nullptr) Deferred = new DeferredRows(*Source.Deferred);
+	Orientation = Source.Orientation;
+	Unoriented = Source.Unoriented;
+	Tagged = Source.Tagged;
+	Coverage.Invalidate();
+	Skips.Invalidate();
+}
+
+// The block holding Row is the last one starting at or before it
+static unsigned int FindBlock(std::vector<FileBlock> const &Index, unsigned int const &Row)
+{
+	return std::upper_bound(Index.begin(), Index.end(), Row,
+		[](unsigned int const &Row, FileBlock const &Entry) { return Row < Entry.FirstRow; }) - Index.begin() - 1;
+}
 
-		while (OldRun.Index() < StraddleRunIndex)
+void RunData::Materialize(unsigned int const &Top, unsigned int const &Bottom)
+{
+	if (Deferred != nullptr) Read(Top, Bottom);
+	Orient(Top, Bottom);
+}
+
+void RunData::Read(unsigned int const &Top, unsigned int const &Bottom)
+{
+	assert(Top <= Bottom);
+	assert(Bottom <= Rows.size());
+	std::vector<FileBlock> const &Index = Deferred->Index;
+	for (unsigned int Block = FindBlock(Index, Top); (Block < Index.size()) && (Index[Block].FirstRow < Bottom); ++Block)
+	{
+		if (Deferred->Read[Block]) continue;
+		Deferred->Read[Block] = true;
+		--Deferred->Remaining;
+
+		FileBlock const &Entry = Index[Block];
+		unsigned int const BlockBottom = (Block + 1 < Index.size()) ? Index[Block + 1].FirstRow : Rows.size();
+		uint8_t const *Compressed = Deferred->Bytes + Entry.Offset;
+		bool Succeeded;
+		if (Deferred->Method == CompressionMethod::None)
+			// Stored rows are read straight out of the mapped file
+			Succeeded = (Entry.CompressedSize == Entry.RawSize) &&
+				ReadRows(Entry.FirstRow, BlockBottom, RowFormat::Packed, Compressed, Entry.CompressedSize);
+		else
+		{
+			std::vector<uint8_t> &Raw = Deferred->Raw;
+			Raw.resize(Entry.RawSize);
+			Succeeded = Decompress(Deferred->Method, Compressed, Entry.CompressedSize, Raw.data(), Raw.size()) &&
+				ReadRows(Entry.FirstRow, BlockBottom, RowFormat::Packed, Raw.data(), Raw.size());
+		}
+		if (!Succeeded)
 		{
-			AddPreSplitRun(OldRun.IsBlack(), OldRun.Width());
-			OldRun.Advance();
+			std::cerr << Local("Part of the image is damaged and couldn't be read: ") << Deferred->Filename << std::endl;
+			FoundDamage = true;
 		}
+	}
+
+	if (Deferred->Remaining > 0) return;
+	delete Deferred;
+	Deferred = nullptr;
+}
+
+bool RunData::Damaged(void) const { return FoundDamage; }
+
+bool RunData::Materialized(unsigned int const &Row) const
+	{ return (Rows.GetTag(Row) == Orientation) && !InFile(Row); }
+
+bool RunData::InFile(unsigned int const &Row) const
+	{ return (Deferred != nullptr) && !Deferred->Read[FindBlock(Deferred->Index, Row)]; }
+
+// Orientations say where each column went: column X moved to Offset + X, or to Offset - X if mirrored, wrapping around
+// at the width.  They're stored as Offset * 2, plus 1 if mirrored, so 0 leaves the row as it was.
+static uint32_t MakeOrientation(bool const &Mirrored, unsigned int const &Offset)
+	{ return Offset * 2 + (Mirrored ? 1 : 0); }
+
+// Moving columns by Inner then Outer
+static uint32_t ComposeOrientations(uint32_t const &Outer, uint32_t const &Inner, unsigned int const &Width)
+{
+	bool const OuterMirrored = Outer & 1, InnerMirrored = Inner & 1;
+	unsigned int const OuterOffset = Outer >> 1, InnerOffset = Inner >> 1;
+	unsigned int const Moved = OuterMirrored ? (Width - InnerOffset) % Width : InnerOffset;
+	return MakeOrientation(OuterMirrored != InnerMirrored, (Moved + OuterOffset) % Width);
+}
+
+static uint32_t InvertOrientation(uint32_t const &Orientation, unsigned int const &Width)
+{
+	bool const Mirrored = Orientation & 1;
+	unsigned int const Offset = Orientation >> 1;
+	return MakeOrientation(Mirrored, Mirrored ? Offset : (Width - Offset) % Width);
+}
+
+void RunData::Orient(unsigned int const &Top, unsigned int const &Bottom)
+{
+	if (Unoriented == 0) return;
+	assert(Deferred == nullptr); // Flips and shifts read everything first
+	assert(Top <= Bottom);
+	assert(Bottom <= Rows.size());
+	for (unsigned int Row = Top; Row < Bottom; ++Row)
+		if (Rows.GetTag(Row) != Orientation) OrientRow(Row);
+	if (Unoriented > 0) return;
+
+	// Every row is the right way around, so start again from here
+	ResetOrientation();
+}
+
+void RunData::FlipVertically(void)
+{
+	if (Deferred != nullptr) Materialize(0, Rows.size()); // Rows still in the file can't be moved
+	Rows.Reverse();
+	Coverage.Invalidate();
+	Skips.Invalidate();
+}
+
+void RunData::FlipHorizontally(void)
+	{ SetOrientation(ComposeOrientations(MakeOrientation(true, Width - 1), Orientation, Width)); }
+
+void RunData::SetOrientation(uint32_t const &Target)
+{
+	// Rows are oriented when they're next used, and rows still in the file would be read the wrong way around
+	if (Deferred != nullptr) Materialize(0, Rows.size());
+	Coverage.Invalidate();
+	Skips.Invalidate();
+	if (Tagged.empty()) Tagged[Orientation] = Rows.size();
+	Orientation = Target;
+	auto const Found = Tagged.find(Orientation);
+	Unoriented = Rows.size() - ((Found == Tagged.end()) ? 0 : Found->second);
+	if (Unoriented == 0) Tagged.clear(); // Moved back to where the rows already are
+}
 
-		// If the run is split, write the opening portion as a final run
-		if (StraddleRunRemainder != OldRun.Width())
-			AddPreSplitRun(OldRun.IsBlack(), OldRun.Width() - StraddleRunRemainder);
+void RunData::ResetOrientation(void)
+{
+	assert(Unoriented == 0);
+	Tagged.clear();
+	if (Orientation == 0) return;
+	for (unsigned int Row = 0; Row < Rows.size(); ++Row) Rows.SetTag(Row, 0);
+	Orientation = 0;
+}
+
+void RunData::OrientRow(unsigned int const &Row)
+{
+	RunArray Runs;
+	uint32_t const Tag = Rows.GetTag(Row);
+	uint32_t const Remaining = CopyRow(Row, Runs);
+	OrientCopy(Runs, Remaining, Width);
+	Rows.Assign(Row, &Runs[0], Runs.size());
+
+	Rows.SetTag(Row, Orientation);
+	auto const Found = Tagged.find(Tag);
+	assert(Found != Tagged.end());
+	if (--Found->second == 0) Tagged.erase(Found);
+	++Tagged[Orientation];
+	--Unoriented;
+	Coverage.Invalidate(Row);
+	Skips.Invalidate(Row);
+}
+
+static void MirrorRuns(RunData::RunArray const &OldRuns, RunData::RunArray &NewRuns)
+{
+		
+	// If the last element was black, add a 0 width white to start the new row
+	unsigned int const WriteStartOffset = RunData::IsBlack(OldRuns.size() - 1) ? 1 : 0;
+
+	// If the first element of the old is 0, skip it
+	unsigned int const ReadStartOffset = (OldRuns[0] == 0) ? 1 : 0;
+
+	unsigned int const NewRunCount = OldRuns.size() + WriteStartOffset - ReadStartOffset;
+	NewRuns.resize(NewRunCount);
+
+	if (WriteStartOffset == 1)
+		NewRuns[0] = 0;
+
+	auto SetNewRun = [&](unsigned int const &NewIndex, unsigned int const &OldIndex)
+	{
+		assert(NewIndex < NewRunCount);
+		assert(NewIndex >= WriteStartOffset);
+		assert(OldIndex < OldRuns.size());
+		assert(OldIndex >= ReadStartOffset);
+		NewRuns[NewIndex] = OldRuns[OldIndex];
+	};
+	for (unsigned int NewRun = 0; NewRun < NewRunCount - WriteStartOffset; ++NewRun)
+		SetNewRun(WriteStartOffset + NewRun, OldRuns.size() - 1 - NewRun);
+}
+
+void RunData::ShiftHorizontally(int Columns)
+	{ SetOrientation(ComposeOrientations(MakeOrientation(false, Mod(Columns, Width)), Orientation, Width)); }
+
+// Right, less than the width
+static void ShiftRuns(RunData::RunArray const &OldRuns, unsigned int const &Columns, unsigned int const &Width,
+	RunData::RunArray &NewRuns)
+{
+	assert(Columns < Width);
+	// Split is where the end will be after the shift
+	unsigned int const Split = (Width - Columns) % Width;
+	
+	// Shift the row to align with the new split
+	assert(!OldRuns.empty());
+	NewRuns.clear();
+
+	class RunIterator
+	{
+		public:
+			RunIterator(RunData::RunArray const &Runs) : Runs(Runs), CurrentRun(0) 
+				{ assert(!Runs.empty()); RunRight = Runs[CurrentRun]; }
+
+			void Reset(void) { CurrentRun = 0; RunRight = Runs[CurrentRun]; }
+
+			bool CanAdvance(void) { return CurrentRun + 1 < Runs.size(); }
+
+			void Advance(void)
+			{
+				++CurrentRun;
+				assert(CurrentRun < Runs.size());
+				RunRight += Runs[CurrentRun];
+			}
+
+			unsigned int Right(void) { return RunRight; }
+
+			unsigned int Index(void) { return CurrentRun; }
+
+			unsigned int Width(void) { return Runs[CurrentRun]; }
+
+			bool IsBlack(void) { return RunData::IsBlack(CurrentRun); }
+
+		private:
+			RunData::RunArray const &Runs;
+			unsigned int CurrentRun, RunRight;
+
+	} OldRun(OldRuns);
+
+	// First, find the row that straddles/hits the division 
+	while (OldRun.Right() <= Split)
+		OldRun.Advance();
+
+	unsigned int const StraddleRunIndex = OldRun.Index();
+	
+	NewRuns.reserve(OldRuns.size() + 2); // Potential white padding + extra split run
+
+	// Write the runs to the end.
+	auto AddPostSplitRun = [&](bool Black, unsigned int Length)
+	{
+		assert(Length > 0);
+		if (NewRuns.empty() && Black)
+			NewRuns.push_back(0);
+		NewRuns.push_back(Length);
+	};
+
+	unsigned int const StraddleRunRemainder = OldRun.Right() - Split;
+	AddPostSplitRun(OldRun.IsBlack(), StraddleRunRemainder);
+
+	while (OldRun.CanAdvance())
+	{
+		OldRun.Advance();
+		AddPostSplitRun(OldRun.IsBlack(), OldRun.Width());
+	}
+
+	// Start from the beginning, and work back to the split.  Drop the initial padded white if present.
+	OldRun.Reset();
+
+	if (OldRun.Width() == 0)
+		OldRun.Advance();
+	
+	auto AddPreSplitRun = [&](bool Black, unsigned int Length)
+	{
+		assert(Length > 0);
+		assert(!NewRuns.empty());
+		if (RunData::IsBlack(NewRuns.size() - 1) == Black)
+			NewRuns.back() += Length;
+		else NewRuns.push_back(Length);
+	};
+
+	while (OldRun.Index() < StraddleRunIndex)
+	{
+		AddPreSplitRun(OldRun.IsBlack(), OldRun.Width());
+		OldRun.Advance();
+	}
+
+	// If the run is split, write the opening portion as a final run
+	if (StraddleRunRemainder != OldRun.Width())
+		AddPreSplitRun(OldRun.IsBlack(), OldRun.Width() - StraddleRunRemainder);
 
 #ifndef NDEBUG
-		/*unsigned int TestWidth = 0; 
-		for (auto const &Run : Rows[CurrentRow]) TestWidth += Run; 
-		assert(TestWidth == Width);*/
+	/*unsigned int TestWidth = 0; 
+	for (auto const &Run : NewRuns) TestWidth += Run; 
+	assert(TestWidth == Width);*/
 #endif
+}
+
+uint32_t RunData::CopyRow(unsigned int const &Row, RunArray &Out) const
+{
+	assert(!InFile(Row));
+	Out.assign(Rows[Row].begin(), Rows[Row].end());
+	return ComposeOrientations(Orientation, InvertOrientation(Rows.GetTag(Row), Width), Width);
+}
+
+void RunData::OrientCopy(RunArray &Runs, uint32_t const &Remaining, unsigned int const &Width)
+{
+	// Mirroring moves column X to Width - 1 - X, so the shift after it is 1 more than the offset
+	bool const Mirrored = Remaining & 1;
+	unsigned int const Columns = Mirrored ? ((Remaining >> 1) + 1) % Width : Remaining >> 1;
+	RunArray Turned;
+	if (Mirrored)
+	{
+		MirrorRuns(Runs, Turned);
+		Runs.swap(Turned);
+	}
+	if (Columns != 0)
+	{
+		ShiftRuns(Runs, Columns, Width, Turned);
+		Runs.swap(Turned);
 	}
 }
 
 void RunData::ShiftVertically(int Rows)
 {
-	unsigned int const Split = Mod(-Rows, this->Rows.size());
-	FlipSubsectionVertically(0, Split);
-	FlipSubsectionVertically(Split, this->Rows.size());
-	FlipSubsectionVertically(0, this->Rows.size());
+	if (Deferred != nullptr) Materialize(0, this->Rows.size()); // Rows still in the file can't be moved
+	this->Rows.Rotate(Mod(Rows, this->Rows.size()));
+	Coverage.Invalidate();
+	Skips.Invalidate();
 }
 		
 void RunData::Add(unsigned int const Left, unsigned int const Right, unsigned int const Up, unsigned int const Down)
 {
-	Rows.resize(Rows.size() + Up + Down);
+	Materialize(0, Rows.size());
+	ResetOrientation();
+	Coverage.Invalidate();
+	Skips.Invalidate();
+	unsigned int const OldHeight = Rows.size();
 	Width += Left + Right;
-	for (unsigned int NewRowReverseIndex = 0; NewRowReverseIndex < Rows.size(); NewRowReverseIndex++)
+	Rows.Resize(OldHeight + Up + Down, Width); // New rows are blank
+	for (unsigned int OldRowReverseIndex = 0; OldRowReverseIndex < OldHeight; OldRowReverseIndex++)
 	{
-		unsigned int const NewRowIndex = Rows.size() - 1 - NewRowReverseIndex;
-		RunArray &NewRow = Rows[NewRowIndex];
-		if ((NewRowIndex >= Up) && (NewRowIndex < Rows.size() - Down))
-		{
-			if (Up > 0)
-			{
-				assert(NewRow.empty());
-				NewRow.swap(Rows[NewRowIndex - Up]);
-			}
-			NewRow[0] += Left;
-			unsigned int const RightColumn = NewRow.size() - 1;
-			if ((Right > 0) && IsBlack(RightColumn))
-				NewRow.push_back(Right);
-			else NewRow[RightColumn] += Right;
-		}
-		else
-		{
-			assert(NewRow.empty());
-			NewRow.resize(1);
-			NewRow[0] = Width;
-		}
+		unsigned int const OldRowIndex = OldHeight - 1 - OldRowReverseIndex;
+		unsigned int const NewRowIndex = OldRowIndex + Up;
+		if (Up > 0) Rows.Swap(NewRowIndex, OldRowIndex); // Moves a blank row up
+		unsigned int const RightColumn = Rows[NewRowIndex].size() - 1;
+		Rows.Edit(NewRowIndex)[0] += Left;
+		if ((Right > 0) && IsBlack(RightColumn))
+			Rows.Splice(NewRowIndex, RightColumn + 1, 0, 1)[RightColumn + 1] = Right;
+		else Rows.Edit(NewRowIndex)[RightColumn] += Right;
 	}
 #ifndef NDEBUG
 	for (unsigned int Top = 0; Top < Up; ++Top)
@@ -470,6 +1276,10 @@ void RunData::Add(unsigned int const Left, unsigned int const Right, unsigned in
 
 void RunData::Remove(unsigned int const Left, unsigned int const Right, unsigned int const Up, unsigned int const Down)
 {
+	Materialize(0, Rows.size());
+	ResetOrientation();
+	Coverage.Invalidate();
+	Skips.Invalidate();
 #ifndef NDEBUG
 	for (unsigned int Top = 0; Top < Up; ++Top)
 	{
@@ -487,44 +1297,52 @@ void RunData::Remove(unsigned int const Left, unsigned int const Right, unsigned
 	for (unsigned int RemainingRow = 0; RemainingRow < RemainingRows; ++RemainingRow)
 	{
 		if (Up > 0)
-			Rows[RemainingRow].swap(Rows[RemainingRow + Up]);
+			Rows.Swap(RemainingRow, RemainingRow + Up);
 		assert(Rows[RemainingRow][0] >= Left);
-		Rows[RemainingRow][0] -= Left;
+		Rows.Edit(RemainingRow)[0] -= Left;
 		if (Right > 0)
 		{
 			unsigned int RightColumn = Rows[RemainingRow].size() - 1;
 			assert(!IsBlack(RightColumn));
 			assert(Rows[RemainingRow][RightColumn] >= Right);
 			if (Rows[RemainingRow][RightColumn] == Right)
-				Rows[RemainingRow].pop_back();
-			else Rows[RemainingRow][Rows[RemainingRow].size() - 1] -= Right;
+				Rows.Splice(RemainingRow, RightColumn, 1, 0);
+			else Rows.Edit(RemainingRow)[RightColumn] -= Right;
 		}
 	}
-	Rows.resize(RemainingRows);
+	Rows.Resize(RemainingRows, Width);
 }
 
 void RunData::Enlarge(unsigned int const Factor)
 {
+	Materialize(0, Rows.size());
+	ResetOrientation();
+	Coverage.Invalidate();
+	Skips.Invalidate();
 	assert(Factor >= 1);
 	if (Factor == 1) return;
 	unsigned int const OriginalHeight = Rows.size();
-	Rows.resize(OriginalHeight * Factor);
 	Width *= Factor;
+	Rows.Resize(OriginalHeight * Factor, Width);
 	for (unsigned int NewRowReverseIndex = 0; NewRowReverseIndex < OriginalHeight; ++NewRowReverseIndex)
 	{
 		unsigned int const NewRowIndex = Rows.size() - 1 - NewRowReverseIndex * Factor;
 		unsigned int const OldRowIndex = OriginalHeight - 1 - NewRowReverseIndex;
-		Rows[NewRowIndex].swap(Rows[OldRowIndex]);
-		assert(Rows[OldRowIndex].size() == 0);
-		for (auto &Run : Rows[NewRowIndex])
-			Run *= Factor;
+		Rows.Swap(NewRowIndex, OldRowIndex);
+		Run *Runs = Rows.Edit(NewRowIndex);
+		for (unsigned int RunIndex = 0; RunIndex < Rows[NewRowIndex].size(); ++RunIndex)
+			Runs[RunIndex] *= Factor;
 		for (unsigned int FactorStep = 1; FactorStep < Factor; ++FactorStep)
-			Rows[NewRowIndex - FactorStep] = Rows[NewRowIndex];
+			Rows.Copy(NewRowIndex - FactorStep, NewRowIndex);
 	}
 }
 		
 void RunData::Shrink(unsigned int const Factor)
 {
+	Materialize(0, Rows.size());
+	ResetOrientation();
+	Coverage.Invalidate();
+	Skips.Invalidate();
 	assert(Width % Factor == 0);
 	assert(Rows.size() % Factor == 0);
 	assert(Factor != 1);
@@ -532,175 +1350,650 @@ void RunData::Shrink(unsigned int const Factor)
 	Width /= Factor;
 	for (unsigned int RowIndex = 0; RowIndex < NewHeight; ++RowIndex)
 	{
-		auto &Row = Rows[RowIndex];
-		if (RowIndex > 1)
-			Row.swap(Rows[RowIndex * Factor]);
-		for (auto &Run : Row)
-			Run /= Factor;
+		if (RowIndex > 0)
+			Rows.Swap(RowIndex, RowIndex * Factor);
+		Run *Runs = Rows.Edit(RowIndex);
+		for (unsigned int RunIndex = 0; RunIndex < Rows[RowIndex].size(); ++RunIndex)
+			Runs[RunIndex] /= Factor;
 	}
-	Rows.resize(NewHeight);
+	Rows.Resize(NewHeight, Width);
 }
 		
 bool RunData::IsBlack(unsigned int const &Index) { return Index & 1; }
 		
-void RunData::FlipSubsectionVertically(unsigned int const &Start, unsigned int const &End)
+//////////////////////////////////////////////////////////////////////////////////////////
+// Run skip index
+void SkipIndex::Invalidate(void)
 {
-	assert(Start <= Rows.size());
-	assert(End <= Rows.size());
-	assert(Start <= End);
-
-	unsigned int const Half = (End - Start) / 2;
-	for (unsigned int CurrentRow = 0; CurrentRow < Half; ++CurrentRow)
-		Rows[Start + CurrentRow].swap(Rows[End - 1 - CurrentRow]);
+	Entries.clear();
+	Stale.clear();
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////
-// Undo levels
-
-Mark::Mark(RunData &Base) : Base(Base)
+void SkipIndex::Invalidate(unsigned int const &Row)
 {
-	Rows.resize(Base.Rows.size());
+	if (Row >= Stale.size()) return;
+	Stale[Row] = true;
+	Entries[Row].clear();
 }
 
-Change *Mark::Apply(bool &FlippedHorizontally, bool &FlippedVertically)
+void SkipIndex::Refresh(RowStore const &Rows, unsigned int const &Top, unsigned int const &Bottom)
 {
-	assert(Rows.size() == Base.Rows.size());
-	FlippedHorizontally = false;
-	FlippedVertically = false;
-	Mark *Out = new Mark(Base);
-	
-	for (unsigned int CurrentRow = 0; CurrentRow < Rows.size(); ++CurrentRow)
-		if (Rows[CurrentRow].size() > 0)
+	Prepare(Rows);
+	for (unsigned int Row = Top; Row < std::min(Bottom, Rows.size()); ++Row)
+		if (Stale[Row])
 		{
-			Out->AddLine(CurrentRow);
-			std::swap(Base.Rows[CurrentRow], Rows[CurrentRow]);
+			Build(Rows[Row], Entries[Row]);
+			Stale[Row] = false;
 		}
-
-	return Out;
 }
 
-Change::CombineResult Mark::Combine(Change *) { return Change::CombineResult::Fail; }
-
-void Mark::AddLine(unsigned int const &LineNumber)
+void SkipIndex::Find(RowStore const &Rows, unsigned int const &Row, unsigned int const &X, unsigned int &RunIndex, unsigned int &RunLeft)
 {
-	assert(LineNumber < Base.Rows.size());
-	assert(LineNumber < Rows.size());
+	Prepare(Rows);
+	assert(Row < Rows.size());
+	EntryArray &RowEntries = Entries[Row];
+	if (Stale[Row])
+	{
+		Build(Rows[Row], RowEntries);
+		Stale[Row] = false;
+	}
 
-	// Only add lines if they haven't already been added at this undo level (keep the state at the beginning of the undo)
-	if (Rows[LineNumber].size() > 0) return;
+	RunIndex = 0;
+	RunLeft = 0;
+	if (RowEntries.empty()) return;
 
-	Rows[LineNumber] = Base.Rows[LineNumber];
-	assert(Rows[LineNumber].size() > 0);
+	auto Next = std::lower_bound(RowEntries.begin(), RowEntries.end(), X,
+		[](Entry const &Skip, unsigned int const &X) { return Skip.Left < X; });
+	if (Next == RowEntries.begin()) return;
+	--Next;
+	RunIndex = Next->Index;
+	RunLeft = Next->Left;
 }
 
-HorizontalFlip::HorizontalFlip(RunData &Base) : Base(Base) { }
-
-Change *HorizontalFlip::Apply(bool &FlippedHorizontally, bool &FlippedVertically)
+void SkipIndex::Splice(RowStore const &Rows, unsigned int const &Row, unsigned int const &Position, unsigned int const &Erase, unsigned int const &Insert)
 {
-	FlippedHorizontally = true;
-	FlippedVertically = false;
-	Base.FlipHorizontally();
-	return new HorizontalFlip(Base);
-}
+	Prepare(Rows);
+	assert(Row < Rows.size());
+	if (Stale[Row]) return;
+	EntryArray &RowEntries = Entries[Row];
+	RowStore::Row const Runs = Rows[Row];
+	if (RowEntries.empty())
+	{
+		if (Runs.size() >= Spacing * 2) Stale[Row] = true;
+		return;
+	}
 
-Change::CombineResult HorizontalFlip::Combine(Change *Other) 
-{ 
-	if (typeid(*this) == typeid(*Other))
-		return Change::CombineResult::Nullify;
-	return Change::CombineResult::Fail;
+	// Drop entries for the replaced runs and renumber the ones after them.  The run at Position still starts in the
+	// same place.
+	assert(RowEntries[0].Index == 0);
+	auto Erased = std::upper_bound(RowEntries.begin(), RowEntries.end(), Position,
+		[](unsigned int const &Position, Entry const &Skip) { return Position < Skip.Index; });
+	auto Kept = std::lower_bound(Erased, RowEntries.end(), Position + Erase,
+		[](Entry const &Skip, unsigned int const &Index) { return Skip.Index < Index; });
+	unsigned int const Gap = Erased - RowEntries.begin();
+	RowEntries.erase(Erased, Kept);
+	for (auto Skip = RowEntries.begin() + Gap; Skip != RowEntries.end(); ++Skip)
+		Skip->Index = Skip->Index + Insert - Erase;
+
+	// Fill in the gap if it got too large
+	Entry Previous = RowEntries[Gap - 1];
+	unsigned int const NextIndex = (Gap < RowEntries.size()) ? RowEntries[Gap].Index : Runs.size();
+	if (NextIndex - Previous.Index <= Spacing * 2) return;
+	EntryArray Filler;
+	while (Previous.Index + Spacing < NextIndex)
+	{
+		for (unsigned int Step = 0; Step < Spacing; ++Step)
+			Previous.Left += Runs[Previous.Index + Step];
+		Previous.Index += Spacing;
+		Filler.push_back(Previous);
+	}
+	RowEntries.insert(RowEntries.begin() + Gap, Filler.begin(), Filler.end());
 }
 
-VerticalFlip::VerticalFlip(RunData &Base) : Base(Base) { }
-
-Change *VerticalFlip::Apply(bool &FlippedHorizontally, bool &FlippedVertically)
+void SkipIndex::Prepare(RowStore const &Rows)
 {
-	FlippedHorizontally = true;
-	FlippedVertically = false;
-	Base.FlipVertically();
-	return new VerticalFlip(Base);
+	if (Stale.size() == Rows.size()) return;
+	Entries.clear();
+	Entries.resize(Rows.size());
+	Stale.assign(Rows.size(), true);
 }
 
-Change::CombineResult VerticalFlip::Combine(Change *Other) 
-{ 
-	if (typeid(*this) == typeid(*Other))
-		return Change::CombineResult::Nullify;
-	return Change::CombineResult::Fail;
+void SkipIndex::Build(RowStore::Row const &Runs, EntryArray &RowEntries)
+{
+	RowEntries.clear();
+	if (Runs.size() < Spacing * 2) return; // Searching short rows is fast enough
+	RowEntries.reserve(Runs.size() / Spacing + 1);
+	Entry Next;
+	Next.Left = 0;
+	for (Next.Index = 0; Next.Index < Runs.size(); ++Next.Index)
+	{
+		if (Next.Index % Spacing == 0) RowEntries.push_back(Next);
+		Next.Left += Runs[Next.Index];
+	}
 }
 
-Shift::Shift(RunData &Base, int Right, int Down) : Base(Base), Right(Right), Down(Down) { }
+//////////////////////////////////////////////////////////////////////////////////////////
+// Coverage pyramid
+CoveragePyramid::CoveragePyramid(void) : Width(0), Height(0) {}
 
-Change *Shift::Apply(bool &, bool &)
-{
-	if (Right != 0) Base.ShiftHorizontally(Right);
-	if (Down != 0) Base.ShiftVertically(Down);
-	return new Shift(Base, -Right, -Down);
-}
+void CoveragePyramid::Invalidate(void) { Levels.clear(); }
 
-Change::CombineResult Shift::Combine(Change *Other)
+void CoveragePyramid::Invalidate(unsigned int const &Row)
 {
-	if (typeid(*this) == typeid(*Other))
+	for (auto &Level : Levels)
 	{
-		Right += static_cast<Shift *>(Other)->Right;
-		Down += static_cast<Shift *>(Other)->Down;
-		return Change::CombineResult::Combine;
+		assert(Row / Level.CellSize < Level.Dirty.size());
+		Level.Dirty[Row / Level.CellSize] = true;
 	}
-	return Change::CombineResult::Fail;
 }
 
-Add::Add(RunData &Base, unsigned int Left, unsigned int Right, unsigned int Up, unsigned int Down) : Base(Base), 
-	Left(Left), Right(Right), Up(Up), Down(Down)
-	{ }
+bool CoveragePyramid::Covers(unsigned int const &Scale) { return Scale >= BaseCellSize * 2; }
 
-Change *Add::Apply(bool &, bool &)
+void CoveragePyramid::Combine(RunData const &Base, unsigned int *Buffer,
+	unsigned int const BufferWidth, unsigned int const X, unsigned int const Y, unsigned int const Scale)
 {
-	Base.Add(Left, Right, Up, Down);
-	return new Remove(Base, Left, Right, Up, Down);
+	assert(Covers(Scale));
+	if (Levels.empty() || (Width != Base.Width) || (Height != Base.Rows.size())) Build(Base);
+
+	unsigned int const LevelIndex = ChooseLevel(Scale);
+	Level &Source = Levels[LevelIndex];
+	unsigned int const CellSize = Source.CellSize;
+
+	// Weigh each cell by the area it shares with each screen pixel.  Cells hanging off the edge of the image only contain
+	// pixels from within the image, so the overlap is measured against the unclipped screen pixels.
+	unsigned int const
+		RowStart = Y * Scale,
+		RowEnd = RowStart + Scale,
+		RowStop = std::min(RowEnd, Height);
+	if (RowStart >= RowStop) return;
+	unsigned int const
+		BufferLeft = X * Scale,
+		BufferEnd = BufferLeft + BufferWidth * Scale,
+		BufferRight = std::min(BufferEnd, Width);
+	if (BufferLeft >= BufferRight) return;
+
+	static thread_local std::vector<uint64_t> Weights;
+	Weights.assign(BufferWidth, 0);
+	for (unsigned int CellRow = RowStart / CellSize; CellRow * CellSize < RowStop; ++CellRow)
+	{
+		if (Source.Dirty[CellRow]) Refresh(Base, LevelIndex, CellRow);
+		unsigned int const RowOverlap =
+			std::min(RowEnd, CellRow * CellSize + CellSize) - std::max(RowStart, CellRow * CellSize);
+
+		unsigned int CellLeft = 0;
+		for (auto const &Span : Source.Rows[CellRow])
+		{
+			unsigned int const SpanLeft = CellLeft * CellSize;
+			CellLeft += Span.Length;
+			if (SpanLeft >= BufferRight) break;
+			if ((Span.Coverage == 0) || (CellLeft * CellSize <= BufferLeft)) continue;
+
+			for (unsigned int Cell = std::max(SpanLeft, BufferLeft - BufferLeft % CellSize) / CellSize;
+				(Cell < CellLeft) && (Cell * CellSize < BufferRight); ++Cell)
+			{
+				unsigned int const
+					PixelLeft = std::max(Cell * CellSize, BufferLeft),
+					PixelRight = std::min(Cell * CellSize + CellSize, BufferEnd);
+				for (unsigned int Column = (PixelLeft - BufferLeft) / Scale; Column * Scale + BufferLeft < PixelRight; ++Column)
+				{
+					unsigned int const ColumnOverlap =
+						std::min(PixelRight, BufferLeft + Column * Scale + Scale) - std::max(PixelLeft, BufferLeft + Column * Scale);
+					Weights[Column] += (uint64_t)Span.Coverage * ColumnOverlap * RowOverlap;
+				}
+			}
+		}
+	}
+
+	uint64_t const CellArea = CellSize * CellSize;
+	for (unsigned int Column = 0; Column < BufferWidth; ++Column)
+		Buffer[Column] += std::min((uint64_t)Scale * Scale, (Weights[Column] + CellArea / 2) / CellArea);
 }
 
-Change::CombineResult Add::Combine(Change *Other)
+void CoveragePyramid::Build(RunData const &Base)
 {
-	if (typeid(*this) == typeid(*Other))
+	Width = Base.Width;
+	Height = Base.Rows.size();
+	Levels.clear();
+	for (unsigned int CellSize = BaseCellSize; ; CellSize *= 2)
 	{
-		Left += static_cast<Add *>(Other)->Left;
-		Right += static_cast<Add *>(Other)->Right;
-		Up += static_cast<Add *>(Other)->Up;
-		Down += static_cast<Add *>(Other)->Down;
-		return Change::CombineResult::Combine;
+		Levels.push_back(Level());
+		Level &NewLevel = Levels.back();
+		NewLevel.CellSize = CellSize;
+		NewLevel.Rows.resize((Height + CellSize - 1) / CellSize);
+		NewLevel.Dirty.assign(NewLevel.Rows.size(), true);
+		if ((CellSize >= Width) && (CellSize >= Height)) break;
 	}
-	return Change::CombineResult::Fail;
 }
 
-Remove::Remove(RunData &Base, unsigned int Left, unsigned int Right, unsigned int Up, unsigned int Down) : Base(Base), 
-	Left(Left), Right(Right), Up(Up), Down(Down)
-	{ }
-
-Change *Remove::Apply(bool &, bool &)
+void CoveragePyramid::Prepare(RunData const &Base, unsigned int const &Y, unsigned int const &Height, unsigned int const &Scale)
 {
-	Base.Remove(Left, Right, Up, Down);
-	return new Remove(Base, Left, Right, Up, Down);
+	assert(Covers(Scale));
+	if (Levels.empty() || (Width != Base.Width) || (this->Height != Base.Rows.size())) Build(Base);
+
+	unsigned int const LevelIndex = ChooseLevel(Scale);
+	Level &Source = Levels[LevelIndex];
+	unsigned int const
+		RowStart = Y * Scale,
+		RowStop = std::min((Y + Height) * Scale, this->Height);
+	for (unsigned int CellRow = RowStart / Source.CellSize; CellRow * Source.CellSize < RowStop; ++CellRow)
+		if (Source.Dirty[CellRow]) Refresh(Base, LevelIndex, CellRow);
 }
 
-Change::CombineResult Remove::Combine(Change *Other)
+unsigned int CoveragePyramid::ChooseLevel(unsigned int const &Scale) const
 {
-	if (typeid(*this) == typeid(*Other))
+	// Use the largest cells that divide the scale evenly, otherwise the largest that are still at most half a screen pixel wide
+	unsigned int LevelIndex = 0;
+	bool Divides = false;
+	for (unsigned int Candidate = 0; Candidate < Levels.size(); ++Candidate)
 	{
-		Left += static_cast<Remove *>(Other)->Left;
-		Right += static_cast<Remove *>(Other)->Right;
-		Up += static_cast<Remove *>(Other)->Up;
-		Down += static_cast<Remove *>(Other)->Down;
-		return Change::CombineResult::Combine;
+		unsigned int const CellSize = Levels[Candidate].CellSize;
+		if (CellSize * 2 > Scale) break;
+		if (Scale % CellSize == 0) { LevelIndex = Candidate; Divides = true; }
+		else if (!Divides) LevelIndex = Candidate;
 	}
-	return Change::CombineResult::Fail;
+	return LevelIndex;
 }
 
-Enlarge::Enlarge(RunData &Base, unsigned int const &Factor) : Base(Base), Factor(Factor)
-	{}
-
-Change *Enlarge::Apply(bool &, bool &)
+void CoveragePyramid::Refresh(RunData const &Base, unsigned int const &LevelIndex, unsigned int const &Row)
 {
-	Base.Enlarge(Factor);
-	return new Shrink(Base, Factor);
-}
+	Level &Target = Levels[LevelIndex];
+	unsigned int const CellSize = Target.CellSize;
+
+	// Children share the scratch row, so bring them up to date first
+	if (LevelIndex > 0)
+		for (unsigned int SourceRow = Row * 2; SourceRow < std::min((unsigned int)Levels[LevelIndex - 1].Rows.size(), Row * 2 + 2); ++SourceRow)
+			if (Levels[LevelIndex - 1].Dirty[SourceRow]) Refresh(Base, LevelIndex - 1, SourceRow);
+
+	Cells.assign((Width + CellSize - 1) / CellSize, 0);
+
+	if (LevelIndex == 0)
+	{
+		// Count black pixels of each underlying image row
+		for (unsigned int ImageRow = Row * CellSize; ImageRow < std::min(Height, Row * CellSize + CellSize); ++ImageRow)
+		{
+			unsigned int RunLeft = 0;
+			for (unsigned int RunIndex = 0; RunIndex < Base.Rows[ImageRow].size(); ++RunIndex)
+			{
+				unsigned int const RunRight = RunLeft + Base.Rows[ImageRow][RunIndex];
+				if (RunData::IsBlack(RunIndex))
+					for (unsigned int Cell = RunLeft / CellSize; Cell * CellSize < RunRight; ++Cell)
+						Cells[Cell] += std::min(RunRight, Cell * CellSize + CellSize) - std::max(RunLeft, Cell * CellSize);
+				RunLeft = RunRight;
+			}
+		}
+	}
+	else
+	{
+		// Sum the quarters from the level below
+		Level &Source = Levels[LevelIndex - 1];
+		for (unsigned int SourceRow = Row * 2; SourceRow < std::min((unsigned int)Source.Rows.size(), Row * 2 + 2); ++SourceRow)
+		{
+			assert(!Source.Dirty[SourceRow]);
+			unsigned int SourceCell = 0;
+			for (auto const &Span : Source.Rows[SourceRow])
+			{
+				if (Span.Coverage != 0)
+					for (unsigned int Cell = SourceCell; Cell < SourceCell + Span.Length; ++Cell)
+						Cells[Cell / 2] += Span.Coverage;
+				SourceCell += Span.Length;
+			}
+		}
+	}
+
+	SpanArray &Spans = Target.Rows[Row];
+	Spans.clear();
+	for (auto const &Coverage : Cells)
+	{
+		if (!Spans.empty() && (Spans.back().Coverage == Coverage)) ++Spans.back().Length;
+		else Spans.push_back(Span{Coverage, 1});
+	}
+	Target.Dirty[Row] = false;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Undo levels
+
+Mark::Mark(RunData &Base) : Base(Base), FrozenSize(0), FrozenMethod(CompressionMethod::None), Store(nullptr),
+	SpillOffset(0), SpillSize(0), Lost(false) { }
+
+Mark::~Mark(void) { if (Store != nullptr) Store->Release(SpillOffset, SpillSize); }
+
+Change *Mark::Apply(bool &FlippedHorizontally, bool &FlippedVertically)
+{
+	FlippedHorizontally = false;
+	FlippedVertically = false;
+	if (!Thaw()) return nullptr;
+	if (!Fits())
+	{
+		std::cerr << Local("An undo level was damaged and couldn't be used") << std::endl;
+		return nullptr;
+	}
+	Mark *Out = new Mark(Base);
+	
+	// Both directions share the same ends, so the undo for each row is just the middle that's being replaced
+	for (auto &Entry : Rows)
+	{
+		assert(Entry.first < Base.Rows.size());
+		Span const &Stored = Entry.second;
+		Base.Materialize(Entry.first, Entry.first + 1);
+		RowStore::Row const Current = Base.Rows[Entry.first];
+
+		Span &Undo = Out->Rows.emplace_hint(Out->Rows.end(), Entry.first, Span())->second;
+		Undo.Start = Stored.Start;
+		Undo.Tail = Stored.Tail;
+		Undo.Runs.assign(Current.begin() + Stored.Start, Current.end() - Stored.Tail);
+
+		RunData::RunArray Replacement;
+		Replacement.reserve(Stored.Start + Stored.Runs.size() + Stored.Tail);
+		Replacement.insert(Replacement.end(), Current.begin(), Current.begin() + Stored.Start);
+		Replacement.insert(Replacement.end(), Stored.Runs.begin(), Stored.Runs.end());
+		Replacement.insert(Replacement.end(), Current.end() - Stored.Tail, Current.end());
+		Base.SwapRow(Entry.first, Replacement);
+	}
+
+	return Out;
+}
+
+Change::CombineResult Mark::Combine(Change *) { return Change::CombineResult::Fail; }
+
+bool Mark::ChangedRows(std::vector<unsigned int> &Out) const
+{
+	if (!Frozen.empty() || (Store != nullptr)) return false;
+	for (auto const &Entry : Rows) Out.push_back(Entry.first);
+	return true;
+}
+
+void Mark::AddLine(unsigned int const &LineNumber)
+{
+	assert(LineNumber < Base.Rows.size());
+
+	// Only add lines if they haven't already been added at this undo level (keep the state at the beginning of the undo)
+	auto Found = Rows.lower_bound(LineNumber);
+	if ((Found != Rows.end()) && (Found->first == LineNumber)) return;
+	Base.Materialize(LineNumber, LineNumber + 1);
+
+	RowStore::Row const Original = Base.Rows[LineNumber];
+	Span &Added = Rows.emplace_hint(Found, LineNumber, Span())->second;
+	Added.Start = 0;
+	Added.Tail = 0;
+	Added.Runs.assign(Original.begin(), Original.end());
+	assert(Added.Runs.size() > 0);
+}
+
+void Mark::Finish(void)
+{
+	for (auto Entry = Rows.begin(); Entry != Rows.end();)
+	{
+		Span &Stored = Entry->second;
+		assert((Stored.Start == 0) && (Stored.Tail == 0));
+		RowStore::Row const Current = Base.Rows[Entry->first];
+		unsigned int const Shorter = std::min((unsigned int)Stored.Runs.size(), Current.size());
+
+		unsigned int Start = 0;
+		while ((Start < Shorter) && (Stored.Runs[Start] == Current[Start])) ++Start;
+		if ((Start == Stored.Runs.size()) && (Start == Current.size()))
+		{
+			// The stroke didn't change this row after all
+			Entry = Rows.erase(Entry);
+			continue;
+		}
+
+		// Run colors alternate from the start of the row, so the ends only match if the run counts differ by an even
+		// number
+		unsigned int Tail = 0;
+		if ((Stored.Runs.size() - Current.size()) % 2 == 0)
+			while ((Start + Tail < Shorter) &&
+				(Stored.Runs[Stored.Runs.size() - 1 - Tail] == Current[Current.size() - 1 - Tail])) ++Tail;
+
+		Stored.Runs.erase(Stored.Runs.end() - Tail, Stored.Runs.end());
+		Stored.Runs.erase(Stored.Runs.begin(), Stored.Runs.begin() + Start);
+		Stored.Runs.shrink_to_fit();
+		Stored.Start = Start;
+		Stored.Tail = Tail;
+		++Entry;
+	}
+}
+
+size_t Mark::Footprint(void) const
+{
+	if (Store != nullptr) return sizeof(Mark);
+	if (!Frozen.empty()) return sizeof(Mark) + Frozen.capacity();
+
+	// Map nodes hold the key and span along with three links and a color
+	size_t Total = sizeof(Mark) + Rows.size() * (sizeof(unsigned int) + sizeof(Span) + 4 * sizeof(void *));
+	for (auto const &Entry : Rows) Total += Entry.second.Runs.capacity() * sizeof(RunData::Run);
+	return Total;
+}
+
+// Undo levels are decompressed while the user waits, so they use the fastest method available
+static CompressionMethod UndoCompression(void)
+{
+	if (CompressionAvailable(CompressionMethod::LZ4)) return CompressionMethod::LZ4;
+	if (CompressionAvailable(CompressionMethod::ZStandard)) return CompressionMethod::ZStandard;
+	return CompressionMethod::None; // Packing alone still makes most runs a byte
+}
+
+void Mark::Freeze(UndoStore *Target)
+{
+	if (!Rows.empty()) Pack();
+	if ((Target == nullptr) || Frozen.empty()) return;
+	if (!Target->Write(Frozen, SpillOffset)) return;
+	Store = Target;
+	SpillSize = Frozen.size();
+	std::vector<uint8_t>().swap(Frozen);
+}
+
+void Mark::Prefetch(void)
+{
+	if (Store == nullptr) return;
+	Frozen.resize(SpillSize);
+	if (!Store->Read(SpillOffset, Frozen))
+	{
+		std::cerr << Local("Could not read an undo level back from its temporary file") << std::endl;
+		std::vector<uint8_t>().swap(Frozen);
+		Lost = true;
+	}
+	Store->Release(SpillOffset, SpillSize);
+	Store = nullptr;
+}
+
+void Mark::Pack(void)
+{
+	// Each row is the distance from the row before, the number of runs kept at the start and end, and the stored runs
+	std::vector<uint8_t> Raw;
+	unsigned int Last = 0;
+	for (auto const &Entry : Rows)
+	{
+		Span const &Stored = Entry.second;
+		size_t const Start = Raw.size();
+		Raw.resize(Start + 5 * (Stored.Runs.size() + 4));
+		uint8_t *Cursor = &Raw[Start];
+		PutNumber(Cursor, Entry.first - Last);
+		PutNumber(Cursor, Stored.Start);
+		PutNumber(Cursor, Stored.Tail);
+		PutNumber(Cursor, Stored.Runs.size());
+		for (auto const &Run : Stored.Runs) PutNumber(Cursor, Run);
+		Raw.resize(Cursor - &Raw[0]);
+		Last = Entry.first;
+	}
+
+	CompressionMethod const Method = UndoCompression();
+	if (!Compress(Method, Raw, Frozen))
+	{
+		Frozen.clear();
+		return;
+	}
+	Frozen.shrink_to_fit();
+	FrozenSize = Raw.size();
+	FrozenMethod = Method;
+	Rows.clear();
+}
+
+bool Mark::Thaw(void)
+{
+	Prefetch();
+	if (Lost) return false;
+	if (Frozen.empty()) return true;
+
+	std::vector<uint8_t> Raw(FrozenSize);
+	bool Intact = Decompress(FrozenMethod, Frozen.data(), Frozen.size(), Raw.data(), Raw.size());
+	std::vector<uint8_t>().swap(Frozen);
+
+	uint8_t const *Cursor = Raw.data(), *End = Raw.data() + Raw.size();
+	unsigned int Row = 0;
+	while (Intact && (Cursor < End))
+	{
+		uint32_t Distance, Count;
+		Span Stored;
+		// Every run takes at least a byte, and rows after the first have to move down
+		Intact = GetNumber(Cursor, End, Distance) && GetNumber(Cursor, End, Stored.Start) &&
+			GetNumber(Cursor, End, Stored.Tail) && GetNumber(Cursor, End, Count) &&
+			(Count <= (size_t)(End - Cursor)) && (Rows.empty() || (Distance > 0));
+		if (!Intact) break;
+		Stored.Runs.resize(Count);
+		for (auto &Run : Stored.Runs)
+			if (!(Intact = GetNumber(Cursor, End, Run))) break;
+		Row += Distance;
+		Rows.emplace_hint(Rows.end(), Row, std::move(Stored));
+	}
+	if (Intact) return true;
+
+	std::cerr << Local("An undo level was damaged and couldn't be used") << std::endl;
+	Rows.clear();
+	Lost = true;
+	return false;
+}
+
+bool Mark::Fits(void)
+{
+	for (auto const &Entry : Rows)
+	{
+		if (Entry.first >= Base.Rows.size()) return false;
+		Span const &Stored = Entry.second;
+		Base.Materialize(Entry.first, Entry.first + 1);
+		RowStore::Row const Current = Base.Rows[Entry.first];
+		if ((Stored.Start > Current.size()) || (Stored.Tail > Current.size() - Stored.Start)) return false;
+
+		// The kept end has to stay the same color, and the new row has to be as wide as the image
+		if ((Stored.Tail > 0) && ((Stored.Start + Stored.Runs.size() + Stored.Tail - Current.size()) % 2 != 0))
+			return false;
+		uint64_t Width = 0;
+		for (unsigned int Index = 0; Index < Stored.Start; ++Index) Width += Current[Index];
+		for (auto const &Run : Stored.Runs) Width += Run;
+		for (unsigned int Index = Current.size() - Stored.Tail; Index < Current.size(); ++Index) Width += Current[Index];
+		if (Width != Base.Width) return false;
+	}
+	return true;
+}
+
+HorizontalFlip::HorizontalFlip(RunData &Base) : Base(Base) { }
+
+Change *HorizontalFlip::Apply(bool &FlippedHorizontally, bool &FlippedVertically)
+{
+	FlippedHorizontally = true;
+	FlippedVertically = false;
+	Base.FlipHorizontally();
+	return new HorizontalFlip(Base);
+}
+
+Change::CombineResult HorizontalFlip::Combine(Change *Other) 
+{ 
+	if (typeid(*this) == typeid(*Other))
+		return Change::CombineResult::Nullify;
+	return Change::CombineResult::Fail;
+}
+
+VerticalFlip::VerticalFlip(RunData &Base) : Base(Base) { }
+
+Change *VerticalFlip::Apply(bool &FlippedHorizontally, bool &FlippedVertically)
+{
+	FlippedHorizontally = true;
+	FlippedVertically = false;
+	Base.FlipVertically();
+	return new VerticalFlip(Base);
+}
+
+Change::CombineResult VerticalFlip::Combine(Change *Other) 
+{ 
+	if (typeid(*this) == typeid(*Other))
+		return Change::CombineResult::Nullify;
+	return Change::CombineResult::Fail;
+}
+
+Shift::Shift(RunData &Base, int Right, int Down) : Base(Base), Right(Right), Down(Down) { }
+
+Change *Shift::Apply(bool &, bool &)
+{
+	if (Right != 0) Base.ShiftHorizontally(Right);
+	if (Down != 0) Base.ShiftVertically(Down);
+	return new Shift(Base, -Right, -Down);
+}
+
+Change::CombineResult Shift::Combine(Change *Other)
+{
+	if (typeid(*this) == typeid(*Other))
+	{
+		Right += static_cast<Shift *>(Other)->Right;
+		Down += static_cast<Shift *>(Other)->Down;
+		return Change::CombineResult::Combine;
+	}
+	return Change::CombineResult::Fail;
+}
+
+Add::Add(RunData &Base, unsigned int Left, unsigned int Right, unsigned int Up, unsigned int Down) : Base(Base), 
+	Left(Left), Right(Right), Up(Up), Down(Down)
+	{ }
+
+Change *Add::Apply(bool &, bool &)
+{
+	Base.Add(Left, Right, Up, Down);
+	return new Remove(Base, Left, Right, Up, Down);
+}
+
+Change::CombineResult Add::Combine(Change *Other)
+{
+	if (typeid(*this) == typeid(*Other))
+	{
+		Left += static_cast<Add *>(Other)->Left;
+		Right += static_cast<Add *>(Other)->Right;
+		Up += static_cast<Add *>(Other)->Up;
+		Down += static_cast<Add *>(Other)->Down;
+		return Change::CombineResult::Combine;
+	}
+	return Change::CombineResult::Fail;
+}
+
+Remove::Remove(RunData &Base, unsigned int Left, unsigned int Right, unsigned int Up, unsigned int Down) : Base(Base), 
+	Left(Left), Right(Right), Up(Up), Down(Down)
+	{ }
+
+Change *Remove::Apply(bool &, bool &)
+{
+	Base.Remove(Left, Right, Up, Down);
+	return new Remove(Base, Left, Right, Up, Down);
+}
+
+Change::CombineResult Remove::Combine(Change *Other)
+{
+	if (typeid(*this) == typeid(*Other))
+	{
+		Left += static_cast<Remove *>(Other)->Left;
+		Right += static_cast<Remove *>(Other)->Right;
+		Up += static_cast<Remove *>(Other)->Up;
+		Down += static_cast<Remove *>(Other)->Down;
+		return Change::CombineResult::Combine;
+	}
+	return Change::CombineResult::Fail;
+}
+
+Enlarge::Enlarge(RunData &Base, unsigned int const &Factor) : Base(Base), Factor(Factor)
+	{}
+
+Change *Enlarge::Apply(bool &, bool &)
+{
+	Base.Enlarge(Factor);
+	return new Shrink(Base, Factor);
+}
 
 Change::CombineResult Enlarge::Combine(Change *Other)
 {
@@ -709,200 +2002,1298 @@ Change::CombineResult Enlarge::Combine(Change *Other)
 		Factor *= static_cast<Enlarge *>(Other)->Factor;
 		return Change::CombineResult::Combine;
 	}
-	return Change::CombineResult::Fail;
-}
+	return Change::CombineResult::Fail;
+}
+
+Shrink::Shrink(RunData &Base, unsigned int const &Factor) : Base(Base), Factor(Factor)
+	{}
+
+Change *Shrink::Apply(bool &, bool &)
+{
+	Base.Shrink(Factor);
+	return new Shrink(Base, Factor);
+}
+
+Change::CombineResult Shrink::Combine(Change *Other)
+{
+	if (typeid(*this) == typeid(*Other))
+	{
+		Factor *= static_cast<Shrink *>(Other)->Factor;
+		return Change::CombineResult::Combine;
+	}
+	return Change::CombineResult::Fail;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Display tile cache
+bool RenderCache::Key::operator<(Key const &Other) const
+{
+	if (Scale != Other.Scale) return Scale < Other.Scale;
+	if (Row != Other.Row) return Row < Other.Row;
+	return Column < Other.Column;
+}
+
+RenderCache::RenderCache(void) : Limit(0), Used(0) {}
+
+RenderCache::~RenderCache(void) { Clear(); }
+
+void RenderCache::SetLimit(size_t const &Bytes)
+{
+	Limit = Bytes;
+	while ((Used > Limit) && !Uses.empty())
+		Drop(Tiles.find(Uses.back()));
+}
+
+bool RenderCache::IsEnabled(void) const
+	{ return Limit >= TileSize * TileSize * sizeof(uint32_t); }
+
+static bool SameColor(Color const &First, Color const &Second)
+{
+	return (First.Red == Second.Red) && (First.Green == Second.Green) &&
+		(First.Blue == Second.Blue) && (First.Alpha == Second.Alpha);
+}
+
+void RenderCache::SetColors(Color const &Foreground, Color const &Background)
+{
+	if (SameColor(this->Foreground, Foreground) && SameColor(this->Background, Background)) return;
+	Clear();
+	this->Foreground = Foreground;
+	this->Background = Background;
+}
+
+cairo_surface_t *RenderCache::Find(unsigned int const &Scale, unsigned int const &Column, unsigned int const &Row)
+{
+	auto Found = Tiles.find(Key{Scale, Column, Row});
+	if (Found == Tiles.end()) return nullptr;
+	Uses.splice(Uses.begin(), Uses, Found->second.Use);
+	return Found->second.Tile;
+}
+
+void RenderCache::Store(unsigned int const &Scale, unsigned int const &Column, unsigned int const &Row, cairo_surface_t *Tile)
+{
+	assert(IsEnabled());
+	Key const NewKey{Scale, Column, Row};
+	auto Found = Tiles.find(NewKey);
+	if (Found != Tiles.end()) Drop(Found);
+
+	size_t const TileBytes = cairo_image_surface_get_stride(Tile) * cairo_image_surface_get_height(Tile);
+	while ((Used + TileBytes > Limit) && !Uses.empty())
+		Drop(Tiles.find(Uses.back()));
+
+	Uses.push_front(NewKey);
+	Tiles[NewKey] = Entry{Tile, Uses.begin()};
+	Used += TileBytes;
+}
+
+void RenderCache::Invalidate(unsigned int const &Left, unsigned int const &Right, unsigned int const &Top, unsigned int const &Bottom)
+{
+	if ((Left >= Right) || (Top >= Bottom)) return;
+	for (auto Position = Tiles.begin(); Position != Tiles.end();)
+	{
+		auto Current = Position++;
+		unsigned int const Span = TileSize * Current->first.Scale;
+		if ((Current->first.Column * Span < Right) && ((Current->first.Column + 1) * Span > Left) &&
+			(Current->first.Row * Span < Bottom) && ((Current->first.Row + 1) * Span > Top))
+			Drop(Current);
+	}
+}
+
+void RenderCache::Clear(void)
+{
+	while (!Tiles.empty())
+		Drop(Tiles.begin());
+	assert(Used == 0);
+}
+
+void RenderCache::Drop(std::map<Key, Entry>::iterator const &Position)
+{
+	assert(Position != Tiles.end());
+	cairo_surface_t *Tile = Position->second.Tile;
+	Used -= cairo_image_surface_get_stride(Tile) * cairo_image_surface_get_height(Tile);
+	cairo_surface_destroy(Tile);
+	Uses.erase(Position->second.Use);
+	Tiles.erase(Position);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Autosave journal
+char const JournalIdentifier[32] = "inscribble journal v00\n";
+
+ChangeJournal::RowSet::RowSet(void) : All(false), Any(false) {}
+
+void ChangeJournal::RowSet::Add(unsigned int const &Row)
+{
+	if (All) return;
+	if (Row >= Rows.size()) Rows.resize(Row + 1, false);
+	Rows[Row] = true;
+	Any = true;
+}
+
+void ChangeJournal::RowSet::AddAll(void)
+{
+	Rows.clear();
+	All = Any = true;
+}
+
+void ChangeJournal::RowSet::Clear(void)
+{
+	Rows.clear();
+	All = Any = false;
+}
+
+bool ChangeJournal::RowSet::Empty(void) const { return !Any; }
+
+bool ChangeJournal::RowSet::Contains(unsigned int const &Row) const
+	{ return All || ((Row < Rows.size()) && Rows[Row]); }
+
+ChangeJournal::ChangeJournal(void) : Saving(false), Lock(-1), Length(0), CompactLength(0), Refused(false) {}
+
+ChangeJournal::~ChangeJournal(void)
+{
+	Wait();
+	if (Lock != -1) close(Lock);
+}
+
+String ChangeJournal::Locate(String const &ImageFilename) { return ImageFilename + ".journal"; }
+
+// Journals for images that were never saved go in the configuration directory, named for the process and numbered
+char const UntitledJournalPrefix[] = "untitled-", UntitledJournalSuffix[] = ".inscribble.journal";
+
+bool ChangeJournal::Claim(String const &ImageFilename)
+{
+	if (Lock != -1) return false;
+
+	std::vector<String> Candidates;
+	if (!ImageFilename.empty()) Candidates.push_back(Locate(ImageFilename));
+	else
+	{
+		String const Example = (String)LocateUserConfigFile(String(UntitledJournalPrefix) + UntitledJournalSuffix);
+		gchar *Directory = g_path_get_dirname(Example.c_str());
+		GDir *Listing = g_dir_open(Directory, 0, nullptr);
+		g_free(Directory);
+		if (Listing != nullptr)
+		{
+			String const Prefix = UntitledJournalPrefix, Suffix = UntitledJournalSuffix;
+			while (gchar const *Entry = g_dir_read_name(Listing))
+			{
+				String const Name = Entry;
+				if ((Name.size() > Prefix.size() + Suffix.size()) && (Name.compare(0, Prefix.size(), Prefix) == 0) &&
+					(Name.compare(Name.size() - Suffix.size(), Suffix.size(), Suffix) == 0))
+					Candidates.push_back((String)LocateUserConfigFile(Name));
+			}
+			g_dir_close(Listing);
+		}
+	}
+
+	for (String const &Candidate : Candidates)
+	{
+		// Sessions still running hold theirs locked
+		if (!Hold(Candidate, O_RDWR)) continue;
+		// A session that ended before its first record was written leaves an empty journal
+		struct stat Status;
+		if ((fstat(Lock, &Status) == 0) && (Status.st_size > 0)) return true;
+		Discard();
+	}
+	return false;
+}
+
+// Opens and locks a journal, failing with errno set to EWOULDBLOCK if another session has it.  The name is checked
+// again once the lock is held, in case the session that had it deleted it in the meantime.
+bool ChangeJournal::Hold(String const &Filename, int const &Flags)
+{
+	int const Descriptor = open(Filename.c_str(), Flags | O_CLOEXEC, 0644);
+	if (Descriptor == -1) return false;
+	struct stat Held, Named;
+	if ((flock(Descriptor, LOCK_EX | LOCK_NB) != 0) || (fstat(Descriptor, &Held) != 0) ||
+		(stat(Filename.c_str(), &Named) != 0) || (Held.st_dev != Named.st_dev) || (Held.st_ino != Named.st_ino))
+	{
+		close(Descriptor);
+		errno = EWOULDBLOCK;
+		return false;
+	}
+	Path = Filename;
+	Lock = Descriptor;
+	Length = Held.st_size;
+	CompactLength = 0;
+	return true;
+}
+
+bool ChangeJournal::Open(String const &ImageFilename)
+{
+	if (Lock != -1) return true;
+	if (Refused) return false;
+
+	if (ImageFilename.empty())
+	{
+		// Numbered past any left by an earlier process with the same id, or being claimed by another session
+		static std::atomic<unsigned int> Count(0);
+		String Filename;
+		do
+		{
+			Filename = (String)LocateUserConfigFile(UntitledJournalPrefix + AsString(getpid()) + "-" + AsString(Count++) +
+				UntitledJournalSuffix);
+			if (Hold(Filename, O_WRONLY | O_CREAT | O_EXCL)) return true;
+		} while ((errno == EEXIST) || (errno == EWOULDBLOCK));
+		std::cerr << Local("Could not open for writing: ") << Filename << std::endl;
+	}
+	else
+	{
+		String const Filename = Locate(ImageFilename);
+		if (Hold(Filename, O_WRONLY | O_CREAT)) return true;
+		if (errno == EWOULDBLOCK)
+			std::cerr << Local("Another window is keeping a journal for this image, so changes made here won't be journaled until it's saved: ") <<
+				Filename << std::endl;
+		else std::cerr << Local("Could not open for writing: ") << Filename << std::endl;
+	}
+	Refused = true;
+	return false;
+}
+
+// Each record is the image width and height, the compression method, the uncompressed and compressed sizes, and a CRC
+// of those and the compressed rows, followed by the compressed rows.
+unsigned int const JournalRecordWords = 6;
+uint64_t const JournalSlackBytes = 1 << 20; // Journals are never compacted while they're smaller than this
+
+bool ChangeJournal::Replay(RunData *&Data)
+{
+	Wait();
+	if (Lock == -1) return false;
+	FILE *Input = fopen(Path.c_str(), "rb");
+	if (Input == nullptr) return false;
+
+	bool Applied = false;
+	char Identifier[32];
+	off_t FileSize = 0;
+	if ((fseeko(Input, 0, SEEK_END) == 0) && ((FileSize = ftello(Input)) > 0) && (fseeko(Input, 0, SEEK_SET) == 0) &&
+		(fread(Identifier, sizeof(char), 32, Input) == 32) && (memcmp(Identifier, JournalIdentifier, 32) == 0))
+		while (true)
+		{
+			/// Read and check a record
+			LittleEndian<uint32_t> Header[JournalRecordWords];
+			if (fread(Header, sizeof(Header), 1, Input) != 1) break;
+			uint32_t const Width = Header[0], RowCount = Header[1], RawSize = Header[3], CompressedSize = Header[4];
+			CompressionMethod const Method = (CompressionMethod)(uint32_t)Header[2];
+			if ((Width < 1) || (RowCount < 1) || !CompressionAvailable(Method) ||
+				(CompressedSize > FileSize - ftello(Input))) break;
+
+			std::vector<uint8_t> Compressed(CompressedSize);
+			if (fread(Compressed.data(), 1, Compressed.size(), Input) != Compressed.size()) break;
+			uLong Check = crc32(0, (Bytef const *)Header, sizeof(LittleEndian<uint32_t>) * (JournalRecordWords - 1));
+			Check = crc32(Check, Compressed.data(), Compressed.size());
+			if (Check != Header[5]) break;
+
+			// Every row takes at least its position and size, and each run at most 5 bytes
+			if ((uint64_t)RawSize > (uint64_t)RowCount * (10 + 5 * ((uint64_t)Width + 2))) break;
+			std::vector<uint8_t> Raw(RawSize);
+			if (!Decompress(Method, Compressed.data(), Compressed.size(), Raw.data(), Raw.size())) break;
+
+			/// Apply the rows
+			if ((Data->Width != Width) || (Data->Rows.size() != RowCount))
+			{
+				delete Data;
+				Data = new RunData(FlatVector(Width, RowCount));
+			}
+			uint8_t const *Cursor = Raw.data(), *End = Raw.data() + Raw.size();
+			uint64_t Row = 0;
+			bool Damaged = false;
+			for (bool First = true; !Damaged && (Cursor < End); First = false)
+			{
+				uint32_t Distance, Size;
+				Damaged = !GetNumber(Cursor, End, Distance) || !GetNumber(Cursor, End, Size) ||
+					(!First && (Distance == 0)) || ((Row += Distance) >= RowCount) || (Size > (size_t)(End - Cursor));
+				if (Damaged) break;
+				Data->Materialize(Row, Row + 1);
+				Damaged = !Data->ReadRows(Row, Row + 1, RunData::RowFormat::Packed, Cursor, Size);
+				Cursor += Size;
+			}
+			if (Damaged) break;
+			Applied = true;
+		}
+	fclose(Input);
+	if (Applied) Data->Rows.Compact();
+	return Applied;
+}
+
+void ChangeJournal::Touch(unsigned int const &Row)
+{
+	Touched.Add(Row);
+	if (Saving) SinceSave.Add(Row);
+}
+
+void ChangeJournal::TouchAll(void)
+{
+	Touched.AddAll();
+	if (Saving) SinceSave.AddAll();
+}
+
+void ChangeJournal::Append(std::vector<RowCopy> Copies, uint32_t const Width, uint32_t const RowCount,
+	CompressionMethod const Method, bool const Replace)
+{
+	/// Turn the rows and pack each as the distance from the row before, its size, and its runs, the same as
+	/// RunData::WriteRows packs a row on its own
+	std::vector<uint8_t> Raw, Row;
+	unsigned int Last = 0;
+	for (RowCopy &Copy : Copies)
+	{
+		RunData::OrientCopy(Copy.Runs, Copy.Remaining, Width);
+		Row.resize(5 * (Copy.Runs.size() + 1));
+		uint8_t *RowCursor = &Row[0];
+		PutNumber(RowCursor, Copy.Runs.size() << 1);
+		for (auto const &Run : Copy.Runs) PutNumber(RowCursor, Run);
+		Row.resize(RowCursor - &Row[0]);
+		std::vector<RunData::Run>().swap(Copy.Runs);
+
+		size_t const Start = Raw.size();
+		Raw.resize(Start + 10 + Row.size());
+		uint8_t *Cursor = &Raw[Start];
+		PutNumber(Cursor, Copy.Row - Last);
+		PutNumber(Cursor, Row.size());
+		Cursor = std::copy(Row.begin(), Row.end(), Cursor);
+		Raw.resize(Cursor - &Raw[0]);
+		Last = Copy.Row;
+	}
+
+	std::vector<uint8_t> Compressed;
+	if (!Compress(Method, Raw, Compressed))
+	{
+		std::cerr << Local("Failed to compress the journal: ") << Path << std::endl;
+		return;
+	}
+
+	/// Write the record
+	String const Filename = Replace ? Path + ".new" : Path;
+	FILE *Output = fopen(Filename.c_str(), Replace ? "wb" : "ab");
+	if (Output == nullptr)
+	{
+		std::cerr << Local("Could not open for writing: ") << Filename << std::endl;
+		return;
+	}
+	// The replacement is locked before it takes the journal's place, so no other session can claim it
+	int const ReplacementLock = Replace ? dup(fileno(Output)) : -1;
+
+	bool Wrote = (!Replace || ((ReplacementLock != -1) && (flock(ReplacementLock, LOCK_EX | LOCK_NB) == 0))) &&
+		(fseeko(Output, 0, SEEK_END) == 0);
+	if (Wrote && (ftello(Output) == 0)) Wrote = fwrite(JournalIdentifier, sizeof(char), 32, Output) == 32;
+
+	LittleEndian<uint32_t> Header[JournalRecordWords];
+	Header[0] = Width;
+	Header[1] = RowCount;
+	Header[2] = (uint32_t)Method;
+	Header[3] = Raw.size();
+	Header[4] = Compressed.size();
+	uLong Check = crc32(0, (Bytef const *)Header, sizeof(LittleEndian<uint32_t>) * (JournalRecordWords - 1));
+	Header[5] = crc32(Check, Compressed.data(), Compressed.size());
+	Wrote = Wrote &&
+		(fwrite(Header, sizeof(Header), 1, Output) == 1) &&
+		(fwrite(Compressed.data(), 1, Compressed.size(), Output) == Compressed.size()) &&
+		(fflush(Output) == 0);
+	off_t const Written = Wrote ? ftello(Output) : 0;
+	// The old journal is only let go of once the new one is on the disk
+	if (Replace) Wrote = Wrote && (fsync(fileno(Output)) == 0);
+
+	if ((fclose(Output) != 0) || !Wrote || (Replace && (rename(Filename.c_str(), Path.c_str()) != 0)))
+	{
+		std::cerr << Local("Could not finish writing: ") << Filename << std::endl;
+		if (!Replace) return;
+		remove(Filename.c_str());
+		if (ReplacementLock != -1) close(ReplacementLock);
+		return;
+	}
+
+	Length = Written;
+	if (!Replace) return;
+	close(Lock);
+	Lock = ReplacementLock;
+	CompactLength = Written;
+}
+
+void ChangeJournal::Flush(String const &ImageFilename, RunData const &Data, CompressionMethod const &Method)
+{
+	if (Touched.Empty()) return;
+	Wait();
+
+	// Once it's grown past the image file it's replayed over, or twice what it was compacted to, the journal is
+	// replaced by one record of every row that's been read.  Rows still in the file haven't changed since it was saved.
+	uint64_t Limit = CompactLength * 2;
+	struct stat Status;
+	if ((CompactLength == 0) && !ImageFilename.empty() && (stat(ImageFilename.c_str(), &Status) == 0))
+		Limit = Status.st_size;
+	bool const Replace = (Lock != -1) && (Length > std::max(Limit, JournalSlackBytes));
+
+	/// Copy the rows as they're stored, so they're turned and packed on the writer thread
+	std::vector<RowCopy> Copies;
+	for (unsigned int Index = 0; Index < Data.Rows.size(); ++Index)
+	{
+		if ((!Replace && !Touched.Contains(Index)) || Data.InFile(Index)) continue;
+		Copies.push_back(RowCopy());
+		Copies.back().Row = Index;
+		Copies.back().Remaining = Data.CopyRow(Index, Copies.back().Runs);
+	}
+	Touched.Clear();
+	if (Copies.empty() || !Open(ImageFilename)) return;
+
+	Writer = std::thread(&ChangeJournal::Append, this, std::move(Copies), Data.Width, Data.Rows.size(),
+		CompressionAvailable(Method) ? Method : DefaultCompression(), Replace);
+}
+
+void ChangeJournal::StartSave(void)
+{
+	Saving = true;
+	SinceSave.Clear();
+}
+
+void ChangeJournal::FinishSave(bool const &Succeeded)
+{
+	if (!Saving) return;
+	Saving = false;
+	if (!Succeeded) return; // Everything since the last full save is still in the journal or touched
+	Discard();
+	Touched = SinceSave;
+}
+
+void ChangeJournal::Discard(void)
+{
+	Wait();
+	Refused = false;
+	if (Lock == -1) return;
+	remove(Path.c_str()); // Before letting go, so no other session claims it in between
+	close(Lock);
+	Lock = -1;
+	Path.clear();
+}
+
+void ChangeJournal::Wait(void)
+{
+	if (Writer.joinable()) Writer.join();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Image manipulation/management
+Image::Image(SettingsData &Settings) :
+	Settings(Settings),
+	ImageSpace(FlatVector(), Settings.ImageSize), PixelsBelow(Settings.DisplayScale),
+	DisplaySpace(FlatVector(), ImageSpace.Size / (float)PixelsBelow),
+	Data(new RunData(ImageSpace.Size)), CurrentMarkUndo(nullptr), 
+	PaletteScale(0), ScratchSurface(nullptr), Saving(nullptr), ModifiedSinceSave(false), LoadSucceeded(false)
+	{}
+
+Image::Image(SettingsData &Settings, String const &Filename) :
+	Settings(Settings),
+	ImageSpace(FlatVector(), Settings.ImageSize), PixelsBelow(Settings.DisplayScale),
+	DisplaySpace(FlatVector(), ImageSpace.Size / (float)PixelsBelow),
+	Data(nullptr), CurrentMarkUndo(nullptr), 
+	PaletteScale(0), ScratchSurface(nullptr), Saving(nullptr), Filename(Filename),
+	ModifiedSinceSave(false), LoadSucceeded(false)
+{
+	/// Open the file
+	FILE *Input = fopen(Filename.c_str(), "rb");
+	if (Input == nullptr)
+	{
+		Data = new RunData(ImageSpace.Size);
+		return;
+	}
+
+	char Identifier1[32];
+	memset(Identifier1, 0, 32);
+	strncpy(Identifier1, "inscribble v00\n", 32);
+
+	char Identifier2[32];
+	memset(Identifier2, 0, 32);
+	strncpy(Identifier2, "inscribble v01\n", 32);
+	
+	char Identifier3[32];
+	memset(Identifier3, 0, 32);
+	strncpy(Identifier3, "inscribble v02\n", 32);
+
+	char Identifier4[32];
+	memset(Identifier4, 0, 32);
+	strncpy(Identifier4, "inscribble v03\n", 32);
+
+	char LoadedIdentifier[32];
+	size_t Result = fread(LoadedIdentifier, sizeof(char), 32, Input);
+	if (Result < 32)
+	{
+		StandardErrorStream << Local("There was some error while trying to read the header of the file.  Inscribist files begin with 32 bytes of text.") << "\n" << OutputStream::Flush();
+	}
+
+	if (strncmp(LoadedIdentifier, Identifier4, 32) == 0)
+	{
+		/// Version 3 files are in blocks, with the compression done per block
+		LoadSucceeded = LoadBlocks(Input, Filename);
+		if (Data == nullptr) Data = new RunData(ImageSpace.Size);
+		fclose(Input);
+		return;
+	}
+
+	unsigned int Version = 2;
+	if (strncmp(LoadedIdentifier, Identifier1, 32) == 0)
+	{
+		Version = 0;
+	}
+	else if (strncmp(LoadedIdentifier, Identifier2, 32) == 0)
+	{
+		Version = 1;
+	}
+	else if (strncmp(LoadedIdentifier, Identifier3, 32) != 0)
+	{
+		std::cerr << Local("The version string in the file is wrong.  Inscribist probably can't open this file.") << std::endl;
+		Data = new RunData(ImageSpace.Size);
+		fclose(Input);
+		return;
+	}
+
+	if (Version == 2)
+	{
+		LoadSucceeded = LoadStream(Input, Filename);
+		if (Data == nullptr) Data = new RunData(ImageSpace.Size);
+		fclose(Input);
+		return;
+	}
+
+	/// Prepare reading the bz2 data
+	int Error;
+	BZFILE *CompressInput = BZ2_bzReadOpen(&Error, Input, 0, 0, nullptr, 0);
+	if (Error != BZ_OK)
+	{
+		if (Error == BZ_IO_ERROR) std::cerr << Local("bz2 noticed the file had an error after being opened: ") << Filename << std::endl;
+		if (Error == BZ_MEM_ERROR) std::cerr << Local("bz2 ran out of memory when opening file for reading: ") << Filename << std::endl;
+		BZ2_bzReadClose(&Error, CompressInput);
+		Data = new RunData(ImageSpace.Size);
+		fclose(Input);
+		return;
+	}
+
+	if (Version >= 1)
+	{
+		BZ2_bzRead(&Error, CompressInput, &Settings.DisplayPaper, sizeof(Settings.DisplayPaper));
+		BZ2_bzRead(&Error, CompressInput, &Settings.DisplayInk, sizeof(Settings.DisplayInk));
+		BZ2_bzRead(&Error, CompressInput, &Settings.ExportPaper, sizeof(Settings.ExportPaper));
+		BZ2_bzRead(&Error, CompressInput, &Settings.ExportInk, sizeof(Settings.ExportInk));
+	}
+
+	/// Read in the image data
+	unsigned int RowCount, Width;
+	BZ2_bzRead(&Error, CompressInput, &RowCount, sizeof(RowCount));
+	BZ2_bzRead(&Error, CompressInput, &Width, sizeof(Width));
+
+	ImageSpace.Size[0] = Width;
+	ImageSpace.Size[1] = RowCount;
+	Data = new RunData(ImageSpace.Size);
+
+	Settings.ImageSize = ImageSpace.Size;
+
+	DisplaySpace.Size = ImageSpace.Size / (float)PixelsBelow;
+
+	unsigned int TotalLengths = 0;
+	RunData::RunArray Row;
+	for (unsigned int CurrentRow = 0; CurrentRow < RowCount; CurrentRow++)
+	{
+		unsigned int RunCount;
+		BZ2_bzRead(&Error, CompressInput, &RunCount, sizeof(RunCount));
+
+		std::vector<unsigned int> Runs;
+		Runs.resize(RunCount * 2);
+		BZ2_bzRead(&Error, CompressInput, &Runs[0], sizeof(unsigned int) * RunCount * 2);
+		
+		Row.clear();
+		bool First = true;
+		unsigned int LineWidth = 0;
+		for (auto const &Run : Runs) 
+		{
+			if (First) First = false;
+			else if (Run == 0) continue;
+			Row.push_back(Run);
+			LineWidth += Run;
+			TotalLengths += Run;
+		}
+		assert(LineWidth == Width);
+		Data->Rows.Assign(CurrentRow, &Row[0], Row.size());
+	}
+	assert(TotalLengths == Width * RowCount);
+	Data->Rows.Compact();
+
+	/// Close the file and finish up.
+	LoadSucceeded = (Error == BZ_OK) || (Error == BZ_STREAM_END);
+	if (!LoadSucceeded) std::cerr << Local("bz2 failed while reading: ") << Filename << std::endl;
+	BZ2_bzReadClose(&Error, CompressInput);
+	fclose(Input);
+}
+
+Image::~Image(void)
+{
+	FinishSave();
+	Journal.Discard();
+	if (ScratchSurface != nullptr) cairo_surface_destroy(ScratchSurface);
+	delete Data;
+}
+
+// The settings saved with an image or used while saving, copied so an image can be saved on another thread
+struct SaveSettings
+{
+	SaveSettings(SettingsData const &Settings) :
+		DisplayPaper(Settings.DisplayPaper), DisplayInk(Settings.DisplayInk),
+		ExportPaper(Settings.ExportPaper), ExportInk(Settings.ExportInk),
+		Compression(Settings.SaveCompression), Threads(Settings.RenderThreads)
+		{}
+
+	Color DisplayPaper, DisplayInk, ExportPaper, ExportInk;
+	CompressionMethod Compression;
+	unsigned int Threads;
+};
+
+static bool WriteImage(String const &Filename, RunData const &Data, SaveSettings const &Settings, WorkerPool &Workers)
+{
+	/// Open the file
+	// The image is written next to the old one and only moved over it once it's complete, since the journal is
+	// replayed over the old one if anything goes wrong before then
+	String const Temporary = Filename + ".new";
+	FILE *Output = fopen(Temporary.c_str(), "wb");
+	if (Output == nullptr)
+	{
+		std::cerr << Local("Could not open for writing: ") << Temporary << std::endl;
+		return false;
+	}
+
+	/// Add a simple header
+	char Identifier[32];
+	memset(Identifier, 0, 32);
+	strncpy(Identifier, "inscribble v03\n", 32);
+	bool Wrote = fwrite(Identifier, sizeof(char), 32, Output) == 32;
+
+	/// Write paper/export colors and the size
+	// These aren't compressed, so they can be read without touching the image data
+	LittleEndian<Color> DisplayPaper = Settings.DisplayPaper, DisplayInk = Settings.DisplayInk,
+		ExportPaper = Settings.ExportPaper, ExportInk = Settings.ExportInk;
+	CompressionMethod const Method = CompressionAvailable(Settings.Compression) ? Settings.Compression : DefaultCompression();
+	LittleEndian<uint32_t> RowCountBuffer = Data.Rows.size(), WidthBuffer = Data.Width,
+		CompressionBuffer = (uint32_t)Method;
+	Wrote = Wrote &&
+		(fwrite(&DisplayPaper, sizeof(DisplayPaper), 1, Output) == 1) &&
+		(fwrite(&DisplayInk, sizeof(DisplayInk), 1, Output) == 1) &&
+		(fwrite(&ExportPaper, sizeof(ExportPaper), 1, Output) == 1) &&
+		(fwrite(&ExportInk, sizeof(ExportInk), 1, Output) == 1) &&
+		(fwrite(&RowCountBuffer, sizeof(RowCountBuffer), 1, Output) == 1) &&
+		(fwrite(&WidthBuffer, sizeof(WidthBuffer), 1, Output) == 1) &&
+		(fwrite(&CompressionBuffer, sizeof(CompressionBuffer), 1, Output) == 1);
+	uint64_t Offset = 32 + sizeof(Color) * 4 + sizeof(uint32_t) * 3;
+
+	/// Split the rows into blocks
+	// Each block is compressed on its own, so blocks can be compressed and decompressed in parallel and read
+	// separately.  Blocks are cut after a row once they hold about SaveBlockBytes of uncompressed rows.
+	std::vector<unsigned int> BlockStarts;
+	{
+		size_t BlockBytes = SaveBlockBytes;
+		for (unsigned int CurrentRow = 0; CurrentRow < Data.Rows.size(); ++CurrentRow)
+		{
+			if (BlockBytes >= SaveBlockBytes)
+			{
+				BlockStarts.push_back(CurrentRow);
+				BlockBytes = 0;
+			}
+			BlockBytes += sizeof(uint32_t) * (Data.Rows[CurrentRow].size() + 1);
+		}
+	}
+	BlockStarts.push_back(Data.Rows.size());
+	unsigned int const BlockCount = BlockStarts.size() - 1;
+
+	/// Compress a wave of blocks at a time in parallel and write them out in order
+	struct SaveBlock
+	{
+		std::vector<uint8_t> Raw, Compressed;
+		bool Failed;
+	};
+	Workers.SetThreadCount(Settings.Threads);
+	unsigned int const WaveSize = Workers.GetThreadCount() * 2;
+	std::vector<SaveBlock> Blocks(std::min(WaveSize, BlockCount));
+	std::vector<FileBlock> Index;
+	for (unsigned int WaveTop = 0; Wrote && (WaveTop < BlockCount); WaveTop += WaveSize)
+	{
+		unsigned int const WaveBlocks = std::min(WaveSize, BlockCount - WaveTop);
+		auto CompressBlock = [&](unsigned int const &Block)
+		{
+			SaveBlock &Out = Blocks[Block];
+			Out.Raw.clear();
+			Data.WriteRows(BlockStarts[WaveTop + Block], BlockStarts[WaveTop + Block + 1], RunData::RowFormat::Packed, Out.Raw);
+			Out.Failed = !Compress(Method, Out.Raw, Out.Compressed);
+		};
+		Workers.Run(WaveBlocks, std::ref(CompressBlock));
+
+		for (unsigned int Block = 0; Wrote && (Block < WaveBlocks); ++Block)
+		{
+			SaveBlock const &Current = Blocks[Block];
+			if (Current.Failed)
+			{
+				std::cerr << Local("Failed to compress the image: ") << Filename << std::endl;
+				fclose(Output);
+				remove(Temporary.c_str());
+				return false;
+			}
+			Wrote = fwrite(&Current.Compressed[0], 1, Current.Compressed.size(), Output) == Current.Compressed.size();
+			FileBlock Entry;
+			Entry.Offset = Offset;
+			Entry.CompressedSize = Current.Compressed.size();
+			Entry.RawSize = Current.Raw.size();
+			Entry.FirstRow = BlockStarts[WaveTop + Block];
+			Index.push_back(Entry);
+			Offset += Current.Compressed.size();
+		}
+	}
+
+	/// Write the block index at the end, followed by where it starts
+	LittleEndian<uint32_t> BlockCountBuffer = BlockCount;
+	Wrote = Wrote && (fwrite(&BlockCountBuffer, sizeof(BlockCountBuffer), 1, Output) == 1);
+	for (auto const &Entry : Index)
+	{
+		LittleEndian<uint64_t> OffsetBuffer = Entry.Offset;
+		LittleEndian<uint32_t> CompressedSizeBuffer = Entry.CompressedSize, RawSizeBuffer = Entry.RawSize,
+			FirstRowBuffer = Entry.FirstRow;
+		Wrote = Wrote &&
+			(fwrite(&OffsetBuffer, sizeof(OffsetBuffer), 1, Output) == 1) &&
+			(fwrite(&CompressedSizeBuffer, sizeof(CompressedSizeBuffer), 1, Output) == 1) &&
+			(fwrite(&RawSizeBuffer, sizeof(RawSizeBuffer), 1, Output) == 1) &&
+			(fwrite(&FirstRowBuffer, sizeof(FirstRowBuffer), 1, Output) == 1);
+	}
+	LittleEndian<uint64_t> IndexOffsetBuffer = Offset;
+	Wrote = Wrote && (fwrite(&IndexOffsetBuffer, sizeof(IndexOffsetBuffer), 1, Output) == 1);
+
+	/// Close everything, and replace the old file once the new one is on the disk
+	Wrote = Wrote && (fflush(Output) == 0) && (fsync(fileno(Output)) == 0);
+	if ((fclose(Output) != 0) || !Wrote || (rename(Temporary.c_str(), Filename.c_str()) != 0))
+	{
+		std::cerr << Local("Could not finish writing: ") << Filename << std::endl;
+		remove(Temporary.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool Image::Save(String const &Filename)
+{
+	FinishSave();
+	Data->Materialize(0, Data->Rows.size());
+	Journal.StartSave();
+	bool const Succeeded = WriteImage(Filename, *Data, SaveSettings(Settings), Workers);
+	Journal.FinishSave(Succeeded);
+	if (!Succeeded) return false;
+	this->Filename = Filename;
+	ModifiedSinceSave = false;
+	return true;
+}
+
+// A save running on another thread, with its own copy of the rows and its own workers so it doesn't touch the image
+struct Image::BackgroundSave
+{
+	BackgroundSave(String const &Filename, RunData const &Source, SettingsData const &Settings) :
+		Filename(Filename), Data(FlatVector(Source.Width, 0)), Settings(Settings), Finished(false), Succeeded(false)
+		{ Data.Copy(Source); }
+
+	String const Filename;
+	RunData Data;
+	SaveSettings const Settings;
+	WorkerPool Workers;
+	std::thread Thread;
+	std::atomic<bool> Finished;
+	bool Succeeded;
+};
+
+void Image::StartSave(String const &Filename)
+{
+	FinishSave();
+
+	Saving = new BackgroundSave(Filename, *Data, Settings);
+	Journal.StartSave();
+	BackgroundSave *Job = Saving;
+	Job->Thread = std::thread([Job](void)
+	{
+		// Rows the image hasn't read or turned yet are done on the copy, here
+		Job->Data.Materialize(0, Job->Data.Rows.size());
+		Job->Succeeded = WriteImage(Job->Filename, Job->Data, Job->Settings, Job->Workers);
+		Job->Finished = true;
+	});
+
+	// Changes made from here on aren't in the file.  If the save fails, the image is marked as changed again.
+	ModifiedSinceSave = false;
+}
+
+bool Image::SaveRunning(void)
+	{ return (Saving != nullptr) && !Saving->Finished; }
+
+bool Image::FinishSave(void)
+{
+	if (Saving == nullptr) return true;
+	Saving->Thread.join();
+	bool const Succeeded = Saving->Succeeded;
+	Journal.FinishSave(Succeeded);
+	if (Succeeded) Filename = Saving->Filename;
+	else ModifiedSinceSave = true;
+	delete Saving;
+	Saving = nullptr;
+	return Succeeded;
+}
+
+void Image::FlushJournal(void) { Journal.Flush(Filename, *Data, Settings.SaveCompression); }
+
+bool Image::CanRecover(void) { return Journal.Claim(Filename); }
+
+bool Image::Recover(void)
+{
+	// The undo levels refer to the rows being replaced
+	assert(!Changes.CanUndo() && !Changes.CanRedo() && (CurrentMarkUndo == nullptr));
+	if (!Journal.Replay(Data)) return false;
+	ImageSpace.Size = FlatVector(Data->Width, Data->Rows.size());
+	DisplaySpace.Size = ImageSpace.Size / (float)PixelsBelow;
+	Settings.ImageSize = ImageSpace.Size;
+	Tiles.Clear();
+	ModifiedSinceSave = true; // The recovered changes stay in the journal until the next save
+	return true;
+}
+
+void Image::DiscardRecovery(void) { Journal.Discard(); }
+
+bool Image::LoadBlocks(FILE *Input, String const &Filename)
+{
+	/// Read the colors and size
+	LittleEndian<Color> DisplayPaper, DisplayInk, ExportPaper, ExportInk;
+	LittleEndian<uint32_t> StandardizedRowCount, StandardizedWidth, StandardizedCompression;
+	if ((fread(&DisplayPaper, sizeof(DisplayPaper), 1, Input) != 1) ||
+		(fread(&DisplayInk, sizeof(DisplayInk), 1, Input) != 1) ||
+		(fread(&ExportPaper, sizeof(ExportPaper), 1, Input) != 1) ||
+		(fread(&ExportInk, sizeof(ExportInk), 1, Input) != 1) ||
+		(fread(&StandardizedRowCount, sizeof(StandardizedRowCount), 1, Input) != 1) ||
+		(fread(&StandardizedWidth, sizeof(StandardizedWidth), 1, Input) != 1) ||
+		(fread(&StandardizedCompression, sizeof(StandardizedCompression), 1, Input) != 1) ||
+		(StandardizedRowCount < 1) || (StandardizedWidth < 1))
+	{
+		std::cerr << Local("The file ends before the image starts: ") << Filename << std::endl;
+		return false;
+	}
+	CompressionMethod const Method = (CompressionMethod)(uint32_t)StandardizedCompression;
+	if (!CompressionAvailable(Method))
+	{
+		std::cerr << Local("The image uses a kind of compression this version can't read: ") << Filename << std::endl;
+		return false;
+	}
+	Settings.DisplayPaper = DisplayPaper;
+	Settings.DisplayInk = DisplayInk;
+	Settings.ExportPaper = ExportPaper;
+	Settings.ExportInk = ExportInk;
+
+	ImageSpace.Size[0] = (uint32_t)StandardizedWidth;
+	ImageSpace.Size[1] = (uint32_t)StandardizedRowCount;
+	Data = new RunData(ImageSpace.Size);
+	Settings.ImageSize = ImageSpace.Size;
+	DisplaySpace.Size = ImageSpace.Size / (float)PixelsBelow;
+
+	/// Read the block index from the end of the file
+	std::vector<FileBlock> Index;
+	{
+		LittleEndian<uint64_t> IndexOffset;
+		LittleEndian<uint32_t> BlockCount;
+		if ((fseeko(Input, -(off_t)sizeof(IndexOffset), SEEK_END) != 0) ||
+			(fread(&IndexOffset, sizeof(IndexOffset), 1, Input) != 1) ||
+			(fseeko(Input, (uint64_t)IndexOffset, SEEK_SET) != 0) ||
+			(fread(&BlockCount, sizeof(BlockCount), 1, Input) != 1))
+		{
+			std::cerr << Local("The block index at the end of the file is missing: ") << Filename << std::endl;
+			return false;
+		}
+
+		for (uint32_t Block = 0; Block < BlockCount; ++Block)
+		{
+			LittleEndian<uint64_t> OffsetBuffer;
+			LittleEndian<uint32_t> CompressedSizeBuffer, RawSizeBuffer, FirstRowBuffer;
+			if ((fread(&OffsetBuffer, sizeof(OffsetBuffer), 1, Input) != 1) ||
+				(fread(&CompressedSizeBuffer, sizeof(CompressedSizeBuffer), 1, Input) != 1) ||
+				(fread(&RawSizeBuffer, sizeof(RawSizeBuffer), 1, Input) != 1) ||
+				(fread(&FirstRowBuffer, sizeof(FirstRowBuffer), 1, Input) != 1))
+			{
+				std::cerr << Local("The block index at the end of the file is damaged: ") << Filename << std::endl;
+				return false;
+			}
+			FileBlock Entry;
+			Entry.Offset = OffsetBuffer;
+			Entry.CompressedSize = CompressedSizeBuffer;
+			Entry.RawSize = RawSizeBuffer;
+			Entry.FirstRow = FirstRowBuffer;
+			bool const Ordered = Index.empty() ? (Entry.FirstRow == 0) : (Entry.FirstRow > Index.back().FirstRow);
+			if (!Ordered || (Entry.FirstRow >= Data->Rows.size()))
+			{
+				std::cerr << Local("The block index at the end of the file is damaged: ") << Filename << std::endl;
+				return false;
+			}
+			Index.push_back(Entry);
+		}
+		if (Index.empty())
+		{
+			std::cerr << Local("The block index at the end of the file is damaged: ") << Filename << std::endl;
+			return false;
+		}
+	}
+
+	/// Leave the rows of large images in the file until they're used
+	if (Index.size() > LazyLoadBlocks)
+	{
+		GMappedFile *File = g_mapped_file_new(Filename.c_str(), false, nullptr);
+		if (File != nullptr)
+		{
+			uint64_t const FileSize = g_mapped_file_get_length(File);
+			for (auto const &Entry : Index)
+				if ((Entry.Offset > FileSize) || (Entry.CompressedSize > FileSize - Entry.Offset))
+				{
+					g_mapped_file_unref(File);
+					std::cerr << Local("Part of the image is damaged and couldn't be read: ") << Filename << std::endl;
+					return false;
+				}
+			Data->Defer(new DeferredRows(Filename, File, Method, Index, Data->Rows.size()));
+			return true;
+		}
+		// Read everything now if the file can't be mapped
+	}
 
-Shrink::Shrink(RunData &Base, unsigned int const &Factor) : Base(Base), Factor(Factor)
-	{}
+	/// Decompress waves of blocks in parallel, then read their rows in order
+	// Reading the file and filling rows stay on this thread; decompressing is the slow part.
+	struct LoadBlock
+	{
+		std::vector<uint8_t> Compressed, Raw;
+		bool Failed;
+	};
+	Workers.SetThreadCount(Settings.RenderThreads);
+	unsigned int const WaveSize = Workers.GetThreadCount() * 2;
+	std::vector<LoadBlock> Blocks(std::min(WaveSize, (unsigned int)Index.size()));
+	for (unsigned int WaveTop = 0; WaveTop < Index.size(); WaveTop += WaveSize)
+	{
+		unsigned int const WaveBlocks = std::min(WaveSize, (unsigned int)Index.size() - WaveTop);
+		for (unsigned int Block = 0; Block < WaveBlocks; ++Block)
+		{
+			FileBlock const &Entry = Index[WaveTop + Block];
+			std::vector<uint8_t> &Compressed = Blocks[Block].Compressed;
+			Compressed.resize(Entry.CompressedSize);
+			if ((fseeko(Input, Entry.Offset, SEEK_SET) != 0) ||
+				(fread(Compressed.data(), 1, Compressed.size(), Input) != Compressed.size()))
+			{
+				std::cerr << Local("Part of the image is damaged and couldn't be read: ") << Filename << std::endl;
+				return false;
+			}
+		}
 
-Change *Shrink::Apply(bool &, bool &)
-{
-	Base.Shrink(Factor);
-	return new Shrink(Base, Factor);
-}
+		auto DecompressBlock = [&](unsigned int const &Block)
+		{
+			FileBlock const &Entry = Index[WaveTop + Block];
+			LoadBlock &Out = Blocks[Block];
+			Out.Raw.resize(Entry.RawSize);
+			Out.Failed = !Decompress(Method, Out.Compressed.data(), Out.Compressed.size(), Out.Raw.data(), Out.Raw.size());
+		};
+		Workers.Run(WaveBlocks, std::ref(DecompressBlock));
 
-Change::CombineResult Shrink::Combine(Change *Other)
-{
-	if (typeid(*this) == typeid(*Other))
-	{
-		Factor *= static_cast<Shrink *>(Other)->Factor;
-		return Change::CombineResult::Combine;
+		for (unsigned int Block = 0; Block < WaveBlocks; ++Block)
+		{
+			unsigned int const Next = WaveTop + Block + 1;
+			unsigned int const Bottom = (Next < Index.size()) ? Index[Next].FirstRow : Data->Rows.size();
+			LoadBlock const &Current = Blocks[Block];
+			if (Current.Failed ||
+				!Data->ReadRows(Index[WaveTop + Block].FirstRow, Bottom, RunData::RowFormat::Packed,
+					Current.Raw.data(), Current.Raw.size()))
+			{
+				std::cerr << Local("Part of the image is damaged and couldn't be read: ") << Filename << std::endl;
+				return false;
+			}
+		}
 	}
-	return Change::CombineResult::Fail;
-}
+	Data->Rows.Compact();
 
-//////////////////////////////////////////////////////////////////////////////////////////
-// Image manipulation/management
-Image::Image(SettingsData &Settings) :
-	Settings(Settings),
-	ImageSpace(FlatVector(), Settings.ImageSize), PixelsBelow(Settings.DisplayScale),
-	DisplaySpace(FlatVector(), ImageSpace.Size / (float)PixelsBelow),
-	Data(new RunData(ImageSpace.Size)), CurrentMarkUndo(nullptr), ModifiedSinceSave(false)
-	{}
+	return true;
+}
 
-Image::Image(SettingsData &Settings, String const &Filename) :
-	Settings(Settings),
-	ImageSpace(FlatVector(), Settings.ImageSize), PixelsBelow(Settings.DisplayScale),
-	DisplaySpace(FlatVector(), ImageSpace.Size / (float)PixelsBelow),
-	Data(nullptr), CurrentMarkUndo(nullptr), ModifiedSinceSave(false)
-{
-	/// Open the file
-	FILE *Input = fopen(Filename.c_str(), "rb");
-	if (Input == nullptr)
-	{
-		Data = new RunData(ImageSpace.Size);
-		return;
-	}
+// bzip2 blocks start with this 48 bit number and the stream ends with the second, neither aligned to bytes.  Each is
+// followed by a 32 bit CRC.
+uint64_t const BZ2BlockMagic = 0x314159265359ull, BZ2EndMagic = 0x177245385090ull;
 
-	char Identifier1[32];
-	memset(Identifier1, 0, 32);
-	strncpy(Identifier1, "inscribble v00\n", 32);
+static unsigned int GetBit(uint8_t const *Bytes, uint64_t const &Position)
+	{ return (Bytes[Position / 8] >> (7 - Position % 8)) & 1; }
 
-	char Identifier2[32];
-	memset(Identifier2, 0, 32);
-	strncpy(Identifier2, "inscribble v01\n", 32);
-	
-	char Identifier3[32];
-	memset(Identifier3, 0, 32);
-	strncpy(Identifier3, "inscribble v02\n", 32);
+// Finds the bit positions of block starts in a bzip2 stream, followed by the position of the end marker.  Returns
+// false if Stream doesn't look like a single bzip2 stream.  The search is split between Workers.
+static bool FindBZ2Blocks(uint8_t const *Stream, size_t const &Size, WorkerPool &Workers, std::vector<uint64_t> &Out)
+{
+	if ((Size < 14) || (memcmp(Stream, "BZh", 3) != 0) || (Stream[3] < '1') || (Stream[3] > '9')) return false;
 
-	char LoadedIdentifier[32];
-	size_t Result = fread(LoadedIdentifier, sizeof(char), 32, Input);
-	if (Result < 32)
+	size_t const PartBytes = 1 << 22;
+	unsigned int const PartCount = (Size + PartBytes - 1) / PartBytes;
+	std::vector<std::vector<uint64_t> > Found(PartCount), Ends(PartCount);
+	auto Search = [&](unsigned int const &Part)
 	{
-		StandardErrorStream << Local("There was some error while trying to read the header of the file.  Inscribist files begin with 32 bytes of text.") << "\n" << OutputStream::Flush();
-	}
+		// Matches are found where they end, so start early enough to catch ones starting in this part
+		size_t const Start = Part * PartBytes, End = std::min(Size, Start + PartBytes);
+		size_t const Lead = std::min(Start, (size_t)6);
+		uint64_t Recent = 0;
+		for (size_t Byte = Start - Lead; Byte < std::min(Size, End + 6); ++Byte)
+			for (unsigned int Bit = 0; Bit < 8; ++Bit)
+			{
+				Recent = (Recent << 1) | ((Stream[Byte] >> (7 - Bit)) & 1);
+				uint64_t const Last48 = Recent & 0xFFFFFFFFFFFFull;
+				if ((Last48 != BZ2BlockMagic) && (Last48 != BZ2EndMagic)) continue;
+				uint64_t const MatchStart = Byte * 8 + Bit + 1 - 48;
+				if ((Byte * 8 + Bit + 1 < 48) || (MatchStart < Start * 8) || (MatchStart >= End * 8)) continue;
+				(Last48 == BZ2BlockMagic ? Found : Ends)[Part].push_back(MatchStart);
+			}
+	};
+	Workers.Run(PartCount, std::ref(Search));
 
-	unsigned int Version = 2;
-	if (strncmp(LoadedIdentifier, Identifier1, 32) == 0)
+	for (unsigned int Part = 0; Part < PartCount; ++Part)
 	{
-		Version = 0;
+		Out.insert(Out.end(), Found[Part].begin(), Found[Part].end());
+		if (!Ends[Part].empty())
+		{
+			// The stream ends at the first end marker; anything that looked like a marker after it is padding
+			uint64_t const EndPosition = Ends[Part].front();
+			while (!Out.empty() && (Out.back() > EndPosition)) Out.pop_back();
+			Out.push_back(EndPosition);
+			break;
+		}
 	}
-	else if (strncmp(LoadedIdentifier, Identifier2, 32) == 0)
+	return (Out.size() >= 2) && (Out.front() == 32) && (Out.back() + 80 <= Size * 8);
+}
+
+// Decompresses the block from bit Start to End of a bzip2 stream by turning it into a stream of its own.  With a
+// single block, the stream CRC is the same as the block CRC.
+static bool DecompressBZ2Block(uint8_t const *Stream, uint64_t const &Start, uint64_t const &End,
+	std::vector<uint8_t> &Out)
+{
+	/// Build the stream
+	std::vector<uint8_t> Single(Stream, Stream + 4);
+	uint32_t CRC = 0;
+	for (unsigned int Bit = 0; Bit < 32; ++Bit) CRC = (CRC << 1) | GetBit(Stream, Start + 48 + Bit);
+
+	size_t const WholeBytes = (End - Start) / 8, First = Start / 8;
+	unsigned int const Shift = Start % 8;
+	Single.reserve(4 + WholeBytes + 12);
+	for (size_t Byte = 0; Byte < WholeBytes; ++Byte)
+		Single.push_back((Shift == 0) ? Stream[First + Byte] :
+			(uint8_t)((Stream[First + Byte] << Shift) | (Stream[First + Byte + 1] >> (8 - Shift))));
+
+	uint8_t Partial = 0;
+	unsigned int PartialBits = 0;
+	auto Put = [&](unsigned int const &Bit)
 	{
-		Version = 1;
-	}
-	else if (strncmp(LoadedIdentifier, Identifier3, 32) != 0)
+		Partial = (Partial << 1) | Bit;
+		if (++PartialBits < 8) return;
+		Single.push_back(Partial);
+		Partial = 0;
+		PartialBits = 0;
+	};
+	for (uint64_t Position = Start + WholeBytes * 8; Position < End; ++Position) Put(GetBit(Stream, Position));
+	for (int Bit = 47; Bit >= 0; --Bit) Put((BZ2EndMagic >> Bit) & 1);
+	for (int Bit = 31; Bit >= 0; --Bit) Put((CRC >> Bit) & 1);
+	if (PartialBits > 0) Single.push_back(Partial << (8 - PartialBits));
+
+	/// Decompress it
+	bz_stream Decompress;
+	memset(&Decompress, 0, sizeof(Decompress));
+	if (BZ2_bzDecompressInit(&Decompress, 0, 0) != BZ_OK) return false;
+	Decompress.next_in = (char *)Single.data();
+	Decompress.avail_in = Single.size();
+	Out.resize(std::max((size_t)1 << 20, Out.capacity()));
+	size_t Used = 0;
+	int Result;
+	do
 	{
-		std::cerr << Local("The version string in the file is wrong.  Inscribist probably can't open this file.") << std::endl;
-		return;
-	}
+		if (Used == Out.size()) Out.resize(Out.size() * 2);
+		Decompress.next_out = (char *)&Out[Used];
+		Decompress.avail_out = Out.size() - Used;
+		Result = BZ2_bzDecompress(&Decompress);
+		Used = Out.size() - Decompress.avail_out;
+	} while (Result == BZ_OK);
+	BZ2_bzDecompressEnd(&Decompress);
+	Out.resize(Used);
+	return Result == BZ_STREAM_END;
+}
 
-	/// Prepare reading the bz2 data
-	int Error;
-	BZFILE *CompressInput = BZ2_bzReadOpen(&Error, Input, 0, 0, nullptr, 0);
-	if (Error != BZ_OK)
+bool Image::LoadStream(FILE *Input, String const &Filename)
+{
+	/// Read the rest of the file
+	std::vector<uint8_t> Stream;
 	{
-		if (Error == BZ_IO_ERROR) std::cerr << Local("bz2 noticed the file had an error after being opened: ") << Filename << std::endl;
-		if (Error == BZ_MEM_ERROR) std::cerr << Local("bz2 ran out of memory when opening file for reading: ") << Filename << std::endl;
-		BZ2_bzReadClose(&Error, CompressInput);
-		fclose(Input);
-		return;
+		uint8_t Buffer[1 << 16];
+		size_t Count;
+		while ((Count = fread(Buffer, 1, sizeof(Buffer), Input)) > 0) Stream.insert(Stream.end(), Buffer, Buffer + Count);
 	}
 
-	if (Version >= 2)
+	/// Parse the decompressed data as it comes in
+	// First the colors and size, then rows, which are stored the same way as in v03 blocks
+	std::vector<uint8_t> Pending;
+	uint32_t RowCount = 0, CurrentRow = 0;
+	bool Damaged = false;
+	auto Parse = [&](uint8_t const *Bytes, size_t const &Size)
 	{
-		LittleEndian<Color> DisplayPaper, DisplayInk, ExportPaper, ExportInk;
-		BZ2_bzRead(&Error, CompressInput, &DisplayPaper, sizeof(DisplayPaper));
-		BZ2_bzRead(&Error, CompressInput, &DisplayInk, sizeof(DisplayInk));
-		BZ2_bzRead(&Error, CompressInput, &ExportPaper, sizeof(ExportPaper));
-		BZ2_bzRead(&Error, CompressInput, &ExportInk, sizeof(ExportInk));
-		Settings.DisplayPaper = DisplayPaper;
-		Settings.DisplayInk = DisplayInk;
-		Settings.ExportPaper = ExportPaper;
-		Settings.ExportInk = ExportInk;
+		if (Damaged) return;
+		Pending.insert(Pending.end(), Bytes, Bytes + Size);
+		size_t Used = 0;
 
-		/// Read in the image data
-		LittleEndian<uint32_t> StandardizedRowCount, StandardizedWidth;
-		BZ2_bzRead(&Error, CompressInput, &StandardizedRowCount, sizeof(StandardizedRowCount));
-		BZ2_bzRead(&Error, CompressInput, &StandardizedWidth, sizeof(StandardizedWidth));
-		uint32_t RowCount = StandardizedRowCount;
+		if (Data == nullptr)
+		{
+			size_t const HeaderSize = sizeof(LittleEndian<Color>) * 4 + sizeof(uint32_t) * 2;
+			if (Pending.size() < HeaderSize) return;
+			LittleEndian<Color> Colors[4];
+			memcpy(Colors, &Pending[0], sizeof(Colors));
+			Settings.DisplayPaper = Colors[0];
+			Settings.DisplayInk = Colors[1];
+			Settings.ExportPaper = Colors[2];
+			Settings.ExportInk = Colors[3];
+
+			uint8_t const *Cursor = &Pending[sizeof(Colors)];
+			RowCount = GetWord(Cursor);
+			uint32_t const Width = GetWord(Cursor);
+			ImageSpace.Size[0] = std::max(Width, 1u);
+			ImageSpace.Size[1] = std::max(RowCount, 1u);
+			// Rows start out unset rather than blank, since they're all about to be replaced
+			Data = new RunData(FlatVector(ImageSpace.Size[0], 0));
+			Data->Rows.AddUnset(ImageSpace.Size[1]);
+			Settings.ImageSize = ImageSpace.Size;
+			DisplaySpace.Size = ImageSpace.Size / (float)PixelsBelow;
+			Used = HeaderSize;
+		}
 
-		ImageSpace.Size[0] = StandardizedWidth;
-		ImageSpace.Size[1] = StandardizedRowCount;
-		Data = new RunData(ImageSpace.Size);
+		// Hand over all the complete rows
+		size_t End = Used;
+		uint32_t Complete = 0;
+		while ((CurrentRow + Complete < RowCount) && (Pending.size() - End >= sizeof(uint32_t)))
+		{
+			uint8_t const *Cursor = &Pending[End];
+			size_t const RowBytes = sizeof(uint32_t) * ((size_t)GetWord(Cursor) + 1);
+			if (Pending.size() - End < RowBytes) break;
+			End += RowBytes;
+			++Complete;
+		}
+		if ((Complete > 0) && !Data->ReadRows(CurrentRow, CurrentRow + Complete, RunData::RowFormat::Words,
+			&Pending[Used], End - Used))
+			Damaged = true;
+		CurrentRow += Complete;
+		Pending.erase(Pending.begin(), Pending.begin() + End);
+	};
 
-		Settings.ImageSize = ImageSpace.Size;
+	/// Decompress blocks in parallel where the stream can be split up
+	Workers.SetThreadCount(Settings.RenderThreads);
+	std::vector<uint64_t> Blocks;
+	bool Split = FindBZ2Blocks(Stream.data(), Stream.size(), Workers, Blocks);
+	if (Split)
+	{
+		unsigned int const BlockCount = Blocks.size() - 1;
+		unsigned int const WaveSize = Workers.GetThreadCount() * 2;
+		std::vector<std::vector<uint8_t> > Raw(std::min(WaveSize, BlockCount));
+		std::vector<char> Failed(Raw.size()); // Not bool, since the threads write neighboring elements
+		for (unsigned int WaveTop = 0; Split && (WaveTop < BlockCount); WaveTop += WaveSize)
+		{
+			unsigned int const WaveBlocks = std::min(WaveSize, BlockCount - WaveTop);
+			auto DecompressBlock = [&](unsigned int const &Block)
+			{
+				Failed[Block] = !DecompressBZ2Block(Stream.data(),
+					Blocks[WaveTop + Block], Blocks[WaveTop + Block + 1], Raw[Block]);
+			};
+			Workers.Run(WaveBlocks, std::ref(DecompressBlock));
 
-		DisplaySpace.Size = ImageSpace.Size / (float)PixelsBelow;
+			for (unsigned int Block = 0; Block < WaveBlocks; ++Block)
+			{
+				if (Failed[Block])
+				{
+					// Probably something in the compressed data that looked like a block start.  Start over.
+					Split = false;
+					break;
+				}
+				Parse(Raw[Block].data(), Raw[Block].size());
+			}
+		}
 
-		for (uint32_t CurrentRow = 0; CurrentRow < RowCount; CurrentRow++)
+		if (!Split)
 		{
-			LittleEndian<uint32_t> StandardizedRunCount;
-			BZ2_bzRead(&Error, CompressInput, &StandardizedRunCount, sizeof(StandardizedRunCount));
-			uint32_t RunCount = StandardizedRunCount;
-
-			std::vector<LittleEndian<RunData::Run> > Runs;
-			Runs.resize(RunCount);
-			BZ2_bzRead(&Error, CompressInput, &Runs[0], sizeof(LittleEndian<RunData::Run>) * RunCount);
-			Data->Rows[CurrentRow].clear();
-			Data->Rows[CurrentRow].reserve(RunCount);
-			for (auto const &Run : Runs) Data->Rows[CurrentRow].push_back(Run);
+			delete Data;
+			Data = nullptr;
+			Pending.clear();
+			RowCount = CurrentRow = 0;
+			Damaged = false;
 		}
 	}
-	else
+
+	/// Otherwise decompress the whole thing here
+	if (!Split)
 	{
-		if (Version >= 1)
+		bz_stream Decompress;
+		memset(&Decompress, 0, sizeof(Decompress));
+		if (BZ2_bzDecompressInit(&Decompress, 0, 0) != BZ_OK)
 		{
-			BZ2_bzRead(&Error, CompressInput, &Settings.DisplayPaper, sizeof(Settings.DisplayPaper));
-			BZ2_bzRead(&Error, CompressInput, &Settings.DisplayInk, sizeof(Settings.DisplayInk));
-			BZ2_bzRead(&Error, CompressInput, &Settings.ExportPaper, sizeof(Settings.ExportPaper));
-			BZ2_bzRead(&Error, CompressInput, &Settings.ExportInk, sizeof(Settings.ExportInk));
+			std::cerr << Local("bz2 ran out of memory when opening file for reading: ") << Filename << std::endl;
+			return false;
 		}
+		Decompress.next_in = (char *)Stream.data();
+		Decompress.avail_in = Stream.size();
+		std::vector<uint8_t> Raw(1 << 20);
+		int Result;
+		do
+		{
+			Decompress.next_out = (char *)Raw.data();
+			Decompress.avail_out = Raw.size();
+			Result = BZ2_bzDecompress(&Decompress);
+			Parse(Raw.data(), Raw.size() - Decompress.avail_out);
+		} while ((Result == BZ_OK) && ((Decompress.avail_in > 0) || (Decompress.avail_out == 0)));
+		BZ2_bzDecompressEnd(&Decompress);
+		if (Result != BZ_STREAM_END)
+		{
+			std::cerr << Local("bz2 failed while reading: ") << Filename << std::endl;
+			return false;
+		}
+	}
 
-		/// Read in the image data
-		unsigned int RowCount, Width;
-		BZ2_bzRead(&Error, CompressInput, &RowCount, sizeof(RowCount));
-		BZ2_bzRead(&Error, CompressInput, &Width, sizeof(Width));
-
-		ImageSpace.Size[0] = Width;
-		ImageSpace.Size[1] = RowCount;
-		Data = new RunData(ImageSpace.Size);
-
-		Settings.ImageSize = ImageSpace.Size;
+	if (Data == nullptr)
+	{
+		std::cerr << Local("Part of the image is damaged and couldn't be read: ") << Filename << std::endl;
+		return false;
+	}
 
-		DisplaySpace.Size = ImageSpace.Size / (float)PixelsBelow;
+	// Rows the file didn't get to are left blank.  Every row was only allocated once, at the end of the buffer, so
+	// there's nothing to compact.
+	for (unsigned int Row = 0; Row < Data->Rows.size(); ++Row)
+		if (Data->Rows[Row].empty()) Data->Rows.Assign(Row, &Data->Width, 1);
 
-		unsigned int TotalLengths = 0;
-		for (unsigned int CurrentRow = 0; CurrentRow < RowCount; CurrentRow++)
-		{
-			unsigned int RunCount;
-			BZ2_bzRead(&Error, CompressInput, &RunCount, sizeof(RunCount));
-
-			std::vector<unsigned int> Runs;
-			Runs.resize(RunCount * 2);
-			BZ2_bzRead(&Error, CompressInput, &Runs[0], sizeof(unsigned int) * RunCount * 2);
-			
-			Data->Rows[CurrentRow].clear();
-			Data->Rows[CurrentRow].reserve(RunCount * 2);
-			bool First = true;
-			unsigned int LineWidth = 0;
-			for (auto const &Run : Runs) 
-			{
-				if (First) First = false;
-				else if (Run == 0) continue;
-				Data->Rows[CurrentRow].push_back(Run);
-				LineWidth += Run;
-				TotalLengths += Run;
-			}
-			assert(LineWidth == Width);
-		}
-		assert(TotalLengths == Width * RowCount);
+	if (Damaged || (CurrentRow != RowCount) || !Pending.empty())
+	{
+		std::cerr << Local("Part of the image is damaged and couldn't be read: ") << Filename << std::endl;
+		return false;
 	}
 
-	/// Close the file and finish up.
-	BZ2_bzReadClose(&Error, CompressInput);
-	fclose(Input);
+	return true;
 }
 
-Image::~Image(void)
+bool Image::Export(String const &Filename)
 {
-	delete Data;
-}
+	unsigned int const Scale = Settings.ExportScale;
+	unsigned int const
+		Width = floor(ImageSpace.Size[0] / Scale),
+		Height = floor(ImageSpace.Size[1] / Scale);
+	if ((Width < 1) || (Height < 1))
+	{
+		std::cerr << Local("The image is too small to export at this scale: ") << Filename << std::endl;
+		return false;
+	}
 
-bool Image::Save(String const &Filename)
-{
-	/// Open the file
+	/// Work out the colors and the smallest format that can hold them
+	// PNG doesn't premultiply alpha.  If every shade is an opaque gray, we can write gray levels, and if they are all
+	// black or white a single bit per pixel.
+	unsigned int const ShadeCount = Scale * Scale + 1;
+	std::vector<uint8_t> Palette(ShadeCount * 4);
+	bool Gray = Settings.ExportGrayscale, Bilevel = Settings.ExportGrayscale;
+	for (unsigned int Shade = 0; Shade < ShadeCount; ++Shade)
+	{
+		Color const Intermediary(Settings.ExportPaper, Settings.ExportInk, (float)Shade / (float)(ShadeCount - 1));
+		uint8_t *Entry = &Palette[Shade * 4];
+		Entry[0] = Intermediary.Red * 0xff;
+		Entry[1] = Intermediary.Green * 0xff;
+		Entry[2] = Intermediary.Blue * 0xff;
+		Entry[3] = Intermediary.Alpha * 0xff;
+		if ((Entry[3] != 0xff) || (Entry[0] != Entry[1]) || (Entry[0] != Entry[2])) Gray = Bilevel = false;
+		if ((Entry[0] != 0) && (Entry[0] != 0xff)) Bilevel = false;
+	}
+
+	/// Open the file and start the PNG
 	FILE *Output = fopen(Filename.c_str(), "wb");
 	if (Output == nullptr)
 	{
@@ -910,101 +3301,207 @@ bool Image::Save(String const &Filename)
 		return false;
 	}
 
-	/// Add a simple header
-	char Identifier[32];
-	memset(Identifier, 0, 32);
-	strncpy(Identifier, "inscribble v02\n", 32);
-
-	fwrite(Identifier, sizeof(char), 32, Output);
-
-	/// Prepare the bz2 stream
-	int Error;
-	BZFILE *CompressOutput = BZ2_bzWriteOpen(&Error, Output, 5, 0, 30);
-	if (Error != BZ_OK)
+	png_structp PNG = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+	png_infop PNGInfo = (PNG == nullptr) ? nullptr : png_create_info_struct(PNG);
+	if (PNGInfo == nullptr)
 	{
-		if (Error == BZ_IO_ERROR) std::cerr << Local("bz2 noticed the file had an error after being opened: ") << Filename << std::endl;
-		if (Error == BZ_MEM_ERROR) std::cerr << Local("bz2 ran out of memory when opening file for writing: ") << Filename << std::endl;
-		BZ2_bzWriteClose(&Error, CompressOutput, 0, nullptr, nullptr);
+		std::cerr << Local("libpng ran out of memory when starting export: ") << Filename << std::endl;
+		png_destroy_write_struct(&PNG, nullptr);
 		fclose(Output);
 		return false;
 	}
 
-	/// Write paper/export colors
-	LittleEndian<Color> DisplayPaper = Settings.DisplayPaper, DisplayInk = Settings.DisplayInk,
-		ExportPaper = Settings.ExportPaper, ExportInk = Settings.ExportInk;
-
-	BZ2_bzWrite(&Error, CompressOutput, &DisplayPaper, sizeof(DisplayPaper));
-	BZ2_bzWrite(&Error, CompressOutput, &DisplayInk, sizeof(DisplayInk));
-	BZ2_bzWrite(&Error, CompressOutput, &ExportPaper, sizeof(ExportPaper));
-	BZ2_bzWrite(&Error, CompressOutput, &ExportInk, sizeof(ExportInk));
-
-	/// Write the image data
-	LittleEndian<uint32_t> RowCountBuffer = Data->Rows.size();
-	BZ2_bzWrite(&Error, CompressOutput, &RowCountBuffer, sizeof(RowCountBuffer));
-	LittleEndian<uint32_t> WidthBuffer = Data->Width;
-	BZ2_bzWrite(&Error, CompressOutput, &WidthBuffer, sizeof(WidthBuffer));
-	
-	std::vector<LittleEndian<uint32_t> > Runs;
-	for (uint32_t CurrentRow = 0; CurrentRow < Data->Rows.size(); CurrentRow++)
+	/// Split the rows into bands that are scaled, filtered and compressed in parallel
+	// Each band is deflated on its own and ends on a byte boundary (a sync flush), so the pieces can be written one
+	// after another as a single zlib stream, the way pigz does it.  Only the last band finishes the stream, and like
+	// pigz each band uses the end of the band before it as a dictionary so little compression is lost.  A wave of a
+	// few bands per thread is kept in memory at a time, so memory doesn't depend on the height of the export.
+	unsigned int const PixelBytes = Gray ? 1 : 4;
+	size_t const RowBytes = Bilevel ? (Width + 7) / 8 : Width * PixelBytes;
+	unsigned int const BandHeight = std::max((size_t)1, ((size_t)1 << 18) / (RowBytes + 1));
+	unsigned int const BandCount = (Height + BandHeight - 1) / BandHeight;
+	Workers.SetThreadCount(Settings.RenderThreads);
+	unsigned int const WaveSize = Workers.GetThreadCount() * 2;
+
+	struct ExportBand
 	{
-		uint32_t NativeRunCount = Data->Rows[CurrentRow].size();
-		LittleEndian<uint32_t> RunCount = NativeRunCount;
-		BZ2_bzWrite(&Error, CompressOutput, &RunCount, sizeof(RunCount));
-
-		Runs.clear();
-		Runs.reserve(Data->Rows[CurrentRow].size());
-		for (auto const &Run : Data->Rows[CurrentRow]) Runs.push_back(Run);
-		BZ2_bzWrite(&Error, CompressOutput, &Runs[0], sizeof(LittleEndian<uint32_t>) * Runs.size());
-	}
+		std::vector<unsigned int> LineShades;
+		std::vector<uint8_t> Filtered, Compressed;
+		uLong Check;
+		bool Failed;
+	};
+	std::vector<ExportBand> Bands(std::min(WaveSize, BandCount));
+	size_t const DictionarySize = 32768;
+	std::vector<uint8_t> Dictionary; // The end of the last band of the previous wave
 
-	/// Close everything
-	BZ2_bzWriteClose(&Error, CompressOutput, 0, nullptr, nullptr);
-	fclose(Output);
+	auto FilterBand = [&](unsigned int const &Band, ExportBand &Out)
+	{
+		unsigned int const BandTop = Band * BandHeight, BandBottom = std::min(Height, BandTop + BandHeight);
+		Out.LineShades.resize(Width);
+		Out.Filtered.resize((BandBottom - BandTop) * (RowBytes + 1));
+
+		/// Scale and filter each row
+		// Filters can't look outside of the band, so the first row of a band can't use up.  Like libpng, the filter
+		// with the smallest sum of (signed) bytes is picked for each row.
+		std::vector<uint8_t> Row(RowBytes), Above(RowBytes), Candidate(RowBytes);
+		for (unsigned int CurrentRow = BandTop; CurrentRow < BandBottom; ++CurrentRow)
+		{
+			unsigned int *LineShades = &Out.LineShades[0];
+			memset(LineShades, 0, sizeof(unsigned int) * Width);
+			Data->Combine(LineShades, Width, 0, CurrentRow, Scale);
 
-	ModifiedSinceSave = false;
+			if (Bilevel)
+			{
+				std::fill(Row.begin(), Row.end(), 0);
+				for (unsigned int Column = 0; Column < Width; ++Column)
+					if (Palette[LineShades[Column] * 4] != 0) Row[Column / 8] |= 0x80 >> (Column % 8);
+			}
+			else if (Gray)
+			{
+				for (unsigned int Column = 0; Column < Width; ++Column)
+					Row[Column] = Palette[LineShades[Column] * 4];
+			}
+			else
+			{
+				for (unsigned int Column = 0; Column < Width; ++Column)
+					memcpy(&Row[Column * 4], &Palette[LineShades[Column] * 4], 4);
+			}
 
-	return true;
-}
+			uint8_t *Destination = &Out.Filtered[(CurrentRow - BandTop) * (RowBytes + 1)];
+			auto Cost = [&](std::vector<uint8_t> const &Bytes)
+			{
+				size_t Sum = 0;
+				for (uint8_t const Byte : Bytes) Sum += (Byte < 128) ? Byte : 256 - Byte;
+				return Sum;
+			};
+			Destination[0] = PNG_FILTER_VALUE_NONE;
+			memcpy(Destination + 1, &Row[0], RowBytes);
+			size_t BestCost = Cost(Row);
+			if (!Bilevel)
+			{
+				for (size_t Index = 0; Index < RowBytes; ++Index)
+					Candidate[Index] = Row[Index] - ((Index < PixelBytes) ? 0 : Row[Index - PixelBytes]);
+				size_t const SubCost = Cost(Candidate);
+				if (SubCost < BestCost)
+				{
+					BestCost = SubCost;
+					Destination[0] = PNG_FILTER_VALUE_SUB;
+					memcpy(Destination + 1, &Candidate[0], RowBytes);
+				}
+			}
+			if (CurrentRow > BandTop)
+			{
+				for (size_t Index = 0; Index < RowBytes; ++Index)
+					Candidate[Index] = Row[Index] - Above[Index];
+				if (Cost(Candidate) < BestCost)
+				{
+					Destination[0] = PNG_FILTER_VALUE_UP;
+					memcpy(Destination + 1, &Candidate[0], RowBytes);
+				}
+			}
+			Row.swap(Above);
+		}
+		Out.Check = adler32(adler32(0, nullptr, 0), &Out.Filtered[0], Out.Filtered.size());
+	};
 
-bool Image::Export(String const &Filename)
-{
-	int const &Scale = Settings.ExportScale;
-	FlatVector const ExportSize(floor(ImageSpace.Size[0] / Scale), floor(ImageSpace.Size[1] / Scale));
+	auto DeflateBand = [&](unsigned int const &Band, ExportBand &Out, uint8_t const *Preset, size_t const &PresetSize)
+	{
+		z_stream Stream;
+		memset(&Stream, 0, sizeof(Stream));
+		Out.Failed = false;
+		if (deflateInit2(&Stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			Out.Failed = true;
+			return;
+		}
+		if ((PresetSize > 0) && (deflateSetDictionary(&Stream, Preset, PresetSize) != Z_OK)) Out.Failed = true;
+		Out.Compressed.resize(deflateBound(&Stream, Out.Filtered.size()) + 16); // The bound doesn't count sync flushes
+		Stream.next_in = &Out.Filtered[0];
+		Stream.avail_in = Out.Filtered.size();
+		Stream.next_out = &Out.Compressed[0];
+		Stream.avail_out = Out.Compressed.size();
+		bool const Last = Band + 1 == BandCount;
+		int const Result = deflate(&Stream, Last ? Z_FINISH : Z_SYNC_FLUSH);
+		// A flush that ran out of room may still have output pending
+		bool const Flushed = Last ? (Result == Z_STREAM_END) : ((Result == Z_OK) && (Stream.avail_out > 0));
+		if (!Flushed || (Stream.avail_in != 0)) Out.Failed = true;
+		Out.Compressed.resize(Out.Compressed.size() - Stream.avail_out);
+		deflateEnd(&Stream);
+	};
 
-	// Create an export surface
-	cairo_surface_t *ExportSurface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, ExportSize[0], ExportSize[1]);
-	if (cairo_surface_status(ExportSurface) != CAIRO_STATUS_SUCCESS)
+	if (setjmp(png_jmpbuf(PNG)))
 	{
-		std::cerr << Local("Cairo failed when trying to create a temporary surface for exporting: ") <<
-			cairo_status_to_string(cairo_surface_status(ExportSurface)) << std::endl;
-		cairo_surface_destroy(ExportSurface);
+		std::cerr << Local("libpng failed while exporting: ") << Filename << std::endl;
+		png_destroy_write_struct(&PNG, &PNGInfo);
+		fclose(Output);
 		return false;
 	}
 
-	cairo_t *ExportContext = cairo_create(ExportSurface);
+	png_init_io(PNG, Output);
+	png_set_IHDR(PNG, PNGInfo, Width, Height, Bilevel ? 1 : 8,
+		Gray ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB_ALPHA,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(PNG, PNGInfo);
 
-	// Scale and draw to the export surface
-	if (!RenderInternal(Region(FlatVector(), ExportSize), ExportContext, Scale, Settings.ExportInk, Settings.ExportPaper))
+	/// Compress a wave of bands at a time and write them out in order
+	uLong Check = adler32(0, nullptr, 0);
+	for (unsigned int WaveTop = 0; WaveTop < BandCount; WaveTop += WaveSize)
 	{
-		cairo_destroy(ExportContext);
-		cairo_surface_destroy(ExportSurface);
-		return false;
+		unsigned int const WaveBands = std::min(WaveSize, BandCount - WaveTop);
+		unsigned int const RowTop = WaveTop * BandHeight;
+		Data->PrepareCombine(RowTop, std::min(WaveBands * BandHeight, Height - RowTop), Scale, false);
+		auto FilterWaveBand = [&](unsigned int const &Band) { FilterBand(WaveTop + Band, Bands[Band]); };
+		Workers.Run(WaveBands, std::ref(FilterWaveBand));
+		auto DeflateWaveBand = [&](unsigned int const &Band)
+		{
+			if (Band == 0)
+			{
+				DeflateBand(WaveTop, Bands[0], Dictionary.data(), Dictionary.size());
+				return;
+			}
+			std::vector<uint8_t> const &Previous = Bands[Band - 1].Filtered;
+			size_t const PresetSize = std::min(DictionarySize, Previous.size());
+			DeflateBand(WaveTop + Band, Bands[Band], &Previous[Previous.size() - PresetSize], PresetSize);
+		};
+		Workers.Run(WaveBands, std::ref(DeflateWaveBand));
+
+		for (unsigned int Band = 0; Band < WaveBands; ++Band)
+		{
+			ExportBand const &Current = Bands[Band];
+			if (Current.Failed)
+			{
+				std::cerr << Local("zlib failed while exporting: ") << Filename << std::endl;
+				png_destroy_write_struct(&PNG, &PNGInfo);
+				fclose(Output);
+				return false;
+			}
+
+			bool const First = WaveTop + Band == 0, Last = WaveTop + Band + 1 == BandCount;
+			Check = adler32_combine(Check, Current.Check, Current.Filtered.size());
+			uint8_t const Header[2] = {0x78, 0x9c}; // 32k window, default compression
+			uint8_t const Trailer[4] = {(uint8_t)(Check >> 24), (uint8_t)(Check >> 16), (uint8_t)(Check >> 8), (uint8_t)Check};
+			png_write_chunk_start(PNG, (png_const_bytep)"IDAT",
+				(First ? 2 : 0) + Current.Compressed.size() + (Last ? 4 : 0));
+			if (First) png_write_chunk_data(PNG, Header, 2);
+			png_write_chunk_data(PNG, &Current.Compressed[0], Current.Compressed.size());
+			if (Last) png_write_chunk_data(PNG, Trailer, 4);
+			png_write_chunk_end(PNG);
+		}
+
+		std::vector<uint8_t> const &Last = Bands[WaveBands - 1].Filtered;
+		Dictionary.assign(Last.end() - std::min(DictionarySize, Last.size()), Last.end());
 	}
 
-	// Save it and clean up
-	cairo_status_t Result = cairo_surface_write_to_png(ExportSurface, Filename.c_str());
-	if (Result != CAIRO_STATUS_SUCCESS)
+	/// Finish up
+	// The image data went around libpng, so it would complain about a missing IDAT in png_write_end
+	png_write_chunk(PNG, (png_const_bytep)"IEND", nullptr, 0);
+	png_destroy_write_struct(&PNG, &PNGInfo);
+	if (fclose(Output) != 0)
 	{
-		std::cerr << Local("Cairo failed when trying to export the image surface to PNG: ") <<
-			cairo_status_to_string(cairo_surface_status(ExportSurface)) << std::endl;
-		cairo_destroy(ExportContext);
-		cairo_surface_destroy(ExportSurface);
+		std::cerr << Local("Could not finish writing: ") << Filename << std::endl;
 		return false;
 	}
 
-	cairo_destroy(ExportContext);
-	cairo_surface_destroy(ExportSurface);
-
 	return true;
 }
 
@@ -1123,10 +3620,17 @@ Region Image::Mark(CursorState const &Start, CursorState const &End, bool const
 	/// Do the drawing
 	if (CurrentMarkUndo == nullptr)
 		CurrentMarkUndo = new ::Mark(*Data);
+	int DirtyLeft = Data->Width, DirtyRight = 0, DirtyTop = Data->Rows.size(), DirtyBottom = 0;
 	auto const Line = [&](int Left, int Right, int Row, bool Black)
 	{
 		CurrentMarkUndo->AddLine(Row);
 		Data->Line(Left, Right, Row, Black);
+		Journal.Touch(Row);
+		if (Left >= Right) return;
+		DirtyLeft = std::min(DirtyLeft, Left);
+		DirtyRight = std::max(DirtyRight, Right);
+		DirtyTop = std::min(DirtyTop, Row);
+		DirtyBottom = std::max(DirtyBottom, Row + 1);
 	};
 
 	// Fill in the lower cap region
@@ -1178,6 +3682,7 @@ Region Image::Mark(CursorState const &Start, CursorState const &End, bool const
 		Line(Left, Right, CurrentRow, Black);
 	}
 
+	Tiles.Invalidate(std::max(0, DirtyLeft), std::max(0, DirtyRight), DirtyTop, DirtyBottom);
 	ModifiedSinceSave = true;
 
 	/// Return the marked area
@@ -1194,8 +3699,11 @@ Region Image::Mark(CursorState const &Start, CursorState const &End, bool const
 
 void Image::FinishMark(void)
 {
+	// Every change finishes the mark first, so this is where the history picks up the current limit
+	Changes.SetLimit((size_t)Settings.UndoMemory * 1024 * 1024);
 	if (CurrentMarkUndo != nullptr)
 	{
+		CurrentMarkUndo->Finish();
 		Changes.AddUndo(CurrentMarkUndo);
 		CurrentMarkUndo = nullptr;
 	}
@@ -1203,8 +3711,45 @@ void Image::FinishMark(void)
 
 bool Image::Render(Region const &Invalid, cairo_t *Destination)
 {
-	return RenderInternal(DisplaySpace.Intersect(Region(Invalid.Start, Invalid.Size)),
-		Destination, PixelsBelow, Settings.DisplayInk, Settings.DisplayPaper);
+	Region const Visible = DisplaySpace.Intersect(Region(Invalid.Start, Invalid.Size));
+
+	Tiles.SetLimit((size_t)Settings.RenderCacheSize * 1024 * 1024);
+	Workers.SetThreadCount(Settings.RenderThreads);
+	if (!Tiles.IsEnabled())
+		return RenderInternal(Visible, Destination, PixelsBelow, Settings.DisplayInk, Settings.DisplayPaper, false);
+	Tiles.SetColors(Settings.DisplayInk, Settings.DisplayPaper);
+
+	/// Copy every tile overlapping the area, rendering the missing ones
+	if ((Visible.Size[0] < 1) || (Visible.Size[1] < 1)) return true;
+	unsigned int const
+		Left = Visible.Start[0],
+		Top = Visible.Start[1],
+		Right = Left + (unsigned int)Visible.Size[0],
+		Bottom = Top + (unsigned int)Visible.Size[1];
+	unsigned int const TileSize = RenderCache::TileSize;
+
+	for (unsigned int Row = Top / TileSize; Row * TileSize < Bottom; ++Row)
+		for (unsigned int Column = Left / TileSize; Column * TileSize < Right; ++Column)
+		{
+			cairo_surface_t *Tile = Tiles.Find(PixelsBelow, Column, Row);
+			if (Tile == nullptr)
+			{
+				Tile = RenderTile(Column, Row);
+				if (Tile == nullptr) return false;
+				Tiles.Store(PixelsBelow, Column, Row, Tile);
+			}
+
+			unsigned int const
+				CopyLeft = std::max(Left, Column * TileSize),
+				CopyTop = std::max(Top, Row * TileSize),
+				CopyRight = std::min(Right, (Column + 1) * TileSize),
+				CopyBottom = std::min(Bottom, (Row + 1) * TileSize);
+			cairo_set_source_surface(Destination, Tile, Column * TileSize, Row * TileSize);
+			cairo_rectangle(Destination, CopyLeft, CopyTop, CopyRight - CopyLeft, CopyBottom - CopyTop);
+			cairo_fill(Destination);
+		}
+
+	return true;
 }
 
 int Image::Zoom(int Amount)
@@ -1227,6 +3772,8 @@ void Image::FlipHorizontally(void)
 	::HorizontalFlip FlipChange(*Data);
 	bool Unused1, Unused2;
 	Changes.AddUndo(FlipChange.Apply(Unused1, Unused2));
+	Journal.TouchAll();
+	Tiles.Clear();
 	ModifiedSinceSave = true; 
 }
 
@@ -1236,6 +3783,8 @@ void Image::FlipVertically(void)
 	::VerticalFlip FlipChange(*Data);
 	bool Unused1, Unused2;
 	Changes.AddUndo(FlipChange.Apply(Unused1, Unused2));
+	Journal.TouchAll();
+	Tiles.Clear();
 	ModifiedSinceSave = true; 
 }
 		
@@ -1248,6 +3797,8 @@ void Image::Shift(bool Large, int Right, int Down)
 		Down * PixelsBelow * (Large ? 50 : 1));
 	bool Unused1, Unused2;
 	Changes.AddUndo(ShiftChange.Apply(Unused1, Unused2));
+	Journal.TouchAll();
+	Tiles.Clear();
 	ModifiedSinceSave = true;
 }
 		
@@ -1258,6 +3809,8 @@ void Image::Scale(unsigned int const &Factor)
 	::Enlarge ScaleChange(*Data, Factor);
 	bool Unused1, Unused2;
 	Changes.AddUndo(ScaleChange.Apply(Unused1, Unused2));
+	Journal.TouchAll();
+	Tiles.Clear();
 	ModifiedSinceSave = true;
 }
 
@@ -1267,6 +3820,8 @@ void Image::Add(unsigned int const &Left, unsigned int const &Right, unsigned in
 	::Add AddChange(*Data, Left, Right, Up, Down);
 	bool Unused1, Unused2;
 	Changes.AddUndo(AddChange.Apply(Unused1, Unused2));
+	Journal.TouchAll();
+	Tiles.Clear();
 	ModifiedSinceSave = true;
 	ImageSpace.Size[0] = Data->Width;
 	ImageSpace.Size[1] = Data->Rows.size();
@@ -1276,14 +3831,35 @@ void Image::Add(unsigned int const &Left, unsigned int const &Right, unsigned in
 bool Image::HasChanges(void)
 	{ return ModifiedSinceSave; }
 
+bool Image::Loaded(void)
+	{ return LoadSucceeded && !Data->Damaged(); }
+
 void Image::Undo(bool &FlippedHorizontally, bool &FlippedVertically)
-	{ if (Changes.CanUndo()) Changes.Undo(FlippedHorizontally, FlippedVertically); }
+{
+	if (!Changes.CanUndo()) return;
+	std::vector<unsigned int> ChangedRows;
+	if (!Changes.Undo(FlippedHorizontally, FlippedVertically, ChangedRows)) Journal.TouchAll();
+	else for (auto const &Row : ChangedRows) Journal.Touch(Row);
+	Tiles.Clear();
+	ModifiedSinceSave = true;
+}
 
 void Image::Redo(bool &FlippedHorizontally, bool &FlippedVertically)
-	{ if (Changes.CanRedo()) Changes.Redo(FlippedHorizontally, FlippedVertically); }
+{
+	if (!Changes.CanRedo()) return;
+	std::vector<unsigned int> ChangedRows;
+	if (!Changes.Redo(FlippedHorizontally, FlippedVertically, ChangedRows)) Journal.TouchAll();
+	else for (auto const &Row : ChangedRows) Journal.Touch(Row);
+	Tiles.Clear();
+	ModifiedSinceSave = true;
+}
+
+size_t Image::UndoFootprint(void) const { return Changes.UndoFootprint(); }
+
+size_t Image::RedoFootprint(void) const { return Changes.RedoFootprint(); }
 
 bool Image::RenderInternal(Region const &Invalid, cairo_t *Destination, int Scale,
-	Color const &Foreground, Color const &Background)
+	Color const &Foreground, Color const &Background, bool const &Exact)
 {
 	/// Prepare a buffer before we copy to the screen
 	if ((Invalid.Size[0] < 1) || (Invalid.Size[1] < 1)) return true;
@@ -1293,72 +3869,123 @@ bool Image::RenderInternal(Region const &Invalid, cairo_t *Destination, int Scal
 		InvalidWidth = Invalid.Size[0],
 		InvalidHeight = Invalid.Size[1];
 
-	int Stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, InvalidWidth);
-	unsigned char *Pixels = new unsigned char[Stride * InvalidHeight];
+	// The surface is kept between renders and only replaced when it's too small
+	if ((ScratchSurface == nullptr) ||
+		((unsigned int)cairo_image_surface_get_width(ScratchSurface) < InvalidWidth) ||
+		((unsigned int)cairo_image_surface_get_height(ScratchSurface) < InvalidHeight))
+	{
+		unsigned int NewWidth = InvalidWidth, NewHeight = InvalidHeight;
+		if (ScratchSurface != nullptr)
+		{
+			NewWidth = std::max(NewWidth, (unsigned int)cairo_image_surface_get_width(ScratchSurface));
+			NewHeight = std::max(NewHeight, (unsigned int)cairo_image_surface_get_height(ScratchSurface));
+			cairo_surface_destroy(ScratchSurface);
+		}
+		ScratchSurface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, NewWidth, NewHeight);
+		if (cairo_surface_status(ScratchSurface) != CAIRO_STATUS_SUCCESS)
+		{
+			std::cerr << Local("Cairo failed when trying to create a temporary surface for rendering: ") <<
+				cairo_status_to_string(cairo_surface_status(ScratchSurface)) << std::endl;
+			cairo_surface_destroy(ScratchSurface);
+			ScratchSurface = nullptr;
+			return false;
+		}
+	}
+
+	cairo_surface_flush(ScratchSurface);
+	RenderPixels(cairo_image_surface_get_data(ScratchSurface), cairo_image_surface_get_stride(ScratchSurface),
+		InvalidX, InvalidY, InvalidWidth, InvalidHeight, Scale, Foreground, Background, Exact);
+	cairo_surface_mark_dirty(ScratchSurface);
 
+	/// Copy the buffer to the screen
+	cairo_set_source_surface(Destination, ScratchSurface, InvalidX, InvalidY);
+	cairo_rectangle(Destination, InvalidX, InvalidY, InvalidWidth, InvalidHeight);
+	cairo_fill(Destination);
+
+	return true;
+}
+
+void Image::RenderPixels(unsigned char *Pixels, int const &Stride,
+	unsigned int const &X, unsigned int const &Y, unsigned int const &Width, unsigned int const &Height,
+	int Scale, Color const &Foreground, Color const &Background, bool const &Exact)
+{
 	/// Figure out the shades for drawing the image
 	// Every time we zoom out, 4 times the amount of source pixels will be part of one screen pixel,
 	// so each pixel contributes less color.
-	unsigned int ShadeCount = Scale * Scale + 1;
-
-	float ShadeUnitScale = 1.0f / (float)(ShadeCount - 1);
-	uint32_t *Colors = new uint32_t[ShadeCount]; // Shades between background and foreground colors. 0 is bg, Scale * Scale is fg.
-	for (unsigned int CurrentColor = 0; CurrentColor < ShadeCount; CurrentColor++)
+	if ((PaletteScale != (unsigned int)Scale) ||
+		!SameColor(PaletteForeground, Foreground) || !SameColor(PaletteBackground, Background))
 	{
-		// Blend the two colors and cache the color in premultiplied form
-		Color const Intermediary(Background, Foreground, (float)CurrentColor * ShadeUnitScale);
-		Colors[CurrentColor] =
-			(uint32_t)(Intermediary.Alpha * 0xff) << 24 |
-			(uint32_t)(Intermediary.Red * Intermediary.Alpha * 0xff) << 16 |
-			(uint32_t)(Intermediary.Green * Intermediary.Alpha * 0xff) << 8 |
-			(uint32_t)(Intermediary.Blue * Intermediary.Alpha * 0xff) << 0;
+		unsigned int ShadeCount = Scale * Scale + 1;
+
+		float ShadeUnitScale = 1.0f / (float)(ShadeCount - 1);
+		Palette.resize(ShadeCount); // Shades between background and foreground colors. 0 is bg, Scale * Scale is fg.
+		for (unsigned int CurrentColor = 0; CurrentColor < ShadeCount; CurrentColor++)
+		{
+			// Blend the two colors and cache the color in premultiplied form
+			Color const Intermediary(Background, Foreground, (float)CurrentColor * ShadeUnitScale);
+			Palette[CurrentColor] =
+				(uint32_t)(Intermediary.Alpha * 0xff) << 24 |
+				(uint32_t)(Intermediary.Red * Intermediary.Alpha * 0xff) << 16 |
+				(uint32_t)(Intermediary.Green * Intermediary.Alpha * 0xff) << 8 |
+				(uint32_t)(Intermediary.Blue * Intermediary.Alpha * 0xff) << 0;
+		}
+		PaletteScale = Scale;
+		PaletteForeground = Foreground;
+		PaletteBackground = Background;
 	}
+	uint32_t const *Colors = &Palette[0];
 
 	/// Do scaling into the buffer one line at a time
 	// Go through each screen row and accumulate shade wherever there is a "black pixel".
 	// The shade count then corresponds to colors from the color map.
-	unsigned int *LineShades = new unsigned int[InvalidWidth];
-
-	void *CurrentPixelByte = Pixels;
-	for (unsigned int CurrentRow = 0; CurrentRow < (unsigned int)InvalidHeight; CurrentRow++)
+	// Rows are independent, so bands of rows are split between the worker threads.
+	Data->PrepareCombine(Y, Height, Scale, !Exact);
+	unsigned int const BandHeight = std::max(8u, Height / (Workers.GetThreadCount() * 4));
+	unsigned int const BandCount = (Height + BandHeight - 1) / BandHeight;
+	if (BandShades.size() < BandCount) BandShades.resize(BandCount);
+	auto RenderBand = [&](unsigned int const &Band)
 	{
-		// Blank the row
-		memset(LineShades, 0, sizeof(unsigned int) * InvalidWidth);
-
-		// Add up underlying image lines
-		Data->Combine(LineShades, InvalidWidth, InvalidX, InvalidY + CurrentRow, Scale);
+		std::vector<unsigned int> &Shades = BandShades[Band];
+		if (Shades.size() < Width) Shades.resize(Width);
+		unsigned int *LineShades = &Shades[0];
 
-		// Copy the row to the buffer
-		uint32_t *CurrentPixel = (uint32_t *)CurrentPixelByte;
-		for (unsigned int CurrentColumn = 0; CurrentColumn < InvalidWidth; CurrentColumn++)
+		unsigned int const BandTop = Band * BandHeight, BandBottom = std::min(Height, BandTop + BandHeight);
+		void *CurrentPixelByte = Pixels + Stride * BandTop;
+		for (unsigned int CurrentRow = BandTop; CurrentRow < BandBottom; CurrentRow++)
 		{
-			*CurrentPixel = Colors[LineShades[CurrentColumn]];
-			CurrentPixel++;
-		}
+			// Blank the row
+			memset(LineShades, 0, sizeof(unsigned int) * Width);
 
-		// Move to the next row
-		CurrentPixelByte = (unsigned char *)CurrentPixelByte + Stride;
-	}
+			// Add up underlying image lines
+			if (Exact) Data->Combine(LineShades, Width, X, Y + CurrentRow, Scale);
+			else Data->CombineCoarse(LineShades, Width, X, Y + CurrentRow, Scale);
 
-	delete [] LineShades;
-	delete [] Colors;
+			// Copy the row to the buffer
+			ShadePixels((uint32_t *)CurrentPixelByte, LineShades, Colors, Width);
 
-	/// Copy the buffer to the screen
-	cairo_surface_t *CopySurface = cairo_image_surface_create_for_data(
-		Pixels, CAIRO_FORMAT_ARGB32, InvalidWidth, InvalidHeight, Stride);
-	if (cairo_surface_status(CopySurface) != CAIRO_STATUS_SUCCESS)
+			// Move to the next row
+			CurrentPixelByte = (unsigned char *)CurrentPixelByte + Stride;
+		}
+	};
+	Workers.Run(BandCount, std::ref(RenderBand)); // A reference fits in the function without allocating
+}
+
+cairo_surface_t *Image::RenderTile(unsigned int const &Column, unsigned int const &Row)
+{
+	unsigned int const TileSize = RenderCache::TileSize;
+	cairo_surface_t *Tile = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, TileSize, TileSize);
+	if (cairo_surface_status(Tile) != CAIRO_STATUS_SUCCESS)
 	{
 		std::cerr << Local("Cairo failed when trying to create a temporary surface for rendering: ") <<
-			cairo_status_to_string(cairo_surface_status(CopySurface)) << std::endl;
-		cairo_surface_destroy(CopySurface);
-		return false;
+			cairo_status_to_string(cairo_surface_status(Tile)) << std::endl;
+		cairo_surface_destroy(Tile);
+		return nullptr;
 	}
 
-	cairo_set_source_surface(Destination, CopySurface, InvalidX, InvalidY);
-	cairo_paint(Destination);
-
-	cairo_surface_destroy(CopySurface);
-	delete [] Pixels;
-
-	return true;
+	cairo_surface_flush(Tile);
+	RenderPixels(cairo_image_surface_get_data(Tile), cairo_image_surface_get_stride(Tile),
+		Column * TileSize, Row * TileSize, TileSize, TileSize,
+		PixelsBelow, Settings.DisplayInk, Settings.DisplayPaper, false);
+	cairo_surface_mark_dirty(Tile);
+	return Tile;
 }
@@ -4,14 +4,41 @@
 #define image_h
 
 #include <cairo/cairo.h>
+#include <cassert>
+#include <cstdio>
+#include <stdint.h>
 #include <deque>
+#include <list>
+#include <map>
+#include <thread>
+#include <vector>
 
 #include "ren-general/lifetime.h"
 
 #include "settings.h"
 #include "cursorstate.h"
+#include "workerpool.h"
+#include "compression.h"
 
 class UndoLevel;
+struct DeferredRows;
+
+// A temporary file holding undo levels spilled from memory.  Space freed by deleted levels is reused.  Only used by
+// one thread at a time.
+class UndoStore
+{
+	public:
+		UndoStore(void);
+		~UndoStore(void); // The file is deleted when closed
+		bool Write(std::vector<uint8_t> const &Data, off_t &Offset); // Returns false if the data should stay in memory
+		bool Read(off_t const &Offset, std::vector<uint8_t> &Data); // Fills Data, which must be the size written
+		void Release(off_t const &Offset, size_t const &Size);
+	private:
+		FILE *File; // Created on the first write
+		bool Failed; // Stop trying after the first error
+		off_t End;
+		std::map<off_t, size_t> Free;
+};
 
 class Change
 {
@@ -24,34 +51,241 @@ class Change
 		};
 
 		virtual ~Change(void);
-		virtual Change *Apply(bool &FlippedHorizontally, bool &FlippedVertically) = 0; // Returns undo change for this change
+		// Returns undo change for this change, or null if the change was lost and nothing was applied
+		virtual Change *Apply(bool &FlippedHorizontally, bool &FlippedVertically) = 0;
 		virtual CombineResult Combine(Change *Other) = 0;
+		virtual size_t Footprint(void) const; // Roughly how many bytes the change uses, in memory
+		// Shrinks the change if it can, for levels that probably won't be applied soon, and moves it to Store if that
+		// isn't null.  Prefetch brings it back into memory.  Both are called on another thread, and Apply has to work
+		// either way.
+		virtual void Freeze(UndoStore *Store);
+		virtual void Prefetch(void);
+		// Adds the rows that applying the change would replace to Rows, or returns false if it changes every row or the
+		// size.  Only asked of changes that aren't frozen.
+		virtual bool ChangedRows(std::vector<unsigned int> &Rows) const;
 };
 
+// Keeps as many undo levels as fit in a memory limit, dropping the oldest first.  The newest undo level is always kept.
+// Levels on either stack other than the newest few are frozen on another thread, and the oldest of those are spilled
+// to a temporary file so they barely count against the limit.  After an undo or redo, the next level on that stack is
+// read back on the same thread.  If a level was lost and can't be applied, the levels past it on that stack are
+// dropped too, since they only make sense after it.
 class ChangeManager
 {
 	public:
+		ChangeManager(void);
+		~ChangeManager(void); // Waits for any freezing to finish
+		void SetLimit(size_t const &Bytes); // Counts both undo and redo levels
 		void AddUndo(Change *Undo);
 		bool CanUndo(void);
-		void Undo(bool &FlippedHorizontally, bool &FlippedVertically);
+		// Returns true if only the rows added to ChangedRows changed, which is none if the level was lost
+		bool Undo(bool &FlippedHorizontally, bool &FlippedVertically, std::vector<unsigned int> &ChangedRows);
 		bool CanRedo(void);
-		void Redo(bool &FlippedHorizontally, bool &FlippedVertically);
+		bool Redo(bool &FlippedHorizontally, bool &FlippedVertically, std::vector<unsigned int> &ChangedRows);
+
+		size_t UndoFootprint(void) const; // Levels still being frozen count at their size before
+		size_t RedoFootprint(void) const;
+	private:
+		// The levels of one stack, the newest at the back
+		struct Stack
+		{
+			Stack(void);
+			void Push(Change *Level);
+			Change *Take(void); // Removes the newest level without deleting it
+			void PopFront(void);
+
+			DeleterDequeue<Change> Levels;
+			size_t Bytes;
+			unsigned int Cold; // Levels at the front that have been frozen or are being frozen
+			unsigned int Spilled; // Levels at the front that have been spilled or are being spilled, never more than Cold
+		};
+
+		struct Task
+		{
+			Change *Level;
+			size_t *Bytes; // Stack total to correct afterwards
+			size_t Before; // Footprint of Level before
+			UndoStore *Store; // Where to spill the level, if freezing
+			bool Prefetch;
+		};
+
+		void Trim(void);
+		void Lose(Stack &Side);
+		void FreezeCold(Stack &Side);
+		void Prefetch(Stack &Side);
+		void Start(void);
+		void Wait(void);
+		static void Run(std::vector<Task> const Tasks); // On the freezer thread
+
+		UndoStore Store; // Before the stacks, so it outlives their levels
+		Stack Undos, Redos;
+		size_t Limit;
+		std::vector<Task> Tasks; // Queued, or running if Freezer is
+		std::thread Freezer;
+};
+
+// Runs for every row of an image, packed into one buffer.  Each row has a slot with some slack so it can grow in
+// place.  Rows that outgrow their slot move to the end of the buffer, and the buffer is compacted once enough of it
+// is abandoned.  Pointers into rows are only valid until the next call that changes a row's size.
+class RowStore
+{
+	public:
+		typedef unsigned int Run;
+
+		class Row
+		{
+			public:
+				Row(Run const *Start, unsigned int const &Count) : Start(Start), Count(Count) {}
+				unsigned int size(void) const { return Count; }
+				bool empty(void) const { return Count == 0; }
+				Run const &operator[](unsigned int const &Index) const { assert(Index < Count); return Start[Index]; }
+				Run const &back(void) const { assert(Count > 0); return Start[Count - 1]; }
+				Run const *begin(void) const { return Start; }
+				Run const *end(void) const { return Start + Count; }
+			private:
+				Run const *Start;
+				unsigned int Count;
+		};
+
+		RowStore(void);
+		RowStore(std::vector<std::vector<Run> > const &Rows);
+
+		unsigned int size(void) const;
+		Row operator[](unsigned int const &Index) const;
+
+		void Resize(unsigned int const &Count, Run const &Fill); // New rows are a single run of Fill
+		void AddUnset(unsigned int const &Count); // New rows have no runs, and have to be set before they're read
+		void Assign(unsigned int const &Index, Run const *Runs, unsigned int const &Count); // Runs must not be from this store
+		Run *Allocate(unsigned int const &Index, unsigned int const &Count); // Old contents are lost
+		Run *Edit(unsigned int const &Index);
+		// Replaces Erase runs at Position with Insert unset runs, returning the start of the row
+		Run *Splice(unsigned int const &Index, unsigned int const &Position, unsigned int const &Erase, unsigned int const &Insert);
+		void Copy(unsigned int const &Target, unsigned int const &Source); // Copies the tag too
+		void Swap(unsigned int const &First, unsigned int const &Second);
+		void Reverse(void); // Reverses the order of the rows without moving any of them
+		void Rotate(unsigned int const &Down); // Moves every row down, wrapping around to the top, without moving any
+		void Compact(void);
+
+		// Each row has a number for the owner to use, which moves with the row.  New rows start at 0.
+		uint32_t GetTag(unsigned int const &Index) const;
+		void SetTag(unsigned int const &Index, uint32_t const &Tag);
+	private:
+		struct Slot
+		{
+			size_t Offset;
+			unsigned int Count, Capacity;
+			uint32_t Tag;
+		};
+
+		static unsigned int Slack(unsigned int const &Count);
+		unsigned int Locate(unsigned int const &Index) const; // Slot of a row
+		void Straighten(void); // Puts the slots in row order
+		Slot &Reserve(unsigned int const &Physical, unsigned int const &Count, bool const &Preserve);
+		void Collect(void);
+
+		std::vector<Slot> Slots;
+		std::vector<Run> Slab;
+		size_t Garbage; // Slab runs no longer part of any slot
+		bool Reversed; // Slots are in the opposite order to rows
+		unsigned int Origin; // Slot the first row is in, counting from the other end if reversed
+};
+
+// Where every Spacing-th run of long rows starts, so finding the run at a column doesn't mean summing the whole row.
+// Rows are indexed lazily when first searched.
+class SkipIndex
+{
+	public:
+		static unsigned int const Spacing = 32; // Runs between entries
+
+		void Invalidate(void);
+		void Invalidate(unsigned int const &Row);
+
+		// Indexes any stale rows from Top to Bottom, after which finding runs in them doesn't change the index
+		void Refresh(RowStore const &Rows, unsigned int const &Top, unsigned int const &Bottom);
+
+		// Finds the last indexed run starting before X, or the first run if there is none.  RunLeft is where it starts.
+		void Find(RowStore const &Rows, unsigned int const &Row, unsigned int const &X, unsigned int &RunIndex, unsigned int &RunLeft);
+
+		// Updates a row after Erase runs at Position were replaced by Insert runs covering the same columns
+		void Splice(RowStore const &Rows, unsigned int const &Row, unsigned int const &Position, unsigned int const &Erase, unsigned int const &Insert);
+	private:
+		struct Entry
+		{
+			unsigned int Index, Left;
+		};
+		typedef std::vector<Entry> EntryArray;
+
+		void Prepare(RowStore const &Rows);
+		void Build(RowStore::Row const &Runs, EntryArray &Entries);
+
+		std::vector<EntryArray> Entries;
+		std::vector<bool> Stale;
+};
+
+struct RunData;
+
+// Black pixel counts for square cells of the image at power-of-two sizes, run length encoded per cell row
+// Rows are rebuilt lazily after being invalidated, so only the parts of the image actually viewed get refreshed
+class CoveragePyramid
+{
+	public:
+		static unsigned int const BaseCellSize = 8;
+
+		CoveragePyramid(void);
+
+		void Invalidate(void);
+		void Invalidate(unsigned int const &Row); // Image row
+
+		// Whether it's worth using the pyramid at this scale rather than the original runs
+		static bool Covers(unsigned int const &Scale);
+
+		// Refreshes the cells used for screen rows Y to Y + Height, after which Combine on them doesn't change the pyramid
+		void Prepare(RunData const &Base, unsigned int const &Y, unsigned int const &Height, unsigned int const &Scale);
+
+		// Same as RunData::Combine, but estimates each screen pixel from the largest cells that fit in it.
+		// Counts are exact when the scale is a multiple of the cell size used.
+		void Combine(RunData const &Base, unsigned int *Buffer,
+			unsigned int const BufferWidth, unsigned int const X, unsigned int const Y, unsigned int const Scale);
 	private:
-		DeleterDequeue<Change> Undos, Redos;
+		struct Span
+		{
+			uint32_t Coverage;
+			uint32_t Length; // In cells
+		};
+		typedef std::vector<Span> SpanArray;
+
+		struct Level
+		{
+			unsigned int CellSize;
+			std::vector<SpanArray> Rows;
+			std::vector<bool> Dirty;
+		};
+
+		void Build(RunData const &Base);
+		unsigned int ChooseLevel(unsigned int const &Scale) const;
+		void Refresh(RunData const &Base, unsigned int const &LevelIndex, unsigned int const &Row);
+
+		std::vector<Level> Levels;
+		unsigned int Width, Height; // Image size the levels were built for
+		std::vector<uint32_t> Cells;
 };
 
 struct RunData
 {
 	public:
-		typedef unsigned int Run; // Each row starts with white (first run is white)
+		typedef RowStore::Run Run; // Each row starts with white (first run is white)
 		typedef std::vector<Run> RunArray;
 		typedef std::vector<RunArray> RowArray;
 
-		RowArray Rows;
+		RowStore Rows;
 		unsigned int Width;
+		CoveragePyramid Coverage;
+		SkipIndex Skips;
 
 		RunData(const FlatVector &Size);
 		RunData(std::vector<std::vector<Run> > const &InitialRows);
+		RunData(RunData const &) = delete;
+		~RunData(void);
 
 		/// Manipulation
 		void Line(int Left, int Right, unsigned int const &Y, bool Black);
@@ -60,6 +294,44 @@ struct RunData
 		// Counts come from the row of pixels on screen at X, Y (scale Scale)
 		void Combine(unsigned int *Buffer,
 			unsigned int const BufferWidth, unsigned int const X, unsigned int const Y, unsigned int const Scale);
+		// Same, but reads from the coverage pyramid when zoomed far enough out (approximate, see CoveragePyramid)
+		void CombineCoarse(unsigned int *Buffer,
+			unsigned int const BufferWidth, unsigned int const X, unsigned int const Y, unsigned int const Scale);
+		// Brings lookup structures up to date for screen rows Y to Y + Height, so the above can be called for those rows
+		// from several threads at once
+		void PrepareCombine(unsigned int const &Y, unsigned int const &Height, unsigned int const &Scale, bool const &Coarse);
+		void SwapRow(unsigned int const &Y, RunArray &Runs);
+
+		/// Storage
+		// How rows are laid out in files.  Words (v02) is each row's run count followed by its runs, all little endian
+		// 32 bit.  Packed (v03) uses variable length numbers, and when a row has as many runs as the row above it (within
+		// the same call) stores the differences from those runs instead.
+		enum class RowFormat { Words, Packed };
+		// Appends rows Top to Bottom to Out
+		void WriteRows(unsigned int const &Top, unsigned int const &Bottom, RowFormat const &Format, std::vector<uint8_t> &Out) const;
+		// Replaces rows Top to Bottom with rows written by WriteRows.  Returns false if the rows in Buffer are damaged.
+		bool ReadRows(unsigned int const &Top, unsigned int const &Bottom, RowFormat const &Format,
+			uint8_t const *Buffer, size_t const &Size);
+
+		/// Reading on demand
+		// Large images can leave their rows in the file they were loaded from until they're first used, and flipping or
+		// shifting horizontally only mirrors or shifts each row when it's next used.  Line, SwapRow and PrepareCombine
+		// read and orient the rows they touch and operations on the whole image do every row first, but Combine and
+		// WriteRows expect their rows to have been done already.  Rows not read yet are blank.
+		void Defer(DeferredRows *Source); // Takes ownership
+		// Copies the rows as they're stored, along with which are still in the file and how they're to be oriented, so
+		// the copy can be read and oriented on another thread.  This one has to have no rows yet.
+		void Copy(RunData const &Source);
+		void Materialize(unsigned int const &Top, unsigned int const &Bottom);
+		bool Materialized(unsigned int const &Row) const;
+		bool InFile(unsigned int const &Row) const; // Not read yet, whether or not it's oriented
+		void Orient(unsigned int const &Top, unsigned int const &Bottom); // Rows still in the file stay
+		bool Damaged(void) const; // Whether any rows read on demand were damaged, and left blank
+		// Copies a row that's been read the way it's stored, leaving it as it is, and returns how the copy still has
+		// to be turned.  OrientCopy turns it, and can be called on another thread.
+		uint32_t CopyRow(unsigned int const &Row, RunArray &Out) const;
+		static void OrientCopy(RunArray &Runs, uint32_t const &Remaining, unsigned int const &Width);
+
 		void FlipVertically(void);
 		void FlipHorizontally(void);
 		void ShiftHorizontally(int Columns);
@@ -69,22 +341,60 @@ struct RunData
 		void Remove(unsigned int const Left, unsigned int const Right, unsigned int const Up, unsigned int const Down);
 		void Enlarge(unsigned int const Factor);
 		void Shrink(unsigned int const Factor);
-	private:
+
 		static bool IsBlack(unsigned int const &Index);
-		void FlipSubsectionVertically(unsigned int const &Start, unsigned int const &End);
+	private:
+		void Read(unsigned int const &Top, unsigned int const &Bottom); // Rows still in the file
+		void SetOrientation(uint32_t const &Target);
+		void ResetOrientation(void); // Every row has to be oriented already.  Needed before the width changes.
+		void OrientRow(unsigned int const &Row);
+
+		DeferredRows *Deferred; // Null once every row has been read
+		bool FoundDamage;
+		// Rows with a tag (see RowStore) other than this still have to be mirrored or shifted to match it.  Tags and
+		// the orientation are how columns were moved since the rows were loaded (see image.cxx).  Flipping or shifting
+		// vertically just reverses or rotates the row store.
+		uint32_t Orientation;
+		unsigned int Unoriented; // Rows left to orient
+		std::map<uint32_t, unsigned int> Tagged; // How many rows have each tag, empty when none are left to orient
 };
 
+// Keeps only the rows a stroke touched, and after Finish only the runs in each row that the stroke changed
 class Mark : public Change
 {
 	public:
 		Mark(RunData &Base);
+		~Mark(void);
 		Change *Apply(bool &FlippedHorizontally, bool &FlippedVertically);
 		CombineResult Combine(Change *Other);
 		
-		void AddLine(unsigned int const &LineNumber);
+		void AddLine(unsigned int const &LineNumber); // Before the row is changed
+		void Finish(void); // After the stroke, drops the runs at either end of each row that are still the same
+		size_t Footprint(void) const;
+		void Freeze(UndoStore *Store); // Packs and compresses the rows, which are unpacked again when applied
+		void Prefetch(void);
+		bool ChangedRows(std::vector<unsigned int> &Rows) const;
 	private:
+		// The row is the first Start runs of the current row, then Runs, then the last Tail runs of the current row
+		struct Span
+		{
+			unsigned int Start, Tail;
+			RunData::RunArray Runs;
+		};
+
+		void Pack(void);
+		bool Thaw(void); // Returns false if the rows were lost or damaged
+		bool Fits(void); // Whether every row's kept ends are in the image, which they are unless the level was damaged
+
 		RunData &Base;
-		RunData::RowArray Rows;
+		std::map<unsigned int, Span> Rows;
+		std::vector<uint8_t> Frozen; // Rows compressed by Freeze, in which case Rows is empty
+		size_t FrozenSize; // Before compression
+		CompressionMethod FrozenMethod;
+		UndoStore *Store; // Where Frozen was spilled to, in which case Frozen is empty too
+		off_t SpillOffset;
+		size_t SpillSize;
+		bool Lost; // Couldn't be read back from Store, or was damaged
 };
 
 class HorizontalFlip : public Change
@@ -162,6 +472,120 @@ class Shrink : public Change
 		unsigned int Factor;
 };
 
+class RenderCache
+{
+	public:
+		// Tiles are square, measured in display pixels
+		static unsigned int const TileSize = 256;
+
+		RenderCache(void);
+		~RenderCache(void);
+
+		void SetLimit(size_t const &Bytes);
+		bool IsEnabled(void) const;
+		void SetColors(Color const &Foreground, Color const &Background); // Drops everything if the colors changed
+
+		// Returns nullptr if the tile isn't cached
+		cairo_surface_t *Find(unsigned int const &Scale, unsigned int const &Column, unsigned int const &Row);
+		// Takes ownership of Tile, evicting the least recently used tiles to stay under the limit
+		void Store(unsigned int const &Scale, unsigned int const &Column, unsigned int const &Row, cairo_surface_t *Tile);
+
+		// Drops tiles showing any of the image space area (right and bottom exclusive)
+		void Invalidate(unsigned int const &Left, unsigned int const &Right, unsigned int const &Top, unsigned int const &Bottom);
+		void Clear(void);
+	private:
+		struct Key
+		{
+			unsigned int Scale, Column, Row;
+			bool operator<(Key const &Other) const;
+		};
+		struct Entry
+		{
+			cairo_surface_t *Tile;
+			std::list<Key>::iterator Use;
+		};
+
+		void Drop(std::map<Key, Entry>::iterator const &Position);
+
+		std::map<Key, Entry> Tiles;
+		std::list<Key> Uses; // Most recently used first
+		size_t Limit, Used;
+		Color Foreground, Background;
+};
+
+// Rows changed since the last full save, appended to a journal file beside the image every so often, so a crash loses
+// little work.  Each record has the image size and the runs of the rows changed since the record before it, compressed.
+// Replaying the records over the last full save brings back the image.  Once the journal grows past the image file (or
+// twice its last compaction), it's compacted into one record holding every row that's been read.
+class ChangeJournal
+{
+	public:
+		ChangeJournal(void);
+		~ChangeJournal(void); // Waits for any append to finish and lets go of the file, but leaves it
+
+		// Where the journal for a saved image goes
+		static String Locate(String const &ImageFilename);
+		// Finds a journal left by a session that ended without closing the image and locks it, so no other session
+		// offers it and this one continues it.  Images that were never saved have a journal of their own in the
+		// configuration directory, so any of those left behind is taken.  Returns false if there isn't one.
+		bool Claim(String const &ImageFilename);
+		// Applies the records from the claimed journal to Data, replacing Data when the size changes.  Stops at the
+		// first damaged record, since the last one may have been cut off.  Returns false if nothing was applied.
+		bool Replay(RunData *&Data);
+
+		void Touch(unsigned int const &Row);
+		void TouchAll(void); // After changes to the size or every row
+
+		// Copies the touched rows and starts appending them to the journal on another thread, after the last append
+		// finishes.  The journal is created and locked first if this one doesn't have it yet.
+		void Flush(String const &ImageFilename, RunData const &Data, CompressionMethod const &Method);
+
+		// Rows touched from here on are also kept aside, in case a full save of the image as it is now succeeds
+		void StartSave(void);
+		// After a full save, the journal is deleted and only the rows touched since StartSave are left to append
+		void FinishSave(bool const &Succeeded);
+
+		// Deletes the journal this one holds, if any
+		void Discard(void);
+	private:
+		struct RowSet
+		{
+			RowSet(void);
+			void Add(unsigned int const &Row);
+			void AddAll(void);
+			void Clear(void);
+			bool Empty(void) const;
+			bool Contains(unsigned int const &Row) const;
+
+			std::vector<bool> Rows;
+			bool All, Any;
+		};
+
+		// A row as it's stored, to turn the way it's shown on the writer thread (see RunData::CopyRow)
+		struct RowCopy
+		{
+			unsigned int Row;
+			uint32_t Remaining;
+			RunData::RunArray Runs;
+		};
+
+		void Wait(void);
+		bool Open(String const &ImageFilename);
+		bool Hold(String const &Filename, int const &Flags);
+		// On the writer thread.  Replacing writes the journal next to Path first, then moves it over.
+		void Append(std::vector<RowCopy> Copies, uint32_t const Width, uint32_t const RowCount,
+			CompressionMethod const Method, bool const Replace);
+
+		RowSet Touched, SinceSave;
+		bool Saving;
+		String Path; // The journal this one holds, while Lock is set
+		int Lock; // A descriptor with an exclusive lock on Path, or -1.  Replacing the journal changes it on the writer.
+		uint64_t Length; // Of the journal as of the last append, set by the writer
+		uint64_t CompactLength; // Of the journal when it was last compacted, or 0, set by the writer
+		bool Refused; // The journal couldn't be opened or another session holds it, so none is kept until the next save
+		std::thread Writer;
+};
+
 class Image
 {
 	public:
@@ -169,7 +593,24 @@ class Image
 		Image(SettingsData &Settings, const String &Filename);
 		~Image(void);
 
-		bool Save(String const &Filename);
+		// False if the file couldn't be opened or read, leaving a blank image, or if rows it left in the file for later
+		// have turned out to be damaged since
+		bool Loaded(void);
+
+		bool Save(String const &Filename); // Returns once the file is written
+		// Copies the image and writes it on another thread, so drawing can go on.  Waits for any earlier save first.
+		void StartSave(String const &Filename);
+		bool SaveRunning(void);
+		// Waits for the background save if there is one.  Returns false if it failed, in which case the image counts as
+		// changed again.
+		bool FinishSave(void);
+
+		// Appends rows changed since the last call to the autosave journal, in the background (see ChangeJournal)
+		void FlushJournal(void);
+		bool CanRecover(void); // Claims a journal for this image left by a crash, if there is one
+		bool Recover(void); // Replays the journal over the image as loaded, before any other changes
+		void DiscardRecovery(void);
+
 		bool Export(String const &Filename);
 
 		Region Mark(CursorState const &Start, CursorState const &End, bool const &Black);
@@ -190,14 +631,22 @@ class Image
 		bool HasChanges(void);
 		void Undo(bool &FlippedHorizontally, bool &FlippedVertically);
 		void Redo(bool &FlippedHorizontally, bool &FlippedVertically);
+		size_t UndoFootprint(void) const; // Bytes used by the undo and redo history, for diagnostics
+		size_t RedoFootprint(void) const;
 
 	private:
 		SettingsData &Settings;
 
 		void Operate(std::function<void(void)> &&Operation);
+		bool LoadStream(FILE *Input, String const &Filename); // Reads the rest of a v02 file
+		bool LoadBlocks(FILE *Input, String const &Filename); // Reads the rest of a v03 file
 
 		bool RenderInternal(Region const &Invalid, cairo_t *Destination, int Scale,
-			Color const &Foreground, Color const &Background);
+			Color const &Foreground, Color const &Background, bool const &Exact);
+		void RenderPixels(unsigned char *Pixels, int const &Stride,
+			unsigned int const &X, unsigned int const &Y, unsigned int const &Width, unsigned int const &Height,
+			int Scale, Color const &Foreground, Color const &Background, bool const &Exact);
+		cairo_surface_t *RenderTile(unsigned int const &Column, unsigned int const &Row);
 
 		Region ImageSpace;
 		unsigned int PixelsBelow;
@@ -207,7 +656,24 @@ class Image
 		ChangeManager Changes;
 		Anchor< ::Mark> CurrentMarkUndo;
 
+		RenderCache Tiles;
+		WorkerPool Workers;
+
+		// Reused between renders
+		std::vector<uint32_t> Palette; // Shades between background and foreground colors
+		unsigned int PaletteScale;
+		Color PaletteForeground, PaletteBackground;
+		std::vector<std::vector<unsigned int> > BandShades; // A line of shades for each band
+		cairo_surface_t *ScratchSurface;
+
+		struct BackgroundSave;
+		BackgroundSave *Saving;
+
+		String Filename; // Where the image was loaded from or last saved, empty for new images
+		ChangeJournal Journal;
+
 		bool ModifiedSinceSave;
+		bool LoadSucceeded;
 };
 
 #endif
@@ -4,6 +4,7 @@
 #include <gdk/gdkkeysyms.h>
 #include <string>
 #include <iostream>
+#include <cstdio>
 #include <cassert>
 #include <cmath>
 #include <tuple>
@@ -15,6 +16,7 @@
 
 #include "info.h"
 #include "image.h"
+#include "batch.h"
 #include "settingsdialog.h"
 #include "expanddialog.h"
 
@@ -367,6 +369,7 @@ class MainWindow : public Window
 
 		gboolean ConfirmClose(void)
 		{
+			CollectSave();
 			return !Sketcher->HasChanges() || GTK::Confirm(*this, Local("Quit Inscribist"),
 				Local("Are you sure you wish to close Inscribist?  Any unsaved changes will be lost."));
 		}
@@ -390,6 +393,20 @@ class MainWindow : public Window
 		static bool IdlePanCallback(MainWindow *This)
 			{ return This->PanUpdate(); }
 
+		static gboolean SaveTimerCallback(MainWindow *This)
+		{
+			if (This->Sketcher->SaveRunning()) return TRUE;
+			This->SaveTimer = 0;
+			This->CollectSave();
+			return FALSE;
+		}
+
+		static gboolean AutosaveTimerCallback(MainWindow *This)
+		{
+			This->Sketcher->FlushJournal();
+			return TRUE;
+		}
+
 		// Constructor, the meat of our salad
 		MainWindow(SettingsData &Settings, const String &Filename) :
 			Window(Local("Inscribist"), 0),
@@ -408,6 +425,7 @@ class MainWindow : public Window
 			ToolbarIndicatorToolbar(gtk_toolbar_new()),
 			ToolbarColorIndicator(gtk_drawing_area_new()),
 			ToolbarSizeIndicator(""),
+			ToolbarSaveIndicator(""),
 
 			Scroller(gtk_scrolled_window_new(NULL, NULL)),
 			Canvas(gtk_drawing_area_new()),
@@ -416,6 +434,8 @@ class MainWindow : public Window
 			FirstDraw(true),
 			LookingAtSet(false),
 
+			SavePending(false), SaveTimer(0), AutosaveTimer(0),
+
 			PanOffsetSet(false), ViewportUpdateSignalHandler(0)
 		{
 			// Setup key callbacks
@@ -439,7 +459,7 @@ class MainWindow : public Window
 			KeyCallbacks[std::make_tuple(GDK_KEY_s, true)] = [this]() 
 			{ 
 				if (SaveFilename.empty()) SaveAs();
-				else Sketcher->Save(SaveFilename);
+				else SaveInBackground();
 			};
 			KeyCallbacks[std::make_tuple(GDK_KEY_S, true)] = [this]() { SaveAs(); };
 			for (auto const &Key : std::list<unsigned int>{GDK_KEY_v, GDK_KEY_KP_Divide})
@@ -500,6 +520,13 @@ class MainWindow : public Window
 
 			gtk_toolbar_set_show_arrow(GTK_TOOLBAR(ToolbarIndicatorToolbar), false);
 
+			GtkToolItem *ToolbarSaveIndicatorItem = gtk_tool_item_new();
+			gtk_container_set_border_width(GTK_CONTAINER(ToolbarSaveIndicatorItem), 4);
+			gtk_container_add(GTK_CONTAINER(ToolbarSaveIndicatorItem), ToolbarSaveIndicator);
+			gtk_widget_show(ToolbarSaveIndicator);
+			gtk_toolbar_insert(GTK_TOOLBAR(ToolbarIndicatorToolbar), ToolbarSaveIndicatorItem, -1);
+			gtk_widget_show(GTK_WIDGET(ToolbarSaveIndicatorItem));
+
 			GtkToolItem *ToolbarSizeIndicatorItem = gtk_tool_item_new();
 			gtk_container_set_border_width(GTK_CONTAINER(ToolbarSizeIndicatorItem), 4);
 			gtk_container_add(GTK_CONTAINER(ToolbarSizeIndicatorItem), ToolbarSizeIndicator);
@@ -556,6 +583,9 @@ class MainWindow : public Window
 
 			Show();
 
+			OfferRecovery();
+			RestartAutosave();
+
 			// Forcibly enable all devices.  Forcible because we don't ask the user.
 			GList *InputDevices = gdk_devices_list();
 			for (GList *DeviceIterator = InputDevices; DeviceIterator != NULL; DeviceIterator = DeviceIterator->next)
@@ -568,6 +598,8 @@ class MainWindow : public Window
 
 		~MainWindow(void)
 		{
+			if (SaveTimer != 0) g_source_remove(SaveTimer);
+			if (AutosaveTimer != 0) g_source_remove(AutosaveTimer);
 			delete Sketcher;
 		}
 
@@ -580,6 +612,7 @@ class MainWindow : public Window
 
 		void New(void)
 		{
+			CollectSave();
 			bool DecidedTo = !Sketcher->HasChanges() || GTK::Confirm(*this, Local("New Image"),
 				Local("Are you sure you wish to clear the image?  Any unsaved changes will be lost."));
 			if (DecidedTo)
@@ -594,6 +627,7 @@ class MainWindow : public Window
 
 				delete Sketcher;
 				Sketcher = new Image(Settings);
+				OfferRecovery();
 
 				// Resize + refresh the canvas for the new image
 				SizeCanvasAppropriately();
@@ -611,6 +645,8 @@ class MainWindow : public Window
 			String Out = OpenDialog.Run();
 			if (!Out.empty())
 			{
+				CollectSave();
+
 				/// Load the image
 				// Save the focus, even though it doesn't mean much
 				if (!LookingAtSet)
@@ -623,6 +659,7 @@ class MainWindow : public Window
 				// Load
 				delete Sketcher;
 				Sketcher = new Image(Settings, SaveFilename);
+				OfferRecovery();
 
 				// Resize + refresh the canvas for the new image
 				SetBackgroundColor(Canvas, Color(Settings.DisplayPaper * BackgroundColorScale,
@@ -675,7 +712,7 @@ class MainWindow : public Window
 						SaveFilename += Extension;
 
 					/// Save the image
-					Sketcher->Save(SaveFilename);
+					SaveInBackground();
 				}
 				else
 				{
@@ -694,6 +731,47 @@ class MainWindow : public Window
 			gtk_widget_destroy(Dialog);
 		}
 
+		// Saves to SaveFilename while drawing continues, showing progress in the toolbar
+		void SaveInBackground(void)
+		{
+			CollectSave();
+			Sketcher->StartSave(SaveFilename);
+			SavePending = true;
+			ToolbarSaveIndicator.SetText(Local("Saving..."));
+			if (SaveTimer == 0) SaveTimer = g_timeout_add(100, (GSourceFunc)&SaveTimerCallback, this);
+		}
+
+		// Waits for a background save to finish, if there is one, and shows how it went
+		void CollectSave(void)
+		{
+			if (!SavePending) return;
+			SavePending = false;
+			ToolbarSaveIndicator.SetText(Sketcher->FinishSave() ? Local("Saved") : Local("Save failed"));
+		}
+
+		// If the last session with this image ended without closing it, offers to replay its autosave journal
+		void OfferRecovery(void)
+		{
+			if (!Sketcher->CanRecover()) return;
+			if (GTK::Confirm(*this, Local("Recover Changes"),
+				Local("Inscribist didn't close properly the last time this image was open.  Do you want to recover the changes that weren't saved?")) &&
+				Sketcher->Recover())
+			{
+				SizeCanvasAppropriately();
+				return;
+			}
+			Sketcher->DiscardRecovery();
+		}
+
+		// Starts writing changed rows to the autosave journal every AutosaveInterval seconds
+		void RestartAutosave(void)
+		{
+			if (AutosaveTimer != 0) g_source_remove(AutosaveTimer);
+			AutosaveTimer = 0;
+			if (Settings.AutosaveInterval > 0)
+				AutosaveTimer = g_timeout_add_seconds(Settings.AutosaveInterval, (GSourceFunc)&AutosaveTimerCallback, this);
+		}
+
 		void Expand(void)
 		{
 			OpenExpandDialog(*this, *Sketcher);
@@ -705,6 +783,7 @@ class MainWindow : public Window
 		void Configure(void)
 		{
 			OpenSettings(*this, Settings, Sketcher->GetSize());
+			RestartAutosave();
 
 			SetBackgroundColor(Canvas, Color(Settings.DisplayPaper * BackgroundColorScale,
 				Settings.DisplayPaper.Alpha * BackgroundColorScale + (1.0f - BackgroundColorScale)));
@@ -737,6 +816,7 @@ class MainWindow : public Window
 		ToolButton NewButton, OpenButton, SaveButton, ExpandButton, ConfigureButton;
 		GtkWidget *ToolbarIndicatorToolbar, *ToolbarColorIndicator;
 		Label ToolbarSizeIndicator;
+		Label ToolbarSaveIndicator;
 
 		GtkWidget *Scroller, *Canvas;
 
@@ -755,6 +835,11 @@ class MainWindow : public Window
 		FlatVector LookingAt;
 		bool LookingAtSet;
 
+		// Background saving, checked on a timer until it finishes
+		bool SavePending;
+		guint SaveTimer;
+		guint AutosaveTimer;
+
 		// For panning updates when the app's idle
 		FlatVector PanOffset;
 		bool PanOffsetSet;
@@ -765,6 +850,38 @@ class MainWindow : public Window
 int main(int ArgumentCount, char **Arguments)
 {
 	InitializeTranslation("inscribist");
+
+	/// Process many files without opening a window
+	if ((ArgumentCount >= 2) && (String(Arguments[1]) == "--batch"))
+		return RunBatch(ArgumentCount - 2, Arguments + 2);
+
+	/// Export without opening a window, for batch jobs
+	if ((ArgumentCount >= 2) && (String(Arguments[1]) == "--export"))
+	{
+		if (ArgumentCount != 4)
+		{
+			std::cerr << Local("Usage: inscribist --export INPUT OUTPUT.png") << std::endl;
+			return 1;
+		}
+
+		FILE *Input = fopen(Arguments[2], "rb");
+		if (Input == nullptr)
+		{
+			std::cerr << Local("Could not open for reading: ") << Arguments[2] << std::endl;
+			return 1;
+		}
+		fclose(Input);
+
+		SettingsData Settings;
+		Image Sketch(Settings, Arguments[2]);
+		// Large images are only read as they're exported, so damage can also turn up during the export
+		bool const Exported = Sketch.Loaded() && Sketch.Export(Arguments[3]);
+		if (Sketch.Loaded()) return Exported ? 0 : 1;
+		std::cerr << Local("The image couldn't be loaded, so it wasn't exported: ") << Arguments[2] << std::endl;
+		if (Exported) remove(Arguments[3]);
+		return 1;
+	}
+
 	gtk_init(&ArgumentCount, &Arguments);
 
 	/// Load the settings
@@ -80,6 +80,13 @@ SettingsData::SettingsData(void) :
 	ExportPaper.Alpha = Get("ExportPaperAlpha", 0.0f);
 
 	DisplayScale = ScaleRange.Constrain(Get("DisplayScale", DisplayScaleDefault));
+	RenderCacheSize = RenderCacheSizeRange.Constrain(Get("RenderCacheSize", RenderCacheSizeDefault));
+	RenderThreads = RenderThreadsRange.Constrain(Get("RenderThreads", RenderThreadsDefault));
+	UndoMemory = UndoMemoryRange.Constrain(Get("UndoMemory", UndoMemoryDefault));
+	ExportGrayscale = Get("ExportGrayscale", true);
+	SaveCompression = (CompressionMethod)Get("SaveCompression", (unsigned int)DefaultCompression());
+	if (!CompressionAvailable(SaveCompression)) SaveCompression = DefaultCompression();
+	AutosaveInterval = AutosaveIntervalRange.Constrain(Get("AutosaveInterval", AutosaveIntervalDefault));
 
 	ExportInk.Red = Get("ExportInkRed", 0.0f);
 	ExportInk.Green = Get("ExportInkGreen", 0.0f);
@@ -127,6 +134,12 @@ void SettingsData::Save(void)
 	Set("DisplayInkAlpha", DisplayInk.Alpha);
 
 	Set("DisplayScale", DisplayScale);
+	Set("RenderCacheSize", RenderCacheSize);
+	Set("RenderThreads", RenderThreads);
+	Set("UndoMemory", UndoMemory);
+	Set("ExportGrayscale", ExportGrayscale);
+	Set("SaveCompression", (unsigned int)SaveCompression);
+	Set("AutosaveInterval", AutosaveInterval);
 
 	Set("ExportPaperRed", ExportPaper.Red);
 	Set("ExportPaperGreen", ExportPaper.Green);
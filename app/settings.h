@@ -13,6 +13,8 @@
 
 #include "ren-gtk/gtkwrapper.h"
 
+#include "compression.h"
+
 class LightSettings
 {
 	public:
@@ -51,6 +53,14 @@ float const LightDiameterDefault(0.1);
 RangeD const ScaleRange(1, SizeRange.Max / 500); // Allow users to zoom out to around 500x500 px
 unsigned int const DisplayScaleDefault = std::max(1u, (SizeDefault / 2000));
 unsigned int const ExportScaleDefault = std::max(1u, (SizeDefault / 2000));
+RangeD const RenderCacheSizeRange(0, 4096); // Megabytes
+unsigned int const RenderCacheSizeDefault = 128;
+RangeD const RenderThreadsRange(0, 64); // 0 uses every processor
+unsigned int const RenderThreadsDefault = 0;
+RangeD const UndoMemoryRange(0, 65536); // Megabytes, the newest undo level is kept even if it's larger
+unsigned int const UndoMemoryDefault = 512;
+RangeD const AutosaveIntervalRange(0, 3600); // Seconds, 0 never writes the journal
+unsigned int const AutosaveIntervalDefault = 60;
 
 String const Extension(".inscribble");
 
@@ -88,6 +98,12 @@ struct SettingsData : private LightSettings
 		Color DisplayPaper, DisplayInk;
 		Color ExportPaper, ExportInk;
 		int DisplayScale, ExportScale;
+		int RenderCacheSize;
+		int RenderThreads;
+		int UndoMemory;
+		bool ExportGrayscale;
+		CompressionMethod SaveCompression; // Falls back to the default if not built in
+		int AutosaveInterval;
 
 		DeviceSettings &GetDeviceSettings(String const &Name);
 
@@ -2,6 +2,8 @@
 
 #include "settingsdialog.h"
 
+#include <algorithm>
+
 #include "ren-translation/translation.h"
 
 SettingsDialog::BrushSection::BrushSection(unsigned int Index, BrushSettings &Settings, const Color &InkColor, const Color &PaperColor) :
@@ -54,6 +56,9 @@ SettingsDialog::SettingsDialog(GtkWidget *Window, SettingsData &Settings, FlatVe
 	DisplayPaperColor(Local("Paper color: "), Settings.DisplayPaper, false),
 	DisplayInkColor(Local("Ink color: "), Settings.DisplayInk, false),
 	DisplayScale(Local("Downscale: "), ScaleRange, ScaleRange.Constrain(Settings.DisplayScale)),
+	RenderCacheSize(Local("Cache (MB): "), RenderCacheSizeRange, RenderCacheSizeRange.Constrain(Settings.RenderCacheSize)),
+	RenderThreads(Local("Threads (0 for all): "), RenderThreadsRange, RenderThreadsRange.Constrain(Settings.RenderThreads)),
+	UndoMemory(Local("Undo memory (MB): "), UndoMemoryRange, UndoMemoryRange.Constrain(Settings.UndoMemory)),
 
 	ExportFrame(Local("Export settings")),
 	ExportBox(true, 3, 16),
@@ -63,6 +68,13 @@ SettingsDialog::SettingsDialog(GtkWidget *Window, SettingsData &Settings, FlatVe
 	ExportScaleBox(false),
 	ExportScale(Local("Downscale: "), ScaleRange, ScaleRange.Constrain(Settings.ExportScale)),
 	ExportSizePreview(""),
+	ExportGrayscale(Local("Export grayscale when colors allow"), Settings.ExportGrayscale),
+
+	SaveFrame(Local("Save settings")),
+	SaveBox(true, 3, 16),
+	SaveCompression(Local("Compression: ")),
+	AutosaveInterval(Local("Autosave every (seconds, 0 for never): "), AutosaveIntervalRange,
+		AutosaveIntervalRange.Constrain(Settings.AutosaveInterval)),
 
 	Okay(Local("Okay"), diSave),
 	Cancel(Local("Cancel"), diClose)
@@ -104,6 +116,12 @@ SettingsDialog::SettingsDialog(GtkWidget *Window, SettingsData &Settings, FlatVe
 	DisplayBox.AddFill(DisplayInkColor);
 	DisplayBox.AddSpace(); DisplayBox.AddSpacer(); DisplayBox.AddSpace();
 	DisplayBox.AddFill(DisplayScale);
+	DisplayBox.AddSpace(); DisplayBox.AddSpacer(); DisplayBox.AddSpace();
+	DisplayBox.AddFill(RenderCacheSize);
+	DisplayBox.AddSpace(); DisplayBox.AddSpacer(); DisplayBox.AddSpace();
+	DisplayBox.AddFill(RenderThreads);
+	DisplayBox.AddSpace(); DisplayBox.AddSpacer(); DisplayBox.AddSpace();
+	DisplayBox.AddFill(UndoMemory);
 	DisplayFrame.Set(DisplayBox);
 	SettingsBox.Add(DisplayFrame);
 
@@ -127,9 +145,25 @@ SettingsDialog::SettingsDialog(GtkWidget *Window, SettingsData &Settings, FlatVe
 	ExportScaleBox.Add(ExportScale);
 	ExportScaleBox.Add(ExportSizePreview);
 	ExportBox.AddFill(ExportScaleBox);
+	ExportBox.AddSpace(); ExportBox.AddSpacer(); ExportBox.AddSpace();
+	ExportBox.Add(ExportGrayscale);
 	ExportFrame.Set(ExportBox);
 	SettingsBox.Add(ExportFrame);
 
+	/// Save settings
+	for (unsigned int Method = 0; Method < (unsigned int)CompressionMethod::Count; ++Method)
+	{
+		if (!CompressionAvailable((CompressionMethod)Method)) continue;
+		SaveCompressionChoices.push_back((CompressionMethod)Method);
+		SaveCompression.Add(CompressionName((CompressionMethod)Method));
+	}
+	SaveCompression.Select(std::find(SaveCompressionChoices.begin(), SaveCompressionChoices.end(), Settings.SaveCompression) -
+		SaveCompressionChoices.begin());
+	SaveBox.Add(SaveCompression);
+	SaveBox.Add(AutosaveInterval);
+	SaveFrame.Set(SaveBox);
+	SettingsBox.Add(SaveFrame);
+
 	/// Brush settings
 	for (unsigned int CurrentBrush = 0; CurrentBrush < Settings.GetBrushCount(); CurrentBrush++)
 	{
@@ -163,9 +197,15 @@ SettingsDialog::SettingsDialog(GtkWidget *Window, SettingsData &Settings, FlatVe
 		Settings.DisplayPaper = DisplayPaperColor.GetColor();
 		Settings.DisplayInk = DisplayInkColor.GetColor();
 		Settings.DisplayScale = DisplayScale.GetValue();
+		Settings.RenderCacheSize = RenderCacheSize.GetValue();
+		Settings.RenderThreads = RenderThreads.GetValue();
+		Settings.UndoMemory = UndoMemory.GetValue();
 		Settings.ExportPaper = ExportPaperColor.GetColor();
 		Settings.ExportInk = ExportInkColor.GetColor();
 		Settings.ExportScale = ExportScale.GetValue();
+		Settings.ExportGrayscale = ExportGrayscale.GetValue();
+		Settings.SaveCompression = SaveCompressionChoices[SaveCompression.GetSelection()];
+		Settings.AutosaveInterval = AutosaveInterval.GetValue();
 
 		for (unsigned int CurrentBrush = 0; CurrentBrush < BrushSections.size(); CurrentBrush++)
 		{
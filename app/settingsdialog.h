@@ -31,6 +31,9 @@ class SettingsDialog : public Dialog
 		Layout DisplayBox;
 		ColorButton DisplayPaperColor, DisplayInkColor;
 		Wheel DisplayScale;
+		Wheel RenderCacheSize;
+		Wheel RenderThreads;
+		Wheel UndoMemory;
 
 		LayoutBorder ExportFrame;
 		Layout ExportBox;
@@ -39,6 +42,13 @@ class SettingsDialog : public Dialog
 		Layout ExportScaleBox;
 		Wheel ExportScale;
 		Label ExportSizePreview;
+		CheckButton ExportGrayscale;
+
+		LayoutBorder SaveFrame;
+		Layout SaveBox;
+		List SaveCompression;
+		std::vector<CompressionMethod> SaveCompressionChoices; // The list's entries, only those built in
+		Wheel AutosaveInterval;
 
 		struct BrushSection
 		{
@@ -0,0 +1,151 @@
+// Copyright 2013 Rendaw, under the FreeBSD license (See included license.txt)
+
+#include "simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86SIMD
+#include <immintrin.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Scalar
+static void ShadePixelsScalar(uint32_t *Pixels, unsigned int const *Shades, uint32_t const *Colors, unsigned int const &Count)
+{
+	for (unsigned int Index = 0; Index < Count; ++Index)
+		Pixels[Index] = Colors[Shades[Index]];
+}
+
+static void AddCoverageScalar(unsigned int *Buffer, unsigned int const &Count, unsigned int const &Amount)
+{
+	for (unsigned int Index = 0; Index < Count; ++Index)
+		Buffer[Index] += Amount;
+}
+
+#ifdef X86SIMD
+//////////////////////////////////////////////////////////////////////////////////////////
+// SSE2
+// There's no gather, but most of a drawing is blank paper so groups of empty shades get stored in one go
+__attribute__((target("sse2")))
+static void ShadePixelsSSE2(uint32_t *Pixels, unsigned int const *Shades, uint32_t const *Colors, unsigned int const &Count)
+{
+	__m128i const Zero = _mm_setzero_si128();
+	__m128i const Paper = _mm_set1_epi32(Colors[0]);
+	unsigned int Index = 0;
+	for (; Index + 4 <= Count; Index += 4)
+	{
+		__m128i const Group = _mm_loadu_si128((__m128i const *)(Shades + Index));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(Group, Zero)) == 0xFFFF)
+			_mm_storeu_si128((__m128i *)(Pixels + Index), Paper);
+		else
+		{
+			Pixels[Index] = Colors[Shades[Index]];
+			Pixels[Index + 1] = Colors[Shades[Index + 1]];
+			Pixels[Index + 2] = Colors[Shades[Index + 2]];
+			Pixels[Index + 3] = Colors[Shades[Index + 3]];
+		}
+	}
+	ShadePixelsScalar(Pixels + Index, Shades + Index, Colors, Count - Index);
+}
+
+__attribute__((target("sse2")))
+static void AddCoverageSSE2(unsigned int *Buffer, unsigned int const &Count, unsigned int const &Amount)
+{
+	__m128i const Add = _mm_set1_epi32(Amount);
+	unsigned int Index = 0;
+	for (; Index + 4 <= Count; Index += 4)
+	{
+		__m128i *Group = (__m128i *)(Buffer + Index);
+		_mm_storeu_si128(Group, _mm_add_epi32(_mm_loadu_si128(Group), Add));
+	}
+	AddCoverageScalar(Buffer + Index, Count - Index, Amount);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// AVX2
+__attribute__((target("avx2")))
+static void ShadePixelsAVX2(uint32_t *Pixels, unsigned int const *Shades, uint32_t const *Colors, unsigned int const &Count)
+{
+	__m256i const Paper = _mm256_set1_epi32(Colors[0]);
+	unsigned int Index = 0;
+	for (; Index + 8 <= Count; Index += 8)
+	{
+		__m256i const Group = _mm256_loadu_si256((__m256i const *)(Shades + Index));
+		if (_mm256_testz_si256(Group, Group))
+			_mm256_storeu_si256((__m256i *)(Pixels + Index), Paper);
+		else _mm256_storeu_si256((__m256i *)(Pixels + Index), _mm256_i32gather_epi32((int const *)Colors, Group, 4));
+	}
+	ShadePixelsScalar(Pixels + Index, Shades + Index, Colors, Count - Index);
+}
+
+__attribute__((target("avx2")))
+static void AddCoverageAVX2(unsigned int *Buffer, unsigned int const &Count, unsigned int const &Amount)
+{
+	__m256i const Add = _mm256_set1_epi32(Amount);
+	unsigned int Index = 0;
+	for (; Index + 8 <= Count; Index += 8)
+	{
+		__m256i *Group = (__m256i *)(Buffer + Index);
+		_mm256_storeu_si256(Group, _mm256_add_epi32(_mm256_loadu_si256(Group), Add));
+	}
+	AddCoverageScalar(Buffer + Index, Count - Index, Amount);
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Dispatch
+static void (*ShadePixelsPath)(uint32_t *, unsigned int const *, uint32_t const *, unsigned int const &) = ShadePixelsScalar;
+static void (*AddCoveragePath)(unsigned int *, unsigned int const &, unsigned int const &) = AddCoverageScalar;
+static SIMDLevel CurrentLevel = SIMDLevel::Scalar;
+
+static struct SIMDStartup { SIMDStartup(void) { SetSIMD(DetectSIMD()); } } Startup;
+
+SIMDLevel DetectSIMD(void)
+{
+#ifdef X86SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return SIMDLevel::AVX2;
+	if (__builtin_cpu_supports("sse2")) return SIMDLevel::SSE2;
+#endif
+	return SIMDLevel::Scalar;
+}
+
+SIMDLevel GetSIMD(void) { return CurrentLevel; }
+
+void SetSIMD(SIMDLevel Level)
+{
+	if ((int)Level > (int)DetectSIMD()) Level = DetectSIMD();
+	CurrentLevel = Level;
+	switch (Level)
+	{
+#ifdef X86SIMD
+		case SIMDLevel::AVX2:
+			ShadePixelsPath = ShadePixelsAVX2;
+			AddCoveragePath = AddCoverageAVX2;
+			break;
+		case SIMDLevel::SSE2:
+			ShadePixelsPath = ShadePixelsSSE2;
+			AddCoveragePath = AddCoverageSSE2;
+			break;
+#endif
+		default:
+			ShadePixelsPath = ShadePixelsScalar;
+			AddCoveragePath = AddCoverageScalar;
+			break;
+	}
+}
+
+char const *SIMDName(SIMDLevel const &Level)
+{
+	switch (Level)
+	{
+		case SIMDLevel::AVX2: return "AVX2";
+		case SIMDLevel::SSE2: return "SSE2";
+		default: return "scalar";
+	}
+}
+
+void ShadePixels(uint32_t *Pixels, unsigned int const *Shades, uint32_t const *Colors, unsigned int const &Count)
+	{ ShadePixelsPath(Pixels, Shades, Colors, Count); }
+
+void AddCoverage(unsigned int *Buffer, unsigned int const &Count, unsigned int const &Amount)
+	{ AddCoveragePath(Buffer, Count, Amount); }
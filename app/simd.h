@@ -0,0 +1,27 @@
+// Copyright 2013 Rendaw, under the FreeBSD license (See included license.txt)
+
+#ifndef simd_h
+#define simd_h
+
+#include <stdint.h>
+
+// Inner loops of rendering, with vectorized versions picked at startup for whatever the processor supports
+enum class SIMDLevel
+{
+	Scalar,
+	SSE2,
+	AVX2
+};
+
+SIMDLevel DetectSIMD(void); // Best level the processor supports
+SIMDLevel GetSIMD(void);
+void SetSIMD(SIMDLevel Level); // Limited to what's detected
+char const *SIMDName(SIMDLevel const &Level);
+
+// Pixels[i] = Colors[Shades[i]]
+void ShadePixels(uint32_t *Pixels, unsigned int const *Shades, uint32_t const *Colors, unsigned int const &Count);
+
+// Buffer[i] += Amount
+void AddCoverage(unsigned int *Buffer, unsigned int const &Count, unsigned int const &Amount);
+
+#endif
@@ -1,11 +1,12 @@
 // Copyright 2013 Rendaw, under the FreeBSD license (See included license.txt)
 
 #include "image.h"
+#include "simd.h"
 
 void CompareInternal(int Line, RunData const &GotData, RunData const &ExpectedData)
 {
-	RunData::RowArray const &Got = GotData.Rows;
-	RunData::RowArray const &Expected = ExpectedData.Rows;
+	RowStore const &Got = GotData.Rows;
+	RowStore const &Expected = ExpectedData.Rows;
 	bool FailedRunCount = false;
 	bool FailedRuns = false;
 
@@ -239,6 +240,20 @@ int main(int, char **)
 		Compare(Test, Expected);
 	}
 	
+	{
+		RunData Test { RunData::RowArray { {{ 10, 10, 10, 10, 10, 10 }} }};
+		RunData const Expected { RunData::RowArray { {{ 10, 35, 5, 10 }} }};
+		Test.Line(15, 45, 0, true);
+		Compare(Test, Expected);
+	}
+	
+	{
+		RunData Test { RunData::RowArray { {{ 10, 10, 10, 10, 10, 10 }} }};
+		RunData const Expected { RunData::RowArray { {{ 10, 10, 5, 1, 4, 10, 10, 10 }} }};
+		Test.Line(25, 26, 0, true);
+		Compare(Test, Expected);
+	}
+	
 	// Test rendering lines of rundata
 	{
 		RunData Test { RunData::RowArray { {{4}}, {{4}} }};
@@ -303,7 +318,94 @@ int main(int, char **)
 		std::vector<unsigned int> const Expected = {0};
 		Compare(Buffer, Expected);
 	}
-	
+
+	{
+		RunData Test { RunData::RowArray { {{0, 1, 1, 1, 1}} }};
+		std::vector<unsigned int> Buffer = {0};
+		Test.Combine(&Buffer[0], 1, 0, 0, 4);
+		std::vector<unsigned int> const Expected = {2};
+		Compare(Buffer, Expected);
+	}
+
+	// Test long rows, found through the skip index
+	{
+		RunData Test { RunData::RowArray { RunData::RunArray(256, 2) } };
+		std::vector<unsigned int> Buffer(12, 0);
+		Test.Combine(&Buffer[0], 12, 500, 0, 1);
+		std::vector<unsigned int> const Expected = {0, 0, 1, 1, 0, 0, 1, 1, 0, 0, 1, 1};
+		Compare(Buffer, Expected);
+	}
+
+	{
+		RunData Test { RunData::RowArray { RunData::RunArray(256, 2) } };
+		RunData::RunArray ExpectedRow(49, 2);
+		ExpectedRow.push_back(2);
+		ExpectedRow.push_back(302);
+		ExpectedRow.insert(ExpectedRow.end(), 55, 2);
+		RunData const Expected { RunData::RowArray { ExpectedRow } };
+		Test.Line(100, 400, 0, false);
+		Compare(Test, Expected);
+
+		std::vector<unsigned int> Buffer(4, 0);
+		Test.Combine(&Buffer[0], 4, 98, 0, 1);
+		Compare(Buffer, std::vector<unsigned int>{1, 1, 0, 0});
+		Test.Line(401, 402, 0, true);
+		ExpectedRow[50] = 301;
+		ExpectedRow[51] = 3;
+		Compare(Test, RunData { RunData::RowArray { ExpectedRow } });
+	}
+
+	// Test the vectorized kernels against the scalar ones
+	for (SIMDLevel Level = SIMDLevel::Scalar; (int)Level <= (int)DetectSIMD(); Level = (SIMDLevel)((int)Level + 1))
+	{
+		std::vector<unsigned int> Shades(37, 0), Colors = {10, 11, 12, 13, 14};
+		for (unsigned int Index = 20; Index < Shades.size(); ++Index) Shades[Index] = Index % 5;
+		std::vector<unsigned int> Expected, Buffer(Shades.size(), 7);
+		for (auto const &Shade : Shades) Expected.push_back(Colors[Shade]);
+		SetSIMD(Level);
+		ShadePixels(&Buffer[0], &Shades[0], &Colors[0], Shades.size());
+		Compare(Buffer, Expected);
+
+		AddCoverage(&Buffer[1], Buffer.size() - 2, 3);
+		for (unsigned int Index = 1; Index + 1 < Expected.size(); ++Index) Expected[Index] += 3;
+		Compare(Buffer, Expected);
+
+		RunData Test { RunData::RowArray { {{3, 50, 7}} }};
+		Buffer.assign(15, 0);
+		Test.Combine(&Buffer[0], 15, 0, 0, 4);
+		Compare(Buffer, std::vector<unsigned int>{1, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 1, 0});
+	}
+	SetSIMD(DetectSIMD());
+
+	// Test rendering from the coverage pyramid
+	{
+		RunData Test { RunData::RowArray(32, RunData::RunArray{{8, 24}}) };
+		std::vector<unsigned int> Buffer = {0, 0};
+		Test.CombineCoarse(&Buffer[0], 2, 0, 0, 16);
+		std::vector<unsigned int> const Expected = {128, 256};
+		Compare(Buffer, Expected);
+	}
+
+	{
+		RunData Test { RunData::RowArray(32, RunData::RunArray{{32}}) };
+		std::vector<unsigned int> Buffer = {0, 0};
+		Test.CombineCoarse(&Buffer[0], 2, 0, 1, 16);
+		Test.Line(4, 20, 17, true);
+		Test.Line(0, 32, 30, true);
+		Buffer = {0, 0};
+		Test.CombineCoarse(&Buffer[0], 2, 0, 1, 16);
+		std::vector<unsigned int> const Expected = {28, 20};
+		Compare(Buffer, Expected);
+	}
+
+	{
+		RunData Test { RunData::RowArray(64, RunData::RunArray{{0, 64}}) };
+		std::vector<unsigned int> Buffer = {0, 0};
+		Test.CombineCoarse(&Buffer[0], 2, 0, 0, 32);
+		std::vector<unsigned int> const Expected = {1024, 1024};
+		Compare(Buffer, Expected);
+	}
+
 	// Test flipping rundata
 	{
 		RunData Test { RunData::RowArray { {{1}}, {{0, 1}} } };
@@ -323,9 +425,21 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{2}}, {{1, 1}}, {{0, 1, 1}}, {{0, 2}} } };
 		RunData Expected { RunData::RowArray { {{2}}, {{0, 1, 1}}, {{1, 1}}, {{0, 2}} } };
 		Test.FlipHorizontally();
+		assert(!Test.Materialized(1)); // Rows are only mirrored once they're used
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 
+	{
+		RunData Test { RunData::RowArray { {{4}}, {{1, 1, 2}} } };
+		Test.FlipHorizontally();
+		Test.FlipVertically();
+		Test.Line(0, 1, 1, true);
+		Test.FlipHorizontally(); // The first row was never mirrored
+		Test.Materialize(0, Test.Rows.size());
+		Compare(Test, RunData { RunData::RowArray { {{1, 1, 2}}, {{3, 1}} } });
+	}
+
 	// Test shifting rundata
 	{
 		RunData Test { RunData::RowArray { {{1}}, {{0, 1}} } };
@@ -366,6 +480,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{10}} } };
 		RunData Expected { RunData::RowArray { {{10}} } };
 		Test.ShiftHorizontally(5);
+		Test.Materialize(0, Test.Rows.size()); // Rows are only shifted once they're used
 		Compare(Test, Expected);
 	}
 	
@@ -373,6 +488,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{10}} } };
 		RunData Expected { RunData::RowArray { {{10}} } };
 		Test.ShiftHorizontally(10);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 	
@@ -380,6 +496,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{0, 10}} } };
 		RunData Expected { RunData::RowArray { {{0, 10}} } };
 		Test.ShiftHorizontally(5);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 	
@@ -387,6 +504,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{0, 10}} } };
 		RunData Expected { RunData::RowArray { {{0, 10}} } };
 		Test.ShiftHorizontally(10);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 	
@@ -394,6 +512,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{10, 10}} } };
 		RunData Expected { RunData::RowArray { {{0, 10, 10}} } };
 		Test.ShiftHorizontally(10);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 	
@@ -401,6 +520,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{10, 10}} } };
 		RunData Expected { RunData::RowArray { {{0, 10, 10}} } };
 		Test.ShiftHorizontally(-10);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 	
@@ -408,6 +528,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{10, 10}} } };
 		RunData Expected { RunData::RowArray { {{5, 10, 5}} } };
 		Test.ShiftHorizontally(-5);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 	
@@ -415,6 +536,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{10, 10}} } };
 		RunData Expected { RunData::RowArray { {{0, 5, 10, 5}} } };
 		Test.ShiftHorizontally(5);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 
@@ -422,6 +544,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{10, 10, 10}} } };
 		RunData Expected { RunData::RowArray { {{20, 10}} } };
 		Test.ShiftHorizontally(10);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 
@@ -429,6 +552,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{10, 10, 10}} } };
 		RunData Expected { RunData::RowArray { {{0, 10, 20}} } };
 		Test.ShiftHorizontally(20);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 
@@ -436,6 +560,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{0, 10, 20}} } };
 		RunData Expected { RunData::RowArray { {{10, 10, 10}} } };
 		Test.ShiftHorizontally(10);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 
@@ -443,6 +568,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{20, 10}} } };
 		RunData Expected { RunData::RowArray { {{10, 10, 10}} } };
 		Test.ShiftHorizontally(20);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 
@@ -450,6 +576,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{0, 5, 10, 5}} } };
 		RunData Expected { RunData::RowArray { {{0, 10, 10}} } };
 		Test.ShiftHorizontally(5);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 	
@@ -457,6 +584,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{0, 10, 10}} } };
 		RunData Expected { RunData::RowArray { {{0, 5, 10, 5}} } };
 		Test.ShiftHorizontally(15);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 
@@ -464,6 +592,7 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{0, 5, 10, 5}} } };
 		RunData Expected { RunData::RowArray { {{10, 10}} } };
 		Test.ShiftHorizontally(15);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 	
@@ -471,9 +600,28 @@ int main(int, char **)
 		RunData Test { RunData::RowArray { {{10, 10}} } };
 		RunData Expected { RunData::RowArray { {{0, 5, 10, 5}} } };
 		Test.ShiftHorizontally(5);
+		Test.Materialize(0, Test.Rows.size());
 		Compare(Test, Expected);
 	}
 
+	{
+		RunData Test { RunData::RowArray { {{2, 1, 1}}, {{0, 1, 3}} } };
+		bool FlippedHorizontally, FlippedVertically;
+		Change *Undo = Shift(Test, 1, 1).Apply(FlippedHorizontally, FlippedVertically);
+		Test.Materialize(0, 1);
+		assert(!Test.Materialized(1));
+		Change *Redo = Undo->Apply(FlippedHorizontally, FlippedVertically);
+		assert(Test.Materialized(0)); // This row was never shifted, so it is already in place
+		assert(!Test.Materialized(1));
+		Test.Materialize(0, Test.Rows.size());
+		Compare(Test, RunData { RunData::RowArray { {{2, 1, 1}}, {{0, 1, 3}} } });
+		delete Redo->Apply(FlippedHorizontally, FlippedVertically);
+		Test.Materialize(0, Test.Rows.size());
+		Compare(Test, RunData { RunData::RowArray { {{1, 1, 2}}, {{3, 1}} } });
+		delete Undo;
+		delete Redo;
+	}
+
 	// Add
 	{
 		RunData Test { RunData::RowArray { {{100}} } };
@@ -632,5 +780,331 @@ int main(int, char **)
 		Compare(Test, Expected);
 	}
 
+	{
+		RunData Test { RunData::RowArray { {{4}}, {{4}}, {{0, 4}}, {{0, 4}}, {{2, 2}}, {{2, 2}} } };
+		RunData Expected { RunData::RowArray { {{2}}, {{0, 2}}, {{1, 1}} } };
+		Test.Shrink(2);
+		Compare(Test, Expected);
+	}
+
+	// Storage
+	{
+		RunData Source { RunData::RowArray { {{0, 3, 7}}, {{10}}, {{2, 2, 2, 2, 2}} } };
+		std::vector<uint8_t> Buffer;
+		Source.WriteRows(1, 3, RunData::RowFormat::Words, Buffer);
+		RunData Test { RunData::RowArray { {{10}}, {{0, 10}}, {{0, 10}} } };
+		RunData Expected { RunData::RowArray { {{10}}, {{10}}, {{2, 2, 2, 2, 2}} } };
+		bool const Read = Test.ReadRows(1, 3, RunData::RowFormat::Words, &Buffer[0], Buffer.size());
+		assert(Read);
+		Compare(Test, Expected);
+	}
+
+	{
+		RunData Source { RunData::RowArray { {{0, 3, 7}}, {{10}} } };
+		std::vector<uint8_t> Buffer;
+		Source.WriteRows(0, 2, RunData::RowFormat::Words, Buffer);
+		RunData Test(FlatVector(10, 0));
+		Test.Rows.AddUnset(2);
+		bool const Read = Test.ReadRows(0, 2, RunData::RowFormat::Words, &Buffer[0], Buffer.size());
+		assert(Read);
+		Compare(Test, Source);
+	}
+
+	{
+		RunData Source { RunData::RowArray { {{0, 3, 7}}, {{2, 8}} } };
+		std::vector<uint8_t> Buffer;
+		Source.WriteRows(0, 2, RunData::RowFormat::Words, Buffer);
+		Buffer[Buffer.size() - 4] = 9; // Makes the second row too wide
+		RunData Test { RunData::RowArray { {{4, 6}}, {{4, 6}} } };
+		RunData Expected { RunData::RowArray { {{0, 3, 7}}, {{10}} } };
+		bool const Read = Test.ReadRows(0, 2, RunData::RowFormat::Words, &Buffer[0], Buffer.size());
+		assert(!Read);
+		Compare(Test, Expected);
+	}
+
+	{
+		RunData Source { RunData::RowArray { {{0, 300, 700}}, {{2, 299, 699}}, {{1000}}, {{0, 1000}}, {{0, 1000}} } };
+		std::vector<uint8_t> Buffer;
+		Source.WriteRows(0, 5, RunData::RowFormat::Packed, Buffer);
+		assert(Buffer.size() == 20); // Rows after the first with the same run count store differences
+		RunData Test { RunData::RowArray(5, RunData::RunArray{{1000}}) };
+		bool const Read = Test.ReadRows(0, 5, RunData::RowFormat::Packed, &Buffer[0], Buffer.size());
+		assert(Read);
+		Compare(Test, Source);
+	}
+
+	{
+		RunData Source { RunData::RowArray { {{0, 3, 7}}, {{0, 4, 6}} } };
+		std::vector<uint8_t> Buffer;
+		Source.WriteRows(0, 2, RunData::RowFormat::Packed, Buffer);
+		Buffer.back() = 40; // Makes the second row too wide
+		RunData Test { RunData::RowArray { {{4, 6}}, {{4, 6}} } };
+		RunData Expected { RunData::RowArray { {{0, 3, 7}}, {{10}} } };
+		bool const Read = Test.ReadRows(0, 2, RunData::RowFormat::Packed, &Buffer[0], Buffer.size());
+		assert(!Read);
+		Compare(Test, Expected);
+	}
+
+	// Journal
+	{
+		String const Filename = "journaltest.inscribble";
+		RunData Source { RunData::RowArray { {{10}}, {{10}}, {{10}} } };
+		{
+			ChangeJournal Journal;
+			Source.Line(2, 5, 1, true);
+			Journal.Touch(1);
+			Journal.Flush(Filename, Source, CompressionMethod::BZip2);
+			Source.Line(0, 1, 2, true);
+			Journal.Touch(2);
+			Journal.Flush(Filename, Source, CompressionMethod::BZip2);
+		} // Waits for the appends to finish, and leaves the journal as a crash would
+		ChangeJournal Recovered;
+		bool const Claimed = Recovered.Claim(Filename);
+		RunData *Test = new RunData(FlatVector(10, 3));
+		bool const Replayed = Recovered.Replay(Test);
+		Recovered.Discard();
+		assert(Claimed && Replayed);
+		Compare(*Test, Source);
+		delete Test;
+	}
+
+	// Test journaling rows that are still to be flipped and shifted, without turning them in the image
+	{
+		String const Filename = "journaltest.inscribble";
+		RunData Source { RunData::RowArray { {{2, 3, 5}}, {{10}}, {{0, 1, 9}} } };
+		ChangeJournal Journal;
+		Source.FlipHorizontally();
+		Source.ShiftHorizontally(3);
+		Journal.TouchAll();
+		Journal.Flush(Filename, Source, CompressionMethod::BZip2);
+		bool const Lazy = !Source.Materialized(0) && !Source.Materialized(2);
+		RunData *Test = new RunData(FlatVector(10, 3));
+		bool const Replayed = Journal.Replay(Test);
+		Journal.Discard();
+		assert(Lazy && Replayed);
+		Source.Materialize(0, Source.Rows.size());
+		Compare(*Test, Source);
+		delete Test;
+	}
+
+	// Test that a journal in use isn't offered to other sessions, and that journals for unsaved images are kept apart
+	{
+		String const Filename = "journaltest.inscribble";
+		RunData Source { RunData::RowArray { {{10}}, {{10}} } };
+		RunData Untitled { RunData::RowArray { {{10}}, {{10}} } };
+		ChangeJournal Journal, Other, First, Second;
+		Source.Line(2, 5, 1, true);
+		Journal.Touch(1);
+		Journal.Flush(Filename, Source, CompressionMethod::BZip2);
+		Untitled.Line(0, 0, 1, true);
+		First.Touch(0);
+		First.Flush(String(), Untitled, CompressionMethod::BZip2);
+		Second.Touch(1);
+		Second.Flush(String(), Source, CompressionMethod::BZip2);
+		bool const Claimed = Other.Claim(Filename);
+		RunData *FirstTest = new RunData(FlatVector(10, 2)), *SecondTest = new RunData(FlatVector(10, 2));
+		bool const Replayed = First.Replay(FirstTest) && Second.Replay(SecondTest);
+		Journal.Discard();
+		First.Discard();
+		Second.Discard();
+		assert(!Claimed && Replayed);
+		Compare(*FirstTest, Untitled);
+		Compare(*SecondTest, Source);
+		delete FirstTest;
+		delete SecondTest;
+	}
+
+	// Test rows moving and compacting in the row store
+	{
+		RunData Test { RunData::RowArray { {{4000}}, {{4000}}, {{4000}} } };
+		RunData::RunArray ExpectedRow;
+		for (unsigned int Dot = 0; Dot < 1500; ++Dot)
+		{
+			for (unsigned int Row = 0; Row < 3; ++Row)
+				Test.Line(Dot * 2 + 1, Dot * 2 + 2, Row, true);
+			ExpectedRow.push_back(1);
+			ExpectedRow.push_back(1);
+		}
+		ExpectedRow.push_back(1000);
+		RunData Expected { RunData::RowArray { ExpectedRow, ExpectedRow, ExpectedRow } };
+		Compare(Test, Expected);
+		Test.Rows.Compact();
+		Compare(Test, Expected);
+	}
+
+	// Test rows growing past their slots while the row store compacts
+	{
+		RunData Test { RunData::RowArray { {{10000}}, {{10000}}, {{10000}} } };
+		RunData::RunArray Grown[2];
+		for (unsigned int Count = 1000; Count < 5000; Count += Count / 2 + 3) // Just past each slot's capacity
+			for (unsigned int Row = 0; Row < 2; ++Row)
+			{
+				Grown[Row].assign(Count, 1);
+				Grown[Row].back() = 10000 - (Count - 1);
+				Test.Rows.Assign(Row, &Grown[Row][0], Count);
+			}
+		Compare(Test, RunData { RunData::RowArray { Grown[0], Grown[1], {{10000}} } });
+	}
+
+	// Test undoing and redoing a mark, which only keeps the changed runs of each row
+	{
+		RunData::RowArray const Original { {{20}}, {{5, 5, 10}}, {{3, 2, 3, 2, 10}} };
+		RunData Test { Original };
+		Mark *Undo = new Mark(Test);
+		for (unsigned int Row = 0; Row < 3; ++Row) Undo->AddLine(Row);
+		Test.Line(2, 4, 0, true);
+		Test.Line(15, 20, 1, true); // Ends the row with black, so the run counts differ by one
+		Test.Line(3, 5, 2, true); // Already black
+		Undo->Finish();
+		RunData const Marked { RunData::RowArray { {{2, 2, 16}}, {{5, 5, 5, 5}}, {{3, 2, 3, 2, 10}} } };
+		Compare(Test, Marked);
+		bool FlippedHorizontally, FlippedVertically;
+		Change *Redo = Undo->Apply(FlippedHorizontally, FlippedVertically);
+		Compare(Test, RunData { Original });
+		Change *Again = Redo->Apply(FlippedHorizontally, FlippedVertically);
+		Compare(Test, Marked);
+		delete Undo;
+		delete Redo;
+		delete Again;
+	}
+
+	// Test a mark that no longer fits its rows being refused rather than applied
+	{
+		RunData Test { RunData::RowArray { {{20}}, {{5, 5, 10}} } };
+		Mark Undo(Test);
+		Undo.AddLine(1);
+		Test.Line(15, 20, 1, true);
+		Undo.Finish();
+		RunData::RunArray const Blank { 20 };
+		Test.Rows.Assign(1, &Blank[0], Blank.size()); // Behind the mark's back
+		bool FlippedHorizontally, FlippedVertically;
+		Change *Redo = Undo.Apply(FlippedHorizontally, FlippedVertically);
+		assert(Redo == nullptr);
+		Compare(Test, RunData { RunData::RowArray { {{20}}, {{20}} } });
+	}
+
+	// Test undo and redo saying which rows they changed, so only those have to be journaled
+	{
+		RunData Test { RunData::RowArray { {{10}}, {{10}}, {{10}} } };
+		ChangeManager Changes;
+		Changes.SetLimit(1 << 20);
+		Changes.AddUndo(new VerticalFlip(Test));
+		Mark *Undo = new Mark(Test);
+		Undo->AddLine(2);
+		Test.Line(3, 5, 2, true);
+		Undo->Finish();
+		Changes.AddUndo(Undo);
+		bool FlippedHorizontally, FlippedVertically;
+		std::vector<unsigned int> UndoneRows, FlippedRows, RedoneRows;
+		bool const UndoneLimited = Changes.Undo(FlippedHorizontally, FlippedVertically, UndoneRows);
+		bool const FlippedLimited = Changes.Undo(FlippedHorizontally, FlippedVertically, FlippedRows);
+		Changes.Redo(FlippedHorizontally, FlippedVertically, FlippedRows);
+		bool const RedoneLimited = Changes.Redo(FlippedHorizontally, FlippedVertically, RedoneRows);
+		assert(UndoneLimited && !FlippedLimited && RedoneLimited);
+		assert((UndoneRows == std::vector<unsigned int>{2}) && (RedoneRows == std::vector<unsigned int>{2}));
+		Compare(Test, RunData { RunData::RowArray { {{10}}, {{10}}, {{3, 2, 5}} } });
+	}
+
+	// Test the undo history dropping the oldest levels to stay under its memory limit
+	{
+		RunData Test { RunData::RowArray { {{3, 1, 6}} } };
+		ChangeManager Changes;
+		Changes.SetLimit(200);
+		for (unsigned int Level = 0; Level < 5; ++Level)
+		{
+			if (Level % 2 == 0) Changes.AddUndo(new Shift(Test, 1, 0));
+			else Changes.AddUndo(new VerticalFlip(Test));
+		}
+		assert(Changes.UndoFootprint() == 3 * 64);
+		bool FlippedHorizontally, FlippedVertically;
+		std::vector<unsigned int> ChangedRows;
+		for (unsigned int Level = 0; Level < 3; ++Level)
+		{
+			assert(Changes.CanUndo());
+			Changes.Undo(FlippedHorizontally, FlippedVertically, ChangedRows);
+		}
+		assert(!Changes.CanUndo());
+		assert(Changes.RedoFootprint() == 3 * 64);
+		Test.Materialize(0, Test.Rows.size());
+		Compare(Test, RunData { RunData::RowArray { {{5, 1, 4}} } });
+		Changes.SetLimit(0); // Redo levels aren't dropped
+		assert(Changes.CanRedo());
+	}
+
+	// Test dropping the levels past one that was lost
+	{
+		class LostChange : public Change
+		{
+			public:
+				Change *Apply(bool &, bool &) { return nullptr; }
+				CombineResult Combine(Change *) { return CombineResult::Fail; }
+		};
+		RunData Test { RunData::RowArray { {{3, 1, 6}}, {{10}} } };
+		ChangeManager Changes;
+		Changes.SetLimit(1024);
+		Changes.AddUndo(new Shift(Test, 1, 0));
+		Changes.AddUndo(new LostChange);
+		Changes.AddUndo(new VerticalFlip(Test));
+		bool FlippedHorizontally, FlippedVertically;
+		std::vector<unsigned int> ChangedRows;
+		Changes.Undo(FlippedHorizontally, FlippedVertically, ChangedRows);
+		Changes.Undo(FlippedHorizontally, FlippedVertically, ChangedRows);
+		assert(!Changes.CanUndo());
+		assert(Changes.UndoFootprint() == 0);
+		Changes.Redo(FlippedHorizontally, FlippedVertically, ChangedRows); // The flip is still there
+		Compare(Test, RunData { RunData::RowArray { {{3, 1, 6}}, {{10}} } });
+		assert(!Changes.CanRedo());
+	}
+
+	// Test undoing marks that were frozen in the background
+	{
+		RunData::RowArray const Original { {{20}}, {{20}}, {{20}} };
+		RunData Test { Original };
+		ChangeManager Changes;
+		Changes.SetLimit(1 << 20);
+		for (unsigned int Stroke = 0; Stroke < 8; ++Stroke)
+		{
+			Mark *Undo = new Mark(Test);
+			Undo->AddLine(Stroke % 3);
+			Test.Line(Stroke * 2, Stroke * 2 + 1, Stroke % 3, true);
+			Undo->Finish();
+			Changes.AddUndo(Undo);
+		}
+		RunData const Marked { RunData::RowArray { {{0, 1, 5, 1, 5, 1, 7}}, {{2, 1, 5, 1, 5, 1, 5}}, {{4, 1, 5, 1, 9}} } };
+		Compare(Test, Marked);
+		bool FlippedHorizontally, FlippedVertically;
+		std::vector<unsigned int> ChangedRows;
+		while (Changes.CanUndo()) Changes.Undo(FlippedHorizontally, FlippedVertically, ChangedRows);
+		Compare(Test, RunData { Original });
+		while (Changes.CanRedo()) Changes.Redo(FlippedHorizontally, FlippedVertically, ChangedRows);
+		Compare(Test, Marked);
+	}
+
+	// Test undoing and redoing past marks spilled to disk, some of them more than once
+	{
+		RunData::RowArray const Original { {{100}}, {{100}}, {{100}} };
+		RunData Test { Original }, Expected { Original };
+		ChangeManager Changes;
+		Changes.SetLimit(1 << 20);
+		for (unsigned int Stroke = 0; Stroke < 40; ++Stroke)
+		{
+			Mark *Undo = new Mark(Test);
+			Undo->AddLine(Stroke % 3);
+			Test.Line(Stroke * 2, Stroke * 2 + 1, Stroke % 3, true);
+			Expected.Line(Stroke * 2, Stroke * 2 + 1, Stroke % 3, true);
+			Undo->Finish();
+			Changes.AddUndo(Undo);
+		}
+		Compare(Test, Expected);
+		bool FlippedHorizontally, FlippedVertically;
+		std::vector<unsigned int> ChangedRows;
+		for (unsigned int Level = 0; Level < 30; ++Level) Changes.Undo(FlippedHorizontally, FlippedVertically, ChangedRows);
+		for (unsigned int Level = 0; Level < 20; ++Level) Changes.Redo(FlippedHorizontally, FlippedVertically, ChangedRows);
+		while (Changes.CanUndo()) Changes.Undo(FlippedHorizontally, FlippedVertically, ChangedRows);
+		Compare(Test, RunData { Original });
+		while (Changes.CanRedo()) Changes.Redo(FlippedHorizontally, FlippedVertically, ChangedRows);
+		Compare(Test, Expected);
+	}
+
 	return 0;
 }
@@ -0,0 +1,101 @@
+// Copyright 2013 Rendaw, under the FreeBSD license (See included license.txt)
+
+#include "workerpool.h"
+
+#include <algorithm>
+#include <cassert>
+
+WorkerPool::WorkerPool(void) : Stopping(false), Task(nullptr), Parts(0), NextPart(0), Unfinished(0) {}
+
+WorkerPool::~WorkerPool(void) { SetThreadCount(1); }
+
+void WorkerPool::SetThreadCount(unsigned int Count)
+{
+	if (Count == 0) Count = std::max(1u, std::thread::hardware_concurrency());
+	if (Count == Threads.size() + 1) return;
+
+	/// Stop the old threads and start new ones
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		assert(Task == nullptr);
+		Stopping = true;
+	}
+	Wake.notify_all();
+	for (auto &Thread : Threads) Thread.join();
+	Threads.clear();
+
+	Stopping = false;
+	for (unsigned int Index = 1; Index < Count; ++Index)
+		Threads.push_back(std::thread(&WorkerPool::Work, this));
+}
+
+unsigned int WorkerPool::GetThreadCount(void) const { return Threads.size() + 1; }
+
+void WorkerPool::Run(unsigned int const &Parts, TaskFunction const &Task)
+{
+	if (Parts == 0) return;
+	if (Threads.empty() || (Parts == 1))
+	{
+		for (unsigned int Part = 0; Part < Parts; ++Part) Task(Part);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		assert(this->Task == nullptr);
+		this->Task = &Task;
+		this->Parts = Parts;
+		NextPart = 0;
+		Unfinished = Parts;
+	}
+	Wake.notify_all();
+
+	/// Help out, then wait for the stragglers
+	unsigned int Part;
+	while (TakePart(Part))
+	{
+		Task(Part);
+		FinishPart();
+	}
+
+	std::unique_lock<std::mutex> Lock(Mutex);
+	Done.wait(Lock, [this](void) { return Unfinished == 0; });
+	this->Task = nullptr;
+}
+
+void WorkerPool::Work(void)
+{
+	while (true)
+	{
+		TaskFunction const *CurrentTask;
+		unsigned int Part;
+		{
+			std::unique_lock<std::mutex> Lock(Mutex);
+			Wake.wait(Lock, [this](void) { return Stopping || ((Task != nullptr) && (NextPart < Parts)); });
+			if (Stopping) return;
+			CurrentTask = Task;
+			Part = NextPart++;
+		}
+		(*CurrentTask)(Part);
+		FinishPart();
+	}
+}
+
+bool WorkerPool::TakePart(unsigned int &Part)
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	if (NextPart >= Parts) return false;
+	Part = NextPart++;
+	return true;
+}
+
+void WorkerPool::FinishPart(void)
+{
+	bool Finished;
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		assert(Unfinished > 0);
+		Finished = --Unfinished == 0;
+	}
+	if (Finished) Done.notify_all();
+}
@@ -0,0 +1,41 @@
+// Copyright 2013 Rendaw, under the FreeBSD license (See included license.txt)
+
+#ifndef workerpool_h
+#define workerpool_h
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads that stay around between jobs, so splitting small jobs up is cheap.  One job runs at a time.
+class WorkerPool
+{
+	public:
+		typedef std::function<void(unsigned int const &Part)> TaskFunction;
+
+		WorkerPool(void);
+		~WorkerPool(void);
+
+		// Counts the calling thread.  0 uses one thread per processor, 1 does everything on the calling thread.
+		void SetThreadCount(unsigned int Count);
+		unsigned int GetThreadCount(void) const;
+
+		// Calls Task once for each part from 0 to Parts, returning once all of them are done
+		void Run(unsigned int const &Parts, TaskFunction const &Task);
+	private:
+		void Work(void);
+		bool TakePart(unsigned int &Part);
+		void FinishPart(void);
+
+		std::vector<std::thread> Threads;
+		std::mutex Mutex;
+		std::condition_variable Wake, Done;
+		bool Stopping;
+
+		TaskFunction const *Task;
+		unsigned int Parts, NextPart, Unfinished;
+};
+
+#endif